@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <assert.h>
 #include "imgproc.h"
+#include "imgproc_kernels.h"
 
 //! Given a pixel, extract its 8-bit red component (bits 24-31).
 //!
@@ -62,13 +63,14 @@ uint32_t make_pixel( uint32_t r, uint32_t g, uint32_t b, uint32_t a ) {
 }
 
 //! Compute the 1D index of a pixel given an image, row, and column.
+//! Rows are img->stride pixels apart, which may be more than the width.
 //!
 //! @param img the Image
 //! @param row the row location of the pixel
 //! @param col the column location of the pixel
 //! @return 1D location of the pixel
 uint32_t compute_index( struct Image *img, int32_t row, int32_t col ) {
-  return row*(img->width) + col;
+  return row*(img->stride) + col;
 }
 
 //! Return whether or not the pixel at a given row or column is within the ellipse
@@ -78,13 +80,9 @@ uint32_t compute_index( struct Image *img, int32_t row, int32_t col ) {
 //! @param col the column at which the pixel is located
 //! @return true or false (1 or 0) based on if the given pixel is within the defined ellipse of the image
 int is_in_ellipse (struct Image *img, int32_t row, int32_t col){
-  int a = img->width / 2;
-  int b = img->height / 2;
-
-  int x = a - col;
-  int y = b - row;
-
-  return (((10000 * x * x) / (a * a) + ((10000 * y * y) / (b * b))) <= 10000);
+  int32_t start, end;
+  kernel_ellipse_span(img->width, img->height, row, &start, &end);
+  return col >= start && col < end;
 }
 
 //! Transform the color component values in each input pixel
@@ -93,21 +91,17 @@ int is_in_ellipse (struct Image *img, int32_t row, int32_t col){
 //! (1 becomes 0, 0 becomes 1.) The alpha value of each pixel should
 //! be left unchanged.
 //!
+//! output_img may be the same Image as input_img.
+//!
 //! @param input_img pointer to the input Image
 //! @param output_img pointer to the output Image (in which the
 //!                   transformed pixels should be stored)
 void imgproc_complement( struct Image *input_img, struct Image *output_img ) {
+  // each row is contiguous, so hand whole rows to the vectorized kernel
   for (int row = 0; row < output_img->height; row++) {
-    for (int col = 0; col < output_img->width; col++) {
-      int index = compute_index(input_img, row, col);
-      output_img->data[index] = input_img->data[index]; //copies over all values
-      int stored_alpha = get_a(output_img->data[index]); //stores alpha for use later
-      output_img->data[index]  = ~(output_img->data[index]); //negates all characters, including alpha
-      int32_t negator = 255; //binary representation is 24 0's followed by 8 1's
-      negator = ~negator; //inverts bits of negator, to allow for bitwise &'ing
-      output_img->data[index] = output_img->data[index] & negator; //turns alpha into zero while preserving rest of characters
-      output_img->data[index] += stored_alpha; //re-adds original alpha value
-    }
+    uint32_t *in_row = &input_img->data[compute_index(input_img, row, 0)];
+    uint32_t *out_row = &output_img->data[compute_index(output_img, row, 0)];
+    kernel_complement(in_row, out_row, output_img->width);
   }
 }
 
@@ -118,6 +112,9 @@ void imgproc_complement( struct Image *input_img, struct Image *output_img ) {
 //! Note that this transformation can only be applied to square
 //! images (where the width and height are identical.)
 //!
+//! If input_img and output_img are the same Image, the image is
+//! transposed in place and no second pixel buffer is needed.
+//!
 //! @param input_img pointer to the input Image
 //! @param output_img pointer to the output Image (in which the
 //!                   transformed pixels should be stored)
@@ -131,13 +128,17 @@ int imgproc_transpose( struct Image *input_img, struct Image *output_img ) {
     return 0;
   }
 
-  // put transposed pixels into output_img->data
-  for (int row = 0; row < output_img->height; row++) {
-    for (int col = 0; col < output_img->width; col++) {
-      int index_in = compute_index(input_img, col, row);
-      int index_out = compute_index(output_img, row, col);
-      output_img->data[index_out] = input_img->data[index_in];
-    }
+  // distance between the starts of consecutive rows
+  uint32_t in_stride = compute_index(input_img, 1, 0);
+  uint32_t out_stride = compute_index(output_img, 1, 0);
+
+  // transpose in place if input and output are the same image,
+  // otherwise copy with the tiled kernel
+  int32_t n = input_img->width;
+  if (input_img == output_img || input_img->data == output_img->data) {
+    kernel_transpose_inplace(output_img->data, out_stride, n);
+  } else {
+    kernel_transpose(input_img->data, in_stride, output_img->data, out_stride, n, n);
   }
 
   return 1;
@@ -159,23 +160,28 @@ int imgproc_transpose( struct Image *input_img, struct Image *output_img ) {
 //!
 //!   floor( (10000*x*x) / (a*a) ) + floor( (10000*y*y) / (b*b) ) <= 10000
 //!
+//! output_img may be the same Image as input_img.
+//!
 //! @param input_img pointer to the input Image
 //! @param output_img pointer to the output Image (in which the
 //!                   transformed pixels should be stored)
 void imgproc_ellipse( struct Image *input_img, struct Image *output_img ) {
-  for (int row = 0; row < output_img->height; row++) {
-    for (int col = 0; col < output_img->width; col++) {
-      int index = compute_index(input_img, row, col);
-      if (is_in_ellipse(input_img, row, col)){
-	      output_img->data[index] = input_img->data[index];
-      }
-      else {
-	      output_img->data[index] = make_pixel(0, 0, 0, 255); //sets pixels outside of the ellipse to fully black
+  // The ellipse is symmetric about the center row b, so rows b-dy and
+  // b+dy share the same span of inside columns. Every row is covered
+  // since height <= 2*b + 1.
+  int32_t b = input_img->height / 2;
+  for (int32_t dy = 0; dy <= b; dy++) {
+    int32_t start, end;
+    kernel_ellipse_span(input_img->width, input_img->height, b - dy, &start, &end);
 
-      }
-    } 
+    int32_t rows[2] = { b - dy, b + dy };
+    int num_rows = (dy > 0 && b + dy < input_img->height) ? 2 : 1;
+    for (int i = 0; i < num_rows; i++) {
+      kernel_ellipse_row(&input_img->data[compute_index(input_img, rows[i], 0)],
+                         &output_img->data[compute_index(output_img, rows[i], 0)],
+                         input_img->width, start, end);
+    }
   }
-  return;
 }
 
 //! Transform the input image using an "emboss" effect. The pixels
@@ -205,62 +211,49 @@ void imgproc_ellipse( struct Image *input_img, struct Image *output_img ) {
 //! and blue color component values should be set to gray, and the
 //! alpha value should be left unmodified.
 //!
+//! output_img may be the same Image as input_img: rows are processed
+//! from the bottom up, so each row's upper neighbors are still
+//! unmodified when it is computed.
+//!
 //! @param input_img pointer to the input Image
 //! @param output_img pointer to the output Image (in which the
 //!                   transformed pixels should be stored)
 void imgproc_emboss( struct Image *input_img, struct Image *output_img ) {
-  // Set top row rgb values to 128
-  for (int col = 0; col < input_img->width; col++) {
-    int index = compute_index(output_img, 0, col);
-    uint32_t a = get_a(input_img->data[index]);
-    uint32_t pixel = make_pixel(128, 128, 128, a);
-    output_img->data[index] = pixel;
+  for (int row = input_img->height - 1; row >= 0; row--) {
+    uint32_t *in_row = &input_img->data[compute_index(input_img, row, 0)];
+    uint32_t *prev_row = (row > 0) ? &input_img->data[compute_index(input_img, row - 1, 0)] : NULL;
+    uint32_t *out_row = &output_img->data[compute_index(output_img, row, 0)];
+    kernel_emboss_row(in_row, prev_row, out_row, input_img->width);
   }
+}
 
-  // Set left column rgb values to 128
-  for (int row = 0; row < input_img->height; row++) {
-    int index = compute_index(output_img, row, 0);
-    uint32_t a = get_a(input_img->data[index]);
-    uint32_t pixel = make_pixel(128, 128, 128, a);
-    output_img->data[index] = pixel;
-  }
+//! In-place version of imgproc_complement: the transformed pixels
+//! replace the original ones.
+//!
+//! @param img pointer to the Image to transform
+void imgproc_complement_inplace( struct Image *img ) {
+  imgproc_complement(img, img);
+}
 
-  // calculate each pixel's value and store it in output_img->data
-  for (int row = 1; row < input_img->height; row++) {
-    for (int col = 1; col < input_img->width; col++) {
-      // get current pixel info
-      int index = compute_index(output_img, row, col);
-      uint32_t r = get_r(input_img->data[index]);
-      uint32_t g = get_g(input_img->data[index]);
-      uint32_t b = get_b(input_img->data[index]);
+//! In-place version of imgproc_transpose.
+//!
+//! @param img pointer to the Image to transform
+//! @return 1 if the transformation succeeded, or 0 if the
+//!         image width and height are not the same
+int imgproc_transpose_inplace( struct Image *img ) {
+  return imgproc_transpose(img, img);
+}
 
-      // get upper left pixel info
-      int ul_index = compute_index(output_img, row - 1, col - 1);
-      uint32_t nr = get_r(input_img->data[ul_index]);
-      uint32_t ng = get_g(input_img->data[ul_index]);
-      uint32_t nb = get_b(input_img->data[ul_index]);
+//! In-place version of imgproc_ellipse.
+//!
+//! @param img pointer to the Image to transform
+void imgproc_ellipse_inplace( struct Image *img ) {
+  imgproc_ellipse(img, img);
+}
 
-      // calculate embossed effect
-      int diffR = (int)nr - (int)r;
-      int diffG = (int)ng - (int)g;
-      int diffB = (int)nb - (int)b;
-      int diff = diffR;
-      if (abs(diffG) > abs(diff)) {
-        diff = diffG;
-      } 
-      if (abs(diffB) > abs(diff)) {
-        diff = diffB;
-      }
-      
-      // apply embossed effect
-      int val = diff + 128;
-      if (val > 255) {
-        val = 255;
-      } else if (val < 0) {
-        val = 0;
-      }
-      uint32_t pixel = make_pixel((uint32_t)val, (uint32_t)val, (uint32_t)val, get_a(input_img->data[index]));
-      output_img->data[index] = pixel;
-    }
-  }
+//! In-place version of imgproc_emboss.
+//!
+//! @param img pointer to the Image to transform
+void imgproc_emboss_inplace( struct Image *img ) {
+  imgproc_emboss(img, img);
 }
@@ -4,32 +4,106 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <sys/stat.h>
 #include "imgproc.h"
+#include "imgproc_pool.h"
+#include "imgproc_chain.h"
+#include "imgproc_batch.h"
 
 struct Transformation {
   const char *name;
-  int (*apply)( struct Image *input_img, struct Image *output_img, int argc, char **argv );
+  int (*apply)( struct Image *input_img, struct Image *output_img, struct ImgprocPool *pool, int argc, char **argv );
+  // nonzero if the transformation can write its output over its input,
+  // so no separate output image is needed
+  int in_place;
+  // the transformation as a stage of a chain
+  enum ImgprocOp op;
 };
 
-int apply_complement( struct Image *input_img, struct Image *output_img, int argc, char **argv );
-int apply_transpose( struct Image *input_img, struct Image *output_img, int argc, char **argv );
-int apply_ellipse( struct Image *input_img, struct Image *output_img, int argc, char **argv );
-int apply_emboss( struct Image *input_img, struct Image *output_img, int argc, char **argv );
+// Maximum number of stages in a chain like "complement,ellipse,emboss"
+#define MAX_CHAIN_STAGES 32
+
+int apply_complement( struct Image *input_img, struct Image *output_img, struct ImgprocPool *pool, int argc, char **argv );
+int apply_transpose( struct Image *input_img, struct Image *output_img, struct ImgprocPool *pool, int argc, char **argv );
+int apply_ellipse( struct Image *input_img, struct Image *output_img, struct ImgprocPool *pool, int argc, char **argv );
+int apply_emboss( struct Image *input_img, struct Image *output_img, struct ImgprocPool *pool, int argc, char **argv );
 
 static const struct Transformation s_transformations[] = {
-  { "complement", apply_complement },
-  { "transpose", apply_transpose },
-  { "ellipse", apply_ellipse },
-  { "emboss", apply_emboss },
-  { NULL, NULL },
+  { "complement", apply_complement, 1, IMGPROC_OP_COMPLEMENT },
+  { "transpose", apply_transpose, 1, IMGPROC_OP_TRANSPOSE },
+  { "ellipse", apply_ellipse, 1, IMGPROC_OP_ELLIPSE },
+  { "emboss", apply_emboss, 1, IMGPROC_OP_EMBOSS },
+  { NULL, NULL, 0, 0 },
 };
 
 void usage( const char *progname ) {
   fprintf( stderr, "Error: invalid command-line arguments\n" );
-  fprintf( stderr, "Usage: %s <transform> <input img> <output img> [args...]\n", progname );
+  fprintf( stderr, "Usage: %s [options] <transform>[,<transform>...] <input img> <output img> [args...]\n", progname );
+  fprintf( stderr, "       %s [options] --batch <manifest> <transform>[,<transform>...]\n", progname );
+  fprintf( stderr, "       %s [options] --batch <input dir> <transform>[,<transform>...] <output dir>\n", progname );
+  fprintf( stderr, "Options:\n"
+                   "  --batch M            process every image listed in manifest M (lines of\n"
+                   "                       <input img> <output img>), or in directory M\n"
+                   "  --threads N          number of threads to use\n"
+                   "  --level N            PNG compression level 0-9 (default 6)\n"
+                   "  --strategy S         deflate strategy: default, filtered, rle or huffman\n"
+                   "  --mem-level N        deflate memory level 1-9 (default 8)\n"
+                   "  --window-bits N      deflate window size 9-15 (default 15)\n"
+                   "  --filter F           PNG row filters: none, fast or adaptive (default)\n" );
   exit( 1 );
 }
 
+// Return the index of name in the NULL-terminated names array,
+// or -1 if it isn't there
+int find_name( const char *const *names, const char *name ) {
+  for ( int i = 0; names[i] != NULL; ++i )
+    if ( strcmp( names[i], name ) == 0 )
+      return i;
+  return -1;
+}
+
+// Parse an integer option value, which must be between min and max
+int parse_int_option( const char *progname, const char *value, int min, int max ) {
+  char *end;
+  long val = strtol( value, &end, 10 );
+  if ( *value == '\0' || *end != '\0' || val < min || val > max )
+    usage( progname );
+  return (int) val;
+}
+
+// Find the transformation whose name is the first len characters of name.
+// Returns NULL if there is no such transformation.
+const struct Transformation *find_transformation( const char *name, size_t len ) {
+  for ( int i = 0; s_transformations[i].name != NULL; ++i )
+    if ( strlen( s_transformations[i].name ) == len && strncmp( s_transformations[i].name, name, len ) == 0 )
+      return &s_transformations[i];
+  return NULL;
+}
+
+// Parse a comma-separated list of transformation names into chain stages.
+// Returns the number of stages, or -1 (after printing an error message)
+// if a name is unknown or there are too many stages.
+int parse_chain( const char *names, enum ImgprocOp *ops ) {
+  int num_ops = 0;
+  for ( const char *p = names; ; ) {
+    size_t len = strcspn( p, "," );
+    const struct Transformation *xform = find_transformation( p, len );
+    if ( xform == NULL ) {
+      fprintf( stderr, "Error: unknown transformation '%.*s'\n", (int) len, p );
+      return -1;
+    }
+    if ( num_ops == MAX_CHAIN_STAGES ) {
+      fprintf( stderr, "Error: too many transformations (at most %d)\n", MAX_CHAIN_STAGES );
+      return -1;
+    }
+    ops[num_ops++] = xform->op;
+    if ( p[len] == '\0' )
+      break;
+    p += len + 1;
+  }
+  return num_ops;
+}
+
 // Make a new empty image.
 // If transformation is "rgb", then the new image will
 // have width and height twice that of the input image,
@@ -52,8 +126,9 @@ struct Image *create_output_img( struct Image *input_img, const char *transforma
   // Set data to NULL for now
   out_img->data = NULL;
 
-  // Attempt to initialize the Image object by calling img_init
-  if ( img_init( out_img, out_w, out_h ) != IMG_SUCCESS ) {
+  // Attempt to initialize the Image object (in the same pixel
+  // format as the input image) by calling img_init_format
+  if ( img_init_format( out_img, out_w, out_h, input_img->format ) != IMG_SUCCESS ) {
     free( out_img );
     return NULL;
   }
@@ -62,6 +137,38 @@ struct Image *create_output_img( struct Image *input_img, const char *transforma
   return out_img;
 }
 
+// Process a batch of images (see imgproc_batch.h) listed in a manifest
+// file, or every image in a directory if source is one. Returns the
+// exit status for main.
+int run_batch( const char *progname, const char *source, const char *transformation, const char *output_dir,
+               struct ImgprocPool *pool, const struct ImgWriteOptions *write_opts ) {
+  struct stat st;
+  int is_dir = stat( source, &st ) == 0 && S_ISDIR( st.st_mode );
+  if ( is_dir != ( output_dir != NULL ) )
+    usage( progname );
+
+  enum ImgprocOp ops[MAX_CHAIN_STAGES];
+  int num_ops = parse_chain( transformation, ops );
+  if ( num_ops < 0 )
+    return 1;
+
+  struct ImgprocBatchList list;
+  imgproc_batch_list_init( &list );
+  int success = is_dir ? imgproc_batch_list_read_dir( &list, source, output_dir )
+                       : imgproc_batch_list_read_manifest( &list, source );
+  if ( success ) {
+    int failed = imgproc_batch_run( pool, &list, ops, num_ops, write_opts, 0 );
+    if ( failed < 0 )
+      fprintf( stderr, "Error: couldn't start batch\n" );
+    else if ( failed > 0 )
+      fprintf( stderr, "Error: %d of %d images failed\n", failed, list.num_images );
+    success = failed == 0;
+  }
+
+  imgproc_batch_list_cleanup( &list );
+  return success ? 0 : 1;
+}
+
 // Free memory allocated to given Image object
 void cleanup_image( struct Image *img ) {
   if ( img != NULL ) {
@@ -71,91 +178,174 @@ void cleanup_image( struct Image *img ) {
 }
 
 int main( int argc, char **argv ) {
+  const char *progname = argv[0];
+  int num_threads = 1;
+  const char *batch_source = NULL;
+  struct ImgWriteOptions write_opts;
+  img_write_options_init( &write_opts );
+
+  // names of the IMG_STRATEGY_* and IMG_FILTER_* values
+  static const char *const strategies[] = { "default", "filtered", "huffman", "rle", NULL };
+  static const char *const filters[] = { "none", "fast", "adaptive", NULL };
+
+  // Parse options preceding the transformation name
+  while ( argc > 1 && strncmp( argv[1], "--", 2 ) == 0 ) {
+    const char *opt = argv[1], *value = argv[2];
+    if ( argc < 3 )
+      usage( progname );
+    if ( strcmp( opt, "--batch" ) == 0 ) {
+      batch_source = value;
+    } else if ( strcmp( opt, "--threads" ) == 0 ) {
+      num_threads = parse_int_option( progname, value, 1, 1024 );
+    } else if ( strcmp( opt, "--level" ) == 0 ) {
+      write_opts.level = parse_int_option( progname, value, 0, 9 );
+    } else if ( strcmp( opt, "--strategy" ) == 0 ) {
+      if ( ( write_opts.strategy = find_name( strategies, value ) ) < 0 )
+        usage( progname );
+    } else if ( strcmp( opt, "--mem-level" ) == 0 ) {
+      write_opts.mem_level = parse_int_option( progname, value, 1, 9 );
+    } else if ( strcmp( opt, "--window-bits" ) == 0 ) {
+      write_opts.window_bits = parse_int_option( progname, value, 9, 15 );
+    } else if ( strcmp( opt, "--filter" ) == 0 ) {
+      if ( ( write_opts.filter = find_name( filters, value ) ) < 0 )
+        usage( progname );
+    } else {
+      usage( progname );
+    }
+    argc -= 2;
+    argv += 2;
+  }
+  argv[0] = (char *) progname;
+
+  if ( batch_source != NULL ) {
+    // the transformation, and the output directory if the source is one
+    if ( argc != 2 && argc != 3 )
+      usage( progname );
+
+    // the pool's threads each work on one image at a time
+    struct ImgprocPool *pool = NULL;
+    if ( num_threads > 1 ) {
+      pool = imgproc_pool_create( num_threads );
+      if ( pool == NULL )
+        fprintf( stderr, "Warning: couldn't start %d threads, running single-threaded\n", num_threads );
+    }
+    int status = run_batch( progname, batch_source, argv[1], argc == 3 ? argv[2] : NULL, pool, &write_opts );
+    imgproc_pool_destroy( pool );
+    return status;
+  }
+
   if ( argc < 4 )
-    usage( argv[0] );
+    usage( progname );
 
   const char *transformation = argv[1];
   const char *input_filename = argv[2];
   const char *output_filename = argv[3];
 
+  // A comma-separated list of transformations is run as a chain,
+  // entirely in memory. Unknown names are reported before anything
+  // is read or allocated.
+  int is_chain = strchr( transformation, ',' ) != NULL;
+  enum ImgprocOp ops[MAX_CHAIN_STAGES];
+  int num_ops = 0;
+  const struct Transformation *xform = NULL;
+  if ( is_chain ) {
+    if ( ( num_ops = parse_chain( transformation, ops ) ) < 0 )
+      return 1;
+  } else if ( ( xform = find_transformation( transformation, strlen( transformation ) ) ) == NULL ) {
+    fprintf( stderr, "Error: unknown transformation '%s'\n", transformation );
+    return 1;
+  }
+
   // Allocate and read the input image
   struct Image *input_img = (struct Image *) malloc( sizeof( struct Image ) );
   if ( input_img == NULL ) {
     fprintf( stderr, "Error: couldn't allocate input image\n" );
     exit( 1 );
   }
-  if ( img_read( input_filename, input_img ) != IMG_SUCCESS ) {
+  // Truecolor images without alpha are kept in RGB24 form, so the
+  // transformations and the writer never touch an alpha channel
+  if ( img_read_native( input_filename, input_img ) != IMG_SUCCESS ) {
     fprintf( stderr, "Error: couldn't read input image\n" );
     free( input_img );
     return 1;
   }
 
-  // Create output Image object
-  struct Image *output_img = create_output_img( input_img, transformation );
-  if ( output_img == NULL ) {
-    fprintf( stderr, "Error: couldn't create output image object\n" );
-    cleanup_image( input_img );
-    return 1;
+  // Create output Image object, unless the transformation can
+  // overwrite the input image (chains always do)
+  struct Image *output_img;
+  if ( is_chain || xform->in_place ) {
+    output_img = input_img;
+  } else {
+    output_img = create_output_img( input_img, transformation );
+    if ( output_img == NULL ) {
+      fprintf( stderr, "Error: couldn't create output image object\n" );
+      cleanup_image( input_img );
+      return 1;
+    }
   }
 
-  // find transformation
-  const struct Transformation *xform = NULL;
-  for ( int i = 0; s_transformations[i].name != NULL; ++i )
-    if ( strcmp( s_transformations[i].name, transformation ) == 0 ) {
-      xform = &s_transformations[i];
-      break;
-    }
+  // Start worker threads if more than one thread was requested
+  struct ImgprocPool *pool = NULL;
+  if ( num_threads > 1 ) {
+    pool = imgproc_pool_create( num_threads );
+    if ( pool == NULL )
+      fprintf( stderr, "Warning: couldn't start %d threads, running single-threaded\n", num_threads );
+  }
 
   int success;
 
-  if ( xform != NULL ) {
-    // apply the transformation!
-    success = xform->apply( input_img, output_img, argc, argv ) != 0;
+  if ( is_chain ) {
+    success = imgproc_chain( pool, ops, num_ops, input_img );
+    if ( !success )
+      fprintf( stderr, "Error: transformation chain failed\n" );
   } else {
-    fprintf( stderr, "Error: unknown transformation '%s'\n", transformation );
-    success = 0;
+    // apply the transformation!
+    success = xform->apply( input_img, output_img, pool, argc, argv ) != 0;
   }
 
   if ( success ) {
-    // Write output image
-    if ( img_write( output_filename, output_img ) != IMG_SUCCESS ) {
+    // Write output image, deflating bands of rows on the pool's threads
+    write_opts.pool = pool;
+    if ( img_write_with_options( output_filename, output_img, &write_opts ) != IMG_SUCCESS ) {
       fprintf( stderr, "Error: couldn't write output image\n" );
       success = false;
     }
   }
 
+  imgproc_pool_destroy( pool );
+  if ( output_img != input_img )
+    cleanup_image( output_img );
   cleanup_image( input_img );
-  cleanup_image( output_img );
 
   return success ? 0 : 1;
 }
 
-int apply_complement( struct Image *input_img, struct Image *output_img, int argc, char **argv ) {
+int apply_complement( struct Image *input_img, struct Image *output_img, struct ImgprocPool *pool, int argc, char **argv ) {
   (void) argc;
   (void) argv;
-  imgproc_complement( input_img, output_img );
+  imgproc_complement_mt( pool, input_img, output_img );
   return 1;
 }
 
-int apply_transpose( struct Image *input_img, struct Image *output_img, int argc, char **argv ) {
+int apply_transpose( struct Image *input_img, struct Image *output_img, struct ImgprocPool *pool, int argc, char **argv ) {
   (void) argc;
   (void) argv;
-  int success = imgproc_transpose( input_img,  output_img );
+  int success = imgproc_transpose_mt( pool, input_img, output_img );
   if ( !success )
     fprintf( stderr, "Error: transpose transformation failed\n" );
   return success;
 }
 
-int apply_ellipse( struct Image *input_img, struct Image *output_img, int argc, char **argv ) {
+int apply_ellipse( struct Image *input_img, struct Image *output_img, struct ImgprocPool *pool, int argc, char **argv ) {
   (void) argc;
   (void) argv;
-  imgproc_ellipse( input_img,  output_img );
+  imgproc_ellipse_mt( pool, input_img, output_img );
   return 1;
 }
 
-int apply_emboss( struct Image *input_img, struct Image *output_img, int argc, char **argv ) {
+int apply_emboss( struct Image *input_img, struct Image *output_img, struct ImgprocPool *pool, int argc, char **argv ) {
   (void) argc;
   (void) argv;
-  imgproc_emboss( input_img,  output_img );
+  imgproc_emboss_mt( pool, input_img, output_img );
   return 1;
 }
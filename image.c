@@ -1,50 +1,137 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "pnglite.h"
 #include "image.h"
-
-int png_init_called;
+#include "imgproc_kernels.h"
+#include "imgproc_pool.h"
+#include "imgproc_buffers.h"
+
+// img_write_with_options passes the IMG_STRATEGY_* and IMG_FILTER_*
+// values straight to pnglite
+_Static_assert(IMG_STRATEGY_DEFAULT == PNG_STRATEGY_DEFAULT && IMG_STRATEGY_FILTERED == PNG_STRATEGY_FILTERED &&
+               IMG_STRATEGY_HUFFMAN == PNG_STRATEGY_HUFFMAN_ONLY && IMG_STRATEGY_RLE == PNG_STRATEGY_RLE,
+               "IMG_STRATEGY_* values differ from PNG_STRATEGY_*");
+_Static_assert(IMG_FILTER_NONE == PNG_FILTER_MODE_NONE && IMG_FILTER_FAST == PNG_FILTER_MODE_FAST &&
+               IMG_FILTER_ADAPTIVE == PNG_FILTER_MODE_ADAPTIVE,
+               "IMG_FILTER_* values differ from PNG_FILTER_MODE_*");
+
+// Images are only deflated in parallel if every band of rows gets at
+// least this much pixel data; smaller bands aren't worth a thread
+#define PARALLEL_DEFLATE_MIN_BAND_BYTES (1 << 20)
+
+// pnglite is set up on first use; images may be read and written on
+// several threads at once (see imgproc_batch.h), hence pthread_once
+static pthread_once_t png_init_once = PTHREAD_ONCE_INIT;
+
+static void init_pnglite(void) {
+  png_init(imgproc_buffer_alloc, imgproc_buffer_free);
+}
 
 int is_little_endian(void) {
   int32_t x = 1;
   return *((char *) &x) == 1;
 }
 
-uint32_t byteswap(uint32_t val) {
-  const uint8_t *p = (const uint8_t *) &val;
-  uint32_t result = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
-  return result;
+int img_init(struct Image *img, int32_t width, int32_t height) {
+  return img_init_format(img, width, height, IMG_FORMAT_RGBA32);
 }
 
-int img_init(struct Image *img, int32_t width, int32_t height) {
-  int num_pixels = width * height;
+// Number of pixels between the starts of rows of the given width: the
+// width rounded up so that a row is a multiple of IMG_ROW_ALIGN bytes.
+// A 3 byte pixel needs IMG_ROW_ALIGN pixels for that, a 4 byte pixel
+// IMG_ROW_ALIGN/4. Returns -1 if the stride doesn't fit in an int32_t.
+static int32_t row_stride(int32_t width, size_t bpp) {
+  int64_t unit = (bpp % 4 == 0) ? IMG_ROW_ALIGN / 4 : IMG_ROW_ALIGN;
+  int64_t stride = ((int64_t) width + unit - 1) / unit * unit;
+  return (stride > INT32_MAX) ? -1 : (int32_t) stride;
+}
 
-  uint32_t *pixel_data = (uint32_t *) malloc(num_pixels * sizeof(uint32_t));
-  if (pixel_data == NULL) {
-    return IMG_ERR_MALLOC_FAILED;
+// Allocate the (uninitialized) pixel data of an image from the buffer
+// cache, whose buffers are aligned to IMG_ROW_ALIGN bytes. Returns NULL
+// if there is not enough memory.
+static uint32_t *alloc_pixels(int32_t width, int32_t height, size_t bpp, int32_t *stride) {
+  *stride = row_stride(width, bpp);
+  if (*stride < 0) {
+    return NULL;
+  }
+  return (uint32_t *) imgproc_buffer_alloc((size_t) *stride * bpp * height);
+}
+
+int img_init_format(struct Image *img, int32_t width, int32_t height, int32_t format) {
+  int rc = img_init_uninitialized(img, width, height, format);
+  if (rc != IMG_SUCCESS) {
+    return rc;
   }
 
-  // initialize every pixel to opaque black
-  for (int32_t i = 0; i < num_pixels; i++) {
-    pixel_data[i] = 0x000000FFU;
+  // the padding at the end of each row is initialized too
+  size_t num_pixels = (size_t) img->stride * height;
+  if (format == IMG_FORMAT_RGB24) {
+    // opaque black is all zero bytes when there is no alpha channel
+    memset(img->data, 0, num_pixels * 3);
+  } else {
+    // initialize every pixel to opaque black
+    kernel_fill(img->data, num_pixels, 0x000000FFU);
+  }
+  return IMG_SUCCESS;
+}
+
+int img_init_uninitialized(struct Image *img, int32_t width, int32_t height, int32_t format) {
+  size_t bpp = (format == IMG_FORMAT_RGB24) ? 3 : 4;
+  int32_t stride;
+
+  uint32_t *pixel_data = alloc_pixels(width, height, bpp, &stride);
+  if (pixel_data == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
   }
 
   // success
   img->width = width;
   img->height = height;
   img->data = pixel_data;
+  img->format = format;
+  img->stride = stride;
+  img->alloc = IMG_ALLOC_CACHE;
   return IMG_SUCCESS;
 }
 
-int img_read(const char *filename, struct Image *img) {
-  if (!png_init_called) {
-    png_init(0, 0);
-    png_init_called = 1;
-  }
+int img_bytes_per_pixel(const struct Image *img) {
+  return (img->format == IMG_FORMAT_RGB24) ? 3 : 4;
+}
+
+size_t img_row_bytes(const struct Image *img) {
+  return (size_t) img->stride * img_bytes_per_pixel(img);
+}
+
+// png_convert_row_t expanding a decoded RGB scanline to RGBA32 pixels
+static void rgb_to_rgba_row(const unsigned char *in, unsigned char *out, unsigned width) {
+  kernel_rgb_to_rgba(in, (uint32_t *) out, width);
+}
+
+// png_convert_row_t storing a decoded RGBA scanline as RGBA32 pixels.
+// pnglite's scanline buffer is malloc'ed, so it can be read as uint32_t.
+static void png_to_rgba_row(const unsigned char *in, unsigned char *out, unsigned width) {
+  kernel_byteswap((const uint32_t *) in, out, width);
+}
+
+// png_convert_row_t storing a row of RGBA32 pixels in PNG byte order
+static void byteswap_row(const unsigned char *in, unsigned char *out, unsigned width) {
+  kernel_byteswap((const uint32_t *) in, out, width);
+}
+
+// Read a PNG file. If keep_rgb is nonzero, truecolor images are
+// stored as IMG_FORMAT_RGB24, otherwise they are expanded to RGBA.
+static int read_png(const char *filename, struct Image *img, int keep_rgb) {
+  pthread_once(&png_init_once, init_pnglite);
 
   png_t png;
 
-  if (png_open_file_read(&png, filename) != PNG_NO_ERROR) {
+  if (png_open_file_mmap(&png, filename) != PNG_NO_ERROR) {
     return IMG_ERR_COULD_NOT_OPEN;
   }
 
@@ -55,103 +142,598 @@ int img_read(const char *filename, struct Image *img) {
     return IMG_ERR_NOT_TRUECOLOR;
   }
   
-  int num_pixels = png.width * png.height;
+  int32_t format = IMG_FORMAT_RGBA32;
+  size_t bpp = sizeof(uint32_t);
+  png_convert_row_t convert = NULL;
+
+  if (png.color_type == PNG_TRUECOLOR && keep_rgb) {
+    // the PNG pixel data is exactly the RGB24 layout
+    format = IMG_FORMAT_RGB24;
+    bpp = 3;
+  } else if (png.color_type == PNG_TRUECOLOR) {
+    // PNG pixel data is in RGB form, each row is expanded to add
+    // the alpha channel as it is decoded
+    convert = rgb_to_rgba_row;
+  } else if (is_little_endian()) {
+    // the RGBA data is in big-endian form, so on a little endian
+    // system each row is byteswapped as it is decoded
+    convert = png_to_rgba_row;
+  }
 
-  // allocate buffer for pixel data in truecolor RGBA format
-  uint32_t *pixel_data = (uint32_t *) malloc(num_pixels * sizeof(uint32_t));
+  int32_t stride;
+  uint32_t *pixel_data = alloc_pixels(png.width, png.height, bpp, &stride);
+  if (pixel_data == NULL) {
+    png_close_file(&png);
+    return IMG_ERR_MALLOC_FAILED;
+  }
 
-  if (png.color_type == PNG_TRUECOLOR) {
-    // PNG pixel data is in RGB form, expand it to add the alpha channel
+  // scanlines are decoded straight into the rows of pixel_data
+  int rc;
+  unsigned rows;
+  unsigned char *dest = (unsigned char *) pixel_data;
+  size_t row_bytes = (size_t) stride * bpp;
+  do {
+    rc = png_read_rows_convert(&png, dest, png.height, row_bytes, convert, &rows);
+    dest += rows * row_bytes;
+  } while (rc == PNG_NO_ERROR);
+
+  if (rc != PNG_DONE) {
+    png_close_file(&png);
+    imgproc_buffer_free(pixel_data);
+    return IMG_ERR_MALLOC_FAILED;
+  }
 
-    unsigned char *pixel_data_raw = (unsigned char *) malloc(num_pixels * 3);
-    if (png_get_data(&png, pixel_data_raw) != PNG_NO_ERROR) {
-      png_close_file(&png);
-      free(pixel_data);
-      return IMG_ERR_MALLOC_FAILED;
-    }
+  // communicate pixel data and image dimensions to caller
+  img->data = pixel_data;
+  img->width = png.width;
+  img->height = png.height;
+  img->format = format;
+  img->stride = stride;
+  img->alloc = IMG_ALLOC_CACHE;
+
+  png_close_file(&png);
+
+  return IMG_SUCCESS;
+}
 
-    for (int i = 0; i < num_pixels; i++) {
-      unsigned char r = pixel_data_raw[i*3 + 0];
-      unsigned char g = pixel_data_raw[i*3 + 1];
-      unsigned char b = pixel_data_raw[i*3 + 2];
-      unsigned char a = 255;
+// Raw formats. Binary PAM stores 8 bit R, G, B (, A) bytes, so the
+// rows of an RGB PAM file are the IMG_FORMAT_RGB24 layout without the
+// row padding. farbfeld stores 16 bit big-endian R, G, B, A values.
+// Both are interchange formats other programs read, and are copied
+// into (and out of) the Image a row at a time.
+//
+// The native format (*.imgraw) is for images passed between stages of
+// a pipeline on one machine: after a header of NATIVE_HEADER_BYTES it
+// holds the pixel data exactly as a struct Image does in memory, row
+// padding and byte order included, so img_read_native maps the file
+// and hands the mapping out as the image data without copying it.
+enum FileType { FILE_TYPE_PNG, FILE_TYPE_PAM, FILE_TYPE_FARBFELD, FILE_TYPE_NATIVE };
+
+#define NATIVE_MAGIC "imgraw\0\1"
+#define NATIVE_BYTE_ORDER 0x01020304U
+// a whole IMG_ROW_ALIGN block, so the mapped rows stay aligned
+#define NATIVE_HEADER_BYTES IMG_ROW_ALIGN
+
+// Start of a native file, in this machine's byte order (the rest of
+// the header is zero)
+struct NativeHeader {
+  char magic[8];
+  uint32_t byte_order;  // NATIVE_BYTE_ORDER as written by this machine
+  int32_t width;
+  int32_t height;
+  int32_t format;
+  int32_t stride;       // always row_stride(width, bytes per pixel)
+};
+
+// Rows are converted through a scratch buffer of about this size
+#define RAW_BATCH_BYTES (256 * 1024)
+
+// Choose the file format by the extension of filename
+static enum FileType file_type(const char *filename) {
+  const char *ext = strrchr(filename, '.');
+  if (ext == NULL || strchr(ext, '/') != NULL)
+    return FILE_TYPE_PNG;
+  if (strcmp(ext, ".pam") == 0)
+    return FILE_TYPE_PAM;
+  if (strcmp(ext, ".ff") == 0 || strcmp(ext, ".farbfeld") == 0)
+    return FILE_TYPE_FARBFELD;
+  if (strcmp(ext, ".imgraw") == 0)
+    return FILE_TYPE_NATIVE;
+  return FILE_TYPE_PNG;
+}
+
+// Scale the big-endian 16 bit value at p to the nearest 8 bit value
+// (so v*257, as written below, comes back as v)
+static inline uint32_t farbfeld_to_8bit(const unsigned char *p) {
+  uint32_t v = ((uint32_t) p[0] << 8) | p[1];
+  return (v * 255 + 32767) / 65535;
+}
+
+// png_convert_row_t storing a farbfeld row as RGBA32 pixels, rounding
+// each 16 bit value to 8 bits
+static void farbfeld_to_rgba_row(const unsigned char *in, unsigned char *out, unsigned width) {
+  uint32_t *pixels = (uint32_t *) out;
+  for (unsigned i = 0; i < width; i++) {
+    const unsigned char *p = in + 8 * i;
+    pixels[i] = (farbfeld_to_8bit(p) << 24) | (farbfeld_to_8bit(p + 2) << 16) |
+                (farbfeld_to_8bit(p + 4) << 8) | farbfeld_to_8bit(p + 6);
+  }
+}
 
-      pixel_data[i] = (r << 24) | (g << 16) | (b << 8) | a;
+// png_convert_row_t storing RGBA32 pixels as a farbfeld row, scaling
+// each 8 bit value v to the 16 bit value v*257
+static void rgba_to_farbfeld_row(const unsigned char *in, unsigned char *out, unsigned width) {
+  const uint32_t *pixels = (const uint32_t *) in;
+  for (unsigned i = 0; i < width; i++) {
+    for (int c = 0; c < 4; c++) {
+      unsigned char v = (unsigned char) (pixels[i] >> (24 - 8 * c));
+      out[8 * i + 2 * c] = v;
+      out[8 * i + 2 * c + 1] = v;
     }
+  }
+}
 
-    free(pixel_data_raw);
-  } else {
-    // PNG pixel data is already in the correct format,
-    // except that the RGBA data is in big-endian form, so we
-    // need to byteswap if on a little endian system
-    if (png_get_data(&png, (unsigned char *) pixel_data) != PNG_NO_ERROR) {
-      png_close_file(&png);
-      free(pixel_data);
-      return IMG_ERR_MALLOC_FAILED;
+// Same as rgba_to_farbfeld_row, for RGB24 pixels (which are opaque)
+static void rgb_to_farbfeld_row(const unsigned char *in, unsigned char *out, unsigned width) {
+  for (unsigned i = 0; i < width; i++) {
+    for (int c = 0; c < 4; c++) {
+      unsigned char v = (c < 3) ? in[3 * i + c] : 255;
+      out[8 * i + 2 * c] = v;
+      out[8 * i + 2 * c + 1] = v;
     }
+  }
+}
+
+// Read height rows of in_row_bytes each from fp into data, whose rows
+// start out_row_bytes apart. Each row is passed through convert, or
+// read straight into data if convert is NULL. Returns 1 if successful.
+static int read_raw_rows(FILE *fp, unsigned char *data, uint32_t width, uint32_t height,
+                         size_t in_row_bytes, size_t out_row_bytes, png_convert_row_t convert) {
+  if (convert == NULL) {
+    uint32_t row = 0;
+    while (row < height && fread(data + (size_t) row * out_row_bytes, in_row_bytes, 1, fp) == 1)
+      row++;
+    return row == height;
+  }
+
+  size_t batch = RAW_BATCH_BYTES / in_row_bytes + 1;
+  unsigned char *buf = (unsigned char *) imgproc_buffer_alloc(batch * in_row_bytes);
+  if (buf == NULL)
+    return 0;
+
+  uint32_t row = 0;
+  while (row < height) {
+    size_t n = (height - row < batch) ? height - row : batch;
+    if (fread(buf, in_row_bytes, n, fp) != n)
+      break;
+    for (size_t i = 0; i < n; i++, row++)
+      convert(buf + i * in_row_bytes, data + (size_t) row * out_row_bytes, width);
+  }
+
+  imgproc_buffer_free(buf);
+  return row == height;
+}
+
+// The reverse of read_raw_rows: write height rows of data (in_row_bytes
+// apart) to fp as rows of out_row_bytes, each passed through convert
+// unless it is NULL. Returns 1 if successful.
+static int write_raw_rows(FILE *fp, const unsigned char *data, uint32_t width, uint32_t height,
+                          size_t in_row_bytes, size_t out_row_bytes, png_convert_row_t convert) {
+  if (convert == NULL) {
+    uint32_t row = 0;
+    while (row < height && fwrite(data + (size_t) row * in_row_bytes, out_row_bytes, 1, fp) == 1)
+      row++;
+    return row == height;
+  }
+
+  size_t batch = RAW_BATCH_BYTES / out_row_bytes + 1;
+  unsigned char *buf = (unsigned char *) imgproc_buffer_alloc(batch * out_row_bytes);
+  if (buf == NULL)
+    return 0;
+
+  uint32_t row = 0;
+  while (row < height) {
+    size_t n = (height - row < batch) ? height - row : batch;
+    for (size_t i = 0; i < n; i++)
+      convert(data + (size_t) (row + i) * in_row_bytes, buf + i * out_row_bytes, width);
+    if (fwrite(buf, out_row_bytes, n, fp) != n)
+      break;
+    row += n;
+  }
+
+  imgproc_buffer_free(buf);
+  return row == height;
+}
+
+// Parse a PAM header, leaving fp at the first byte of pixel data.
+// Returns IMG_SUCCESS or an IMG_ERR_* value.
+static int read_pam_header(FILE *fp, uint32_t *width, uint32_t *height, int *depth) {
+  char line[256];
+  long w = -1, h = -1, d = -1, maxval = -1;
+  char tupltype[64] = "";
+
+  if (fgets(line, sizeof(line), fp) == NULL || strcmp(line, "P7\n") != 0)
+    return IMG_ERR_COULD_NOT_OPEN;
+
+  for (;;) {
+    char key[64];
+    if (fgets(line, sizeof(line), fp) == NULL)
+      return IMG_ERR_COULD_NOT_OPEN;
+    if (line[0] == '#' || line[0] == '\n')
+      continue;
+    if (strcmp(line, "ENDHDR\n") == 0)
+      break;
+    if (sscanf(line, "%63s", key) != 1)
+      return IMG_ERR_COULD_NOT_OPEN;
+    if (strcmp(key, "WIDTH") == 0)
+      sscanf(line, "%*s %ld", &w);
+    else if (strcmp(key, "HEIGHT") == 0)
+      sscanf(line, "%*s %ld", &h);
+    else if (strcmp(key, "DEPTH") == 0)
+      sscanf(line, "%*s %ld", &d);
+    else if (strcmp(key, "MAXVAL") == 0)
+      sscanf(line, "%*s %ld", &maxval);
+    else if (strcmp(key, "TUPLTYPE") == 0)
+      sscanf(line, "%*s %63s", tupltype);
+  }
 
-    if (is_little_endian()) {
-      for (int i = 0; i < num_pixels; i++) {
-        pixel_data[i] = byteswap(pixel_data[i]);
-      }
+  if (w <= 0 || h <= 0 || w > INT32_MAX || h > INT32_MAX)
+    return IMG_ERR_COULD_NOT_OPEN;
+
+  // only 8 bit RGB and RGBA tuples are supported
+  if (maxval != 255 ||
+      !((d == 3 && (tupltype[0] == '\0' || strcmp(tupltype, "RGB") == 0)) ||
+        (d == 4 && strcmp(tupltype, "RGB_ALPHA") == 0)))
+    return IMG_ERR_NOT_TRUECOLOR;
+
+  *width = (uint32_t) w;
+  *height = (uint32_t) h;
+  *depth = (int) d;
+  return IMG_SUCCESS;
+}
+
+// Read a PAM or farbfeld file. keep_rgb is as for read_png.
+static int read_raw(const char *filename, struct Image *img, int keep_rgb, enum FileType type) {
+  FILE *fp = fopen(filename, "rb");
+  if (fp == NULL)
+    return IMG_ERR_COULD_NOT_OPEN;
+
+  uint32_t width = 0, height = 0;
+  size_t in_bpp;
+  int rc = IMG_SUCCESS;
+  int32_t format = IMG_FORMAT_RGBA32;
+  png_convert_row_t convert = NULL;
+
+  if (type == FILE_TYPE_PAM) {
+    int depth;
+    rc = read_pam_header(fp, &width, &height, &depth);
+    in_bpp = (size_t) depth;
+    if (depth == 3 && keep_rgb) {
+      // the file holds exactly the RGB24 layout
+      format = IMG_FORMAT_RGB24;
+    } else if (depth == 3) {
+      convert = rgb_to_rgba_row;
+    } else if (is_little_endian()) {
+      convert = png_to_rgba_row;
+    }
+  } else {
+    unsigned char header[16];
+    if (fread(header, 1, 16, fp) != 16 || memcmp(header, "farbfeld", 8) != 0) {
+      rc = IMG_ERR_COULD_NOT_OPEN;
+    } else {
+      width = ((uint32_t) header[8] << 24) | (header[9] << 16) | (header[10] << 8) | header[11];
+      height = ((uint32_t) header[12] << 24) | (header[13] << 16) | (header[14] << 8) | header[15];
+      if (width == 0 || height == 0 || width > INT32_MAX || height > INT32_MAX)
+        rc = IMG_ERR_COULD_NOT_OPEN;
     }
+    in_bpp = 8;
+    convert = farbfeld_to_rgba_row;
+  }
+
+  uint32_t *pixel_data = NULL;
+  int32_t stride = 0;
+  size_t out_row_bytes = 0;
+  if (rc == IMG_SUCCESS) {
+    size_t out_bpp = (format == IMG_FORMAT_RGB24) ? 3 : 4;
+    pixel_data = alloc_pixels((int32_t) width, (int32_t) height, out_bpp, &stride);
+    out_row_bytes = (size_t) stride * out_bpp;
+    if (pixel_data == NULL)
+      rc = IMG_ERR_MALLOC_FAILED;
+  }
+
+  if (rc == IMG_SUCCESS &&
+      !read_raw_rows(fp, (unsigned char *) pixel_data, width, height, width * in_bpp, out_row_bytes, convert)) {
+    rc = IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  fclose(fp);
+
+  if (rc != IMG_SUCCESS) {
+    imgproc_buffer_free(pixel_data);
+    return rc;
   }
 
-  // communicate pixel data and image dimensions to caller
   img->data = pixel_data;
-  img->width = png.width;
-  img->height = png.height;
+  img->width = (int32_t) width;
+  img->height = (int32_t) height;
+  img->format = format;
+  img->stride = stride;
+  img->alloc = IMG_ALLOC_CACHE;
+  return IMG_SUCCESS;
+}
 
-  png_close_file(&png);
+// Write a PAM or farbfeld file
+static int write_raw(const char *filename, struct Image *img, enum FileType type) {
+  FILE *fp = fopen(filename, "wb");
+  if (fp == NULL)
+    return IMG_ERR_COULD_NOT_OPEN;
+
+  int rgb = (img->format == IMG_FORMAT_RGB24);
+  size_t in_row_bytes = img_row_bytes(img);
+  size_t out_bpp;
+  png_convert_row_t convert = NULL;
+  int ok;
+
+  if (type == FILE_TYPE_PAM) {
+    char header[256];
+    int len = snprintf(header, sizeof(header), "P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL 255\nTUPLTYPE %s\nENDHDR\n",
+                       img->width, img->height, rgb ? 3 : 4, rgb ? "RGB" : "RGB_ALPHA");
+    ok = fwrite(header, 1, len, fp) == (size_t) len;
+    out_bpp = rgb ? 3 : 4;
+    if (!rgb && is_little_endian())
+      convert = byteswap_row;
+  } else {
+    unsigned char header[16] = "farbfeld";
+    for (int i = 0; i < 4; i++) {
+      header[8 + i] = (unsigned char) ((uint32_t) img->width >> (24 - 8 * i));
+      header[12 + i] = (unsigned char) ((uint32_t) img->height >> (24 - 8 * i));
+    }
+    ok = fwrite(header, 1, 16, fp) == 16;
+    out_bpp = 8;
+    convert = rgb ? rgb_to_farbfeld_row : rgba_to_farbfeld_row;
+  }
+
+  ok = ok && write_raw_rows(fp, (const unsigned char *) img->data, img->width, img->height,
+                            in_row_bytes, img->width * out_bpp, convert);
+  ok = (fclose(fp) == 0) && ok;
+
+  return ok ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
+}
+
+// Map a native file. The pixel data is used in place, unless the file
+// holds RGB24 pixels and keep_rgb is zero, in which case they are
+// expanded into a new buffer and the mapping is released.
+static int read_native(const char *filename, struct Image *img, int keep_rgb) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return IMG_ERR_COULD_NOT_OPEN;
+
+  struct NativeHeader header;
+  struct stat st;
+  size_t bpp = 0, data_bytes = 0;
+  int rc = IMG_SUCCESS;
+  if (fstat(fd, &st) != 0 || pread(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header) ||
+      memcmp(header.magic, NATIVE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.byte_order != NATIVE_BYTE_ORDER || header.width <= 0 || header.height <= 0 ||
+      (header.format != IMG_FORMAT_RGBA32 && header.format != IMG_FORMAT_RGB24)) {
+    rc = IMG_ERR_COULD_NOT_OPEN;
+  } else {
+    // the rows must be laid out as img_init lays them out, and the file
+    // must hold all of them
+    bpp = (header.format == IMG_FORMAT_RGB24) ? 3 : 4;
+    data_bytes = (size_t) header.stride * bpp * header.height;
+    if (header.stride <= 0 || header.stride != row_stride(header.width, bpp) ||
+        (uint64_t) st.st_size < NATIVE_HEADER_BYTES + (uint64_t) data_bytes)
+      rc = IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  // a private writable mapping: transforming the image in place copies
+  // the pages it changes instead of writing to the file
+  unsigned char *base = NULL;
+  if (rc == IMG_SUCCESS) {
+    base = mmap(NULL, NATIVE_HEADER_BYTES + data_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED)
+      rc = IMG_ERR_COULD_NOT_OPEN;
+  }
+  close(fd);
+  if (rc != IMG_SUCCESS)
+    return rc;
+
+  img->width = header.width;
+  img->height = header.height;
+  img->format = header.format;
+  img->stride = header.stride;
+
+  if (header.format == IMG_FORMAT_RGB24 && !keep_rgb) {
+    int32_t stride;
+    uint32_t *pixel_data = alloc_pixels(header.width, header.height, 4, &stride);
+    if (pixel_data != NULL) {
+      for (int32_t row = 0; row < header.height; row++)
+        kernel_rgb_to_rgba(base + NATIVE_HEADER_BYTES + (size_t) row * header.stride * 3,
+                           pixel_data + (size_t) row * stride, header.width);
+    }
+    munmap(base, NATIVE_HEADER_BYTES + data_bytes);
+    if (pixel_data == NULL)
+      return IMG_ERR_MALLOC_FAILED;
+    img->data = pixel_data;
+    img->format = IMG_FORMAT_RGBA32;
+    img->stride = stride;
+    img->alloc = IMG_ALLOC_CACHE;
+    return IMG_SUCCESS;
+  }
 
+  img->data = (uint32_t *) (base + NATIVE_HEADER_BYTES);
+  img->alloc = IMG_ALLOC_MAPPED;
   return IMG_SUCCESS;
 }
 
+// Write a native file. Rows are written with the padding img_init
+// would give them, whatever the stride of img.
+static int write_native(const char *filename, struct Image *img) {
+  FILE *fp = fopen(filename, "wb");
+  if (fp == NULL)
+    return IMG_ERR_COULD_NOT_OPEN;
+
+  size_t bpp = img_bytes_per_pixel(img);
+  struct NativeHeader header;
+  memcpy(header.magic, NATIVE_MAGIC, sizeof(header.magic));
+  header.byte_order = NATIVE_BYTE_ORDER;
+  header.width = img->width;
+  header.height = img->height;
+  header.format = img->format;
+  header.stride = row_stride(img->width, bpp);
+
+  unsigned char block[NATIVE_HEADER_BYTES];
+  memset(block, 0, sizeof(block));
+  memcpy(block, &header, sizeof(header));
+  int ok = header.stride >= 0 && fwrite(block, sizeof(block), 1, fp) == 1;
+
+  size_t out_row_bytes = (size_t) header.stride * bpp;
+  if (ok && img->stride == header.stride) {
+    ok = fwrite(img->data, out_row_bytes, img->height, fp) == (size_t) img->height;
+  } else if (ok) {
+    // the padding is less than IMG_ROW_ALIGN pixels
+    static const unsigned char zeros[IMG_ROW_ALIGN * 3];
+    size_t pixel_bytes = (size_t) img->width * bpp;
+    for (int32_t row = 0; ok && row < img->height; row++) {
+      const unsigned char *pixels = (const unsigned char *) img->data + (size_t) row * img_row_bytes(img);
+      ok = fwrite(pixels, pixel_bytes, 1, fp) == 1 &&
+           fwrite(zeros, out_row_bytes - pixel_bytes, 1, fp) == 1;
+    }
+  }
+  ok = (fclose(fp) == 0) && ok;
+
+  return ok ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
+}
+
+// An image mapped from a native file would lose the pages it hasn't
+// written yet if that file were truncated, which is what opening it
+// for writing does. Unlinking the file instead leaves the mapping
+// intact, and the output is written to a new file of the same name.
+static void unlink_if_mapped(const char *filename, const struct Image *img) {
+  if (img->alloc == IMG_ALLOC_MAPPED)
+    unlink(filename);
+}
+
+int img_read(const char *filename, struct Image *img) {
+  enum FileType type = file_type(filename);
+  if (type == FILE_TYPE_NATIVE)
+    return read_native(filename, img, 0);
+  if (type != FILE_TYPE_PNG)
+    return read_raw(filename, img, 0, type);
+  return read_png(filename, img, 0);
+}
+
+int img_read_native(const char *filename, struct Image *img) {
+  enum FileType type = file_type(filename);
+  if (type == FILE_TYPE_NATIVE)
+    return read_native(filename, img, 1);
+  if (type != FILE_TYPE_PNG)
+    return read_raw(filename, img, 1, type);
+  return read_png(filename, img, 1);
+}
+
+// png_run_tasks_t running the tasks on an ImgprocPool
+static void run_pool_tasks(void *runner, int num_tasks, png_task_t task, void *arg) {
+  imgproc_pool_run((struct ImgprocPool *) runner, num_tasks, task, arg);
+}
+
 int img_write(const char *filename, struct Image *img) {
-  if (!png_init_called) {
-    png_init(0, 0);
-    png_init_called = 1;
+  return img_write_with_options(filename, img, NULL);
+}
+
+void img_write_options_init(struct ImgWriteOptions *opts) {
+  opts->level = -1;
+  opts->strategy = IMG_STRATEGY_DEFAULT;
+  opts->mem_level = 8;
+  opts->window_bits = 15;
+  opts->filter = IMG_FILTER_ADAPTIVE;
+  opts->pool = NULL;
+}
+
+int img_write_with_options(const char *filename, struct Image *img, const struct ImgWriteOptions *opts) {
+  pthread_once(&png_init_once, init_pnglite);
+
+  // the options are PNG encoder settings, the raw formats have none
+  enum FileType type = file_type(filename);
+  if (type != FILE_TYPE_PNG) {
+    unlink_if_mapped(filename, img);
+    if (type == FILE_TYPE_NATIVE)
+      return write_native(filename, img);
+    return write_raw(filename, img, type);
   }
 
-  png_t png;
+  struct ImgWriteOptions defaults;
+  if (opts == NULL) {
+    img_write_options_init(&defaults);
+    opts = &defaults;
+  }
+
+  // check the settings before the output file is created (or an
+  // existing one truncated)
+  if (png_check_compression(opts->level, opts->strategy, opts->mem_level, opts->window_bits) != PNG_NO_ERROR ||
+      png_check_filter_mode(opts->filter) != PNG_NO_ERROR) {
+    return IMG_ERR_BAD_OPTIONS;
+  }
 
+  png_t png;
+  unlink_if_mapped(filename, img);
   if (png_open_file_write(&png, filename) != PNG_NO_ERROR) {
     return IMG_ERR_COULD_NOT_OPEN;
   }
 
-  // if this is a little endian system, we need to byteswap
-  // every uint32_t so that it can be written in big-endian order
-  // (which is what PNG requires)
+  if (png_set_compression(&png, opts->level, opts->strategy, opts->mem_level, opts->window_bits) != PNG_NO_ERROR ||
+      png_set_filter_mode(&png, opts->filter) != PNG_NO_ERROR) {
+    png_close_file(&png);
+    return IMG_ERR_BAD_OPTIONS;
+  }
 
-  uint32_t *data_to_write = img->data;
-  int need_byteswap = is_little_endian();
+  int color = PNG_TRUECOLOR_ALPHA;
+  png_convert_row_t convert = NULL;
+  if (img->format == IMG_FORMAT_RGB24) {
+    // RGB24 pixel data is already laid out the way PNG stores it
+    color = PNG_TRUECOLOR;
+  } else if (is_little_endian()) {
+    // on a little endian system, every uint32_t has to be byteswapped
+    // so that it is written in big-endian order (which is what PNG
+    // requires). Each row is swapped straight into pnglite's scanline
+    // buffer, so no swapped copy of the image is made.
+    convert = byteswap_row;
+  }
 
-  if (need_byteswap) {
-    data_to_write = (uint32_t *) malloc(img->width * img->height * sizeof(uint32_t));
-    if (data_to_write == NULL) {
-      png_close_file(&png);
-      return IMG_ERR_MALLOC_FAILED;
-    }
+  const unsigned char *data = (const unsigned char *) img->data;
+  size_t stride = img_row_bytes(img);
+  int num_bands = imgproc_pool_size(opts->pool);
+  if ((size_t) img->height * stride < (size_t) num_bands * PARALLEL_DEFLATE_MIN_BAND_BYTES) {
+    num_bands = (int) ((size_t) img->height * stride / PARALLEL_DEFLATE_MIN_BAND_BYTES);
+  }
 
-    int32_t num_pixels = img->width * img->height;
-    for (int32_t i = 0; i < num_pixels; i++) {
-      data_to_write[i] = byteswap(img->data[i]);
+  int rc = png_write_begin(&png, img->width, img->height, 8, color);
+  if (rc == PNG_NO_ERROR && num_bands > 1) {
+    rc = png_write_rows_parallel(&png, data, stride, convert, num_bands, run_pool_tasks, opts->pool);
+  } else if (rc == PNG_NO_ERROR) {
+    rc = png_write_rows_convert(&png, data, img->height, stride, convert);
+    if (rc == PNG_NO_ERROR) {
+      rc = png_write_end(&png);
     }
   }
 
-  int rc = png_set_data(&png, img->width, img->height, 8, PNG_TRUECOLOR_ALPHA, (unsigned char *) data_to_write);
-  int success = (rc == PNG_NO_ERROR);
-
   png_close_file(&png);
-  if (need_byteswap) {
-    free(data_to_write);
-  }
 
-  return success ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
+  return (rc == PNG_NO_ERROR) ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
+}
+
+void *img_alloc_data(size_t size) {
+  return imgproc_buffer_alloc(size);
 }
 
 void img_cleanup( struct Image *img ) {
   // The data array is the only dynamically-allocated
   // part of the representation of a struct Image
-  free( img->data );
+  if ( img->alloc == IMG_ALLOC_CACHE )
+    imgproc_buffer_free( img->data );
+  else if ( img->alloc == IMG_ALLOC_MAPPED )
+    munmap( (unsigned char *) img->data - NATIVE_HEADER_BYTES, NATIVE_HEADER_BYTES + img_row_bytes( img ) * img->height );
+  else
+    free( img->data );
 }
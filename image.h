@@ -7,20 +7,67 @@
 #define IMG_ERR_NOT_TRUECOLOR    -2
 #define IMG_ERR_MALLOC_FAILED    -3
 #define IMG_ERR_COULD_NOT_WRITE  -4
+#define IMG_ERR_BAD_OPTIONS      -5
+
+// pixel formats (layouts of the data array of an Image)
+#define IMG_FORMAT_RGBA32        0  // one uint32_t per pixel, 0xRRGGBBAA
+#define IMG_FORMAT_RGB24         1  // three bytes per pixel, R, G, B
+
+// deflate strategies for img_write_with_options
+#define IMG_STRATEGY_DEFAULT     0
+#define IMG_STRATEGY_FILTERED    1
+#define IMG_STRATEGY_HUFFMAN     2  // Huffman coding only, no matching
+#define IMG_STRATEGY_RLE         3  // only matches of the previous pixel
+
+// how img_write_with_options chooses the PNG filter of each row
+#define IMG_FILTER_NONE          0
+#define IMG_FILTER_FAST          1  // best of none, sub and up
+#define IMG_FILTER_ADAPTIVE      2  // best of all five PNG filters
+
+// who owns the data array of an Image, i.e. how img_cleanup releases it
+#define IMG_ALLOC_MALLOC         0  // from malloc (or calloc, realloc), freed with free()
+#define IMG_ALLOC_CACHE          1  // from the buffer cache (see img_alloc_data)
+#define IMG_ALLOC_MAPPED         2  // a mapping of a .imgraw file (see img_read_native)
+
+// Rows of pixel data start at multiples of this many bytes: the data
+// array is aligned to it, and rows are padded to a multiple of it
+#define IMG_ROW_ALIGN            64
 
 #ifndef ASM_SOURCE
+#include <stddef.h>
 #include <stdint.h>
 
 struct Image {
   int32_t width;
   int32_t height;
-  uint32_t *data;
+  uint32_t *data;   // for IMG_FORMAT_RGB24, really an array of bytes
+  int32_t format;   // one of the IMG_FORMAT_* values
+  int32_t stride;   // distance between the starts of consecutive rows,
+                    // in pixels (at least width)
+  int32_t alloc;    // one of the IMG_ALLOC_* values; a program filling
+                    // in an Image itself sets it (zero means malloc)
+};
+
+struct ImgprocPool;
+
+// Settings for encoding PNG files, see img_write_with_options
+struct ImgWriteOptions {
+  int level;        // compression level 0 (none) to 9 (best), -1 for the default (6)
+  int strategy;     // one of the IMG_STRATEGY_* values
+  int mem_level;    // memory used for the compression state, 1 to 9
+  int window_bits;  // base 2 logarithm of the window size, 9 to 15
+  int filter;       // one of the IMG_FILTER_* values
+  struct ImgprocPool *pool; // if not NULL, large images are filtered and
+                            // deflated in bands of rows on its threads
 };
 
 // Initialize an Image struct instance by creating a pixel
 // buffer large enough to accommodate an image of the specified
 // dimensions, initialzing all pixels to opaque black,
 // and initialzing all of the struct Image field values.
+// Each row starts at a multiple of IMG_ROW_ALIGN bytes, so the
+// stride may be larger than the width (img_read and
+// img_read_native lay out their images the same way.)
 // This function only needs to be called if the program
 // needs to create an "empty" image in memory.
 //
@@ -34,8 +81,31 @@ struct Image {
 //   IMG_ERR_* values
 int img_init(struct Image *img, int32_t width, int32_t height);
 
+// Like img_init, but the pixel data uses the specified format
+// (IMG_FORMAT_RGBA32 or IMG_FORMAT_RGB24.) Pixels are initialized
+// to opaque black.
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int img_init_format(struct Image *img, int32_t width, int32_t height, int32_t format);
+
+// Like img_init_format, but the pixels are left uninitialized. This
+// saves a pass over memory when every pixel is about to be written,
+// e.g. for the output of a transformation which sets all of them.
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int img_init_uninitialized(struct Image *img, int32_t width, int32_t height, int32_t format);
+
 // Read PNG image data from a file and initialize the specified
-// Image struct instance.
+// Image struct instance. Files named *.pam (binary PAM with RGB or
+// RGB_ALPHA tuples) or *.ff / *.farbfeld (farbfeld) are read as those
+// uncompressed formats instead, which is much faster for intermediate
+// images passed between programs. Files named *.imgraw hold the pixel
+// data exactly as this machine lays out a struct Image, and are mapped
+// into memory rather than read (see img_read_native.)
 //
 // Parameters:
 //   filename - name of PNG file to read
@@ -47,8 +117,31 @@ int img_init(struct Image *img, int32_t width, int32_t height);
 //   IMG_ERR_* values
 int img_read(const char *filename, struct Image *img);
 
+// Like img_read, but truecolor (RGB) PNG files are not expanded to
+// RGBA: the image is stored in IMG_FORMAT_RGB24, exactly as it is
+// laid out in the file. Files with an alpha channel are read as
+// IMG_FORMAT_RGBA32.
+//
+// A *.imgraw file is not copied at all: img->data points into a
+// private mapping of the file (img->alloc is IMG_ALLOC_MAPPED), whose
+// pages are only read from disk when they are used, and are copied
+// when they are changed. img_cleanup unmaps it, computing the length
+// from width, height and stride, which must not be changed meanwhile.
+// The file must not be truncated or rewritten in place while the image
+// is in use; img_write replaces rather than rewrites the file it was
+// mapped from, so an image can be written back to its own file.
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int img_read_native(const char *filename, struct Image *img);
+
 // Write pixel data from specified Image struct instance to the
-// named PNG output file.
+// named PNG output file. IMG_FORMAT_RGB24 images are written as
+// truecolor PNG files, IMG_FORMAT_RGBA32 images as truecolor with
+// alpha. As for img_read, the .pam, .ff, .farbfeld and .imgraw
+// extensions select an uncompressed format instead (farbfeld always
+// has alpha.)
 //
 // Parameters:
 //   filename - name of PNG file to write
@@ -60,10 +153,49 @@ int img_read(const char *filename, struct Image *img);
 //   IMG_ERR_* values
 int img_write(const char *filename, struct Image *img);
 
+// Set the fields of an ImgWriteOptions to the settings img_write
+// uses: default level and strategy, mem_level 8, window_bits 15,
+// adaptive filtering, and no pool.
+void img_write_options_init(struct ImgWriteOptions *opts);
+
+// Like img_write, but with the specified encoder settings (or the
+// defaults if opts is NULL.) Level 1 or IMG_STRATEGY_RLE is much
+// faster than the default for intermediate outputs, level 9 gives
+// the smallest files.
+//
+// Returns:
+//   IMG_SUCCESS if successful, IMG_ERR_BAD_OPTIONS if a setting is
+//   out of range, otherwise one of the other IMG_ERR_* values
+int img_write_with_options(const char *filename, struct Image *img, const struct ImgWriteOptions *opts);
+
+// Return the number of bytes used by each pixel of an Image
+// (4 for IMG_FORMAT_RGBA32, 3 for IMG_FORMAT_RGB24.)
+int img_bytes_per_pixel(const struct Image *img);
+
+// Return the number of bytes between the starts of consecutive rows
+// of an Image (a multiple of IMG_ROW_ALIGN.)
+size_t img_row_bytes(const struct Image *img);
+
+// Allocate a pixel buffer of at least size bytes, aligned to
+// IMG_ROW_ALIGN, for a program which fills in a struct Image itself.
+// The buffer comes from the cache img_init and img_read use (see
+// imgproc_buffers.h), so the Image's alloc field must be set to
+// IMG_ALLOC_CACHE for img_cleanup to release it correctly.
+//
+// Parameters:
+//   size - number of bytes needed
+//
+// Returns:
+//   pointer to the buffer, or NULL if there is not enough memory
+void *img_alloc_data(size_t size);
+
 // De-allocate the dynamically-allocated memory used in the internal
 // representation of the given Image struct. Note that this function
 // does NOT de-allocate the struct Image instance itself (since allocating
 // Image objects is the responsibility of the program, not this library.)
+// img->data is released according to img->alloc: buffers from this
+// library go back to its cache, mapped files are unmapped, and data
+// from malloc is passed to free().
 //
 // Parameters:
 //   img - pointer to Image object to clean up
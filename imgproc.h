@@ -1,5 +1,9 @@
 // Header for image processing API functions (imgproc_complement, etc.)
 // as well as any helper functions they rely on.
+//
+// The imgproc_* functions work on IMG_FORMAT_RGBA32 images (the layout
+// used by both the C and the assembly implementations). Images in other
+// formats are handled by the imgproc_*_mt functions (imgproc_pool.h).
 
 #ifndef IMGPROC_H
 #define IMGPROC_H
@@ -42,6 +46,7 @@ uint32_t get_a( uint32_t pixel );
 uint32_t make_pixel( uint32_t r, uint32_t g, uint32_t b, uint32_t a );
 
 //! Compute the 1D index of a pixel given an image, row, and column.
+//! Rows are img->stride pixels apart, which may be more than the width.
 //!
 //! @param img the Image
 //! @param row the row location of the pixel
@@ -63,6 +68,8 @@ int is_in_ellipse( struct Image *img, int32_t row, int32_t col);
 //! (1 becomes 0, 0 becomes 1.) The alpha value of each pixel should
 //! be left unchanged.
 //!
+//! output_img may be the same Image as input_img.
+//!
 //! @param input_img pointer to the input Image
 //! @param output_img pointer to the output Image (in which the
 //!                   transformed pixels should be stored)
@@ -75,6 +82,9 @@ void imgproc_complement( struct Image *input_img, struct Image *output_img );
 //! Note that this transformation can only be applied to square
 //! images (where the width and height are identical.)
 //!
+//! If input_img and output_img are the same Image, the image is
+//! transposed in place and no second pixel buffer is needed.
+//!
 //! @param input_img pointer to the input Image
 //! @param output_img pointer to the output Image (in which the
 //!                   transformed pixels should be stored)
@@ -100,6 +110,8 @@ int imgproc_transpose( struct Image *input_img, struct Image *output_img );
 //!
 //!   floor( (10000*x*x) / (a*a) ) + floor( (10000*y*y) / (b*b) ) <= 10000
 //!
+//! output_img may be the same Image as input_img.
+//!
 //! @param input_img pointer to the input Image
 //! @param output_img pointer to the output Image (in which the
 //!                   transformed pixels should be stored)
@@ -132,11 +144,38 @@ void imgproc_ellipse( struct Image *input_img, struct Image *output_img );
 //! and blue color component values should be set to gray, and the
 //! alpha value should be left unmodified.
 //!
+//! output_img may be the same Image as input_img: rows are processed
+//! from the bottom up, so each row's upper neighbors are still
+//! unmodified when it is computed.
+//!
 //! @param input_img pointer to the input Image
 //! @param output_img pointer to the output Image (in which the
 //!                   transformed pixels should be stored)
 void imgproc_emboss( struct Image *input_img, struct Image *output_img );
 
+//! In-place version of imgproc_complement: the transformed pixels
+//! replace the original ones.
+//!
+//! @param img pointer to the Image to transform
+void imgproc_complement_inplace( struct Image *img );
+
+//! In-place version of imgproc_transpose.
+//!
+//! @param img pointer to the Image to transform
+//! @return 1 if the transformation succeeded, or 0 if the
+//!         image width and height are not the same
+int imgproc_transpose_inplace( struct Image *img );
+
+//! In-place version of imgproc_ellipse.
+//!
+//! @param img pointer to the Image to transform
+void imgproc_ellipse_inplace( struct Image *img );
+
+//! In-place version of imgproc_emboss.
+//!
+//! @param img pointer to the Image to transform
+void imgproc_emboss_inplace( struct Image *img );
+
 // TODO: add prototypes for your helper functions
 
 #endif // IMGPROC_H
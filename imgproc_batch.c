@@ -0,0 +1,353 @@
+// Batch processing of images with a pipelined read/transform/write executor
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "imgproc_batch.h"
+
+// The stages an image goes through
+enum BatchStage {
+  STAGE_DECODE,
+  STAGE_TRANSFORM,
+  STAGE_ENCODE,
+};
+
+// An image in the pipeline
+struct BatchItem {
+  int index;          // index in the list
+  struct Image img;
+};
+
+// A bounded FIFO of images waiting for the next stage
+struct BatchQueue {
+  struct BatchItem *items;
+  int head;
+  int count;
+  // slots promised to images still in the previous stage, so that a
+  // stage is never started without room for its result
+  int reserved;
+};
+
+struct BatchRun {
+  const struct ImgprocBatchList *list;
+  const enum ImgprocOp *ops;
+  int num_ops;
+  struct ImgWriteOptions write_opts;
+  int capacity;         // capacity of each queue
+
+  // protects all fields below, and signals that work or room may
+  // have become available
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  int next_input;                // next image to decode
+  struct BatchQueue decoded;     // waiting to be transformed
+  struct BatchQueue transformed; // waiting to be encoded
+  int finished;                  // images which have left the pipeline
+  int failed;
+};
+
+////////////////////////////////////////////////////////////////////////
+// File lists
+////////////////////////////////////////////////////////////////////////
+
+void imgproc_batch_list_init( struct ImgprocBatchList *list ) {
+  list->inputs = NULL;
+  list->outputs = NULL;
+  list->num_images = 0;
+  list->capacity = 0;
+}
+
+void imgproc_batch_list_cleanup( struct ImgprocBatchList *list ) {
+  for ( int i = 0; i < list->num_images; i++ ) {
+    free( list->inputs[i] );
+    free( list->outputs[i] );
+  }
+  free( list->inputs );
+  free( list->outputs );
+  imgproc_batch_list_init( list );
+}
+
+int imgproc_batch_list_add( struct ImgprocBatchList *list, const char *input, const char *output ) {
+  if ( list->num_images == list->capacity ) {
+    int capacity = list->capacity > 0 ? list->capacity * 2 : 64;
+    char **inputs = realloc( list->inputs, capacity * sizeof( char * ) );
+    if ( inputs == NULL )
+      return 0;
+    list->inputs = inputs;
+    char **outputs = realloc( list->outputs, capacity * sizeof( char * ) );
+    if ( outputs == NULL )
+      return 0;
+    list->outputs = outputs;
+    list->capacity = capacity;
+  }
+
+  char *in = strdup( input ), *out = strdup( output );
+  if ( in == NULL || out == NULL ) {
+    free( in );
+    free( out );
+    return 0;
+  }
+  list->inputs[list->num_images] = in;
+  list->outputs[list->num_images] = out;
+  list->num_images++;
+  return 1;
+}
+
+int imgproc_batch_list_read_manifest( struct ImgprocBatchList *list, const char *filename ) {
+  FILE *fp = fopen( filename, "r" );
+  if ( fp == NULL ) {
+    fprintf( stderr, "Error: couldn't open manifest %s\n", filename );
+    return 0;
+  }
+
+  char *line = NULL;
+  size_t line_size = 0;
+  int line_num = 0, success = 1;
+  while ( success && getline( &line, &line_size, fp ) >= 0 ) {
+    line_num++;
+    char *save;
+    char *input = strtok_r( line, " \t\r\n", &save );
+    if ( input == NULL || input[0] == '#' )
+      continue;
+    char *output = strtok_r( NULL, " \t\r\n", &save );
+    if ( output == NULL || strtok_r( NULL, " \t\r\n", &save ) != NULL ) {
+      fprintf( stderr, "Error: %s:%d: expected <input img> <output img>\n", filename, line_num );
+      success = 0;
+    } else if ( !imgproc_batch_list_add( list, input, output ) ) {
+      fprintf( stderr, "Error: out of memory reading manifest %s\n", filename );
+      success = 0;
+    }
+  }
+  if ( success && ferror( fp ) ) {
+    fprintf( stderr, "Error: couldn't read manifest %s\n", filename );
+    success = 0;
+  }
+
+  free( line );
+  fclose( fp );
+  return success;
+}
+
+// Return whether a file name has one of the extensions img_read knows
+static int is_image_name( const char *name ) {
+  static const char *const extensions[] = { ".png", ".pam", ".ff", ".farbfeld", ".imgraw" };
+  const char *ext = strrchr( name, '.' );
+  if ( ext == NULL || ext == name )
+    return 0;
+  for ( size_t i = 0; i < sizeof( extensions ) / sizeof( extensions[0] ); i++ )
+    if ( strcmp( ext, extensions[i] ) == 0 )
+      return 1;
+  return 0;
+}
+
+static int compare_names( const void *a, const void *b ) {
+  return strcmp( *(char *const *) a, *(char *const *) b );
+}
+
+// Return the malloc'ed string dir/name, or NULL if out of memory
+static char *join_path( const char *dir, const char *name ) {
+  size_t len = strlen( dir ) + 1 + strlen( name ) + 1;
+  char *path = malloc( len );
+  if ( path != NULL )
+    snprintf( path, len, "%s/%s", dir, name );
+  return path;
+}
+
+int imgproc_batch_list_read_dir( struct ImgprocBatchList *list, const char *input_dir, const char *output_dir ) {
+  DIR *dir = opendir( input_dir );
+  if ( dir == NULL ) {
+    fprintf( stderr, "Error: couldn't open directory %s\n", input_dir );
+    return 0;
+  }
+
+  // collect the names first, so the images are processed in order
+  char **names = NULL;
+  int num_names = 0, max_names = 0, success = 1;
+  struct dirent *entry;
+  while ( success && ( entry = readdir( dir ) ) != NULL ) {
+    if ( !is_image_name( entry->d_name ) )
+      continue;
+    char *path = join_path( input_dir, entry->d_name );
+    struct stat st;
+    int is_file = path != NULL && stat( path, &st ) == 0 && S_ISREG( st.st_mode );
+    free( path );
+    if ( !is_file )
+      continue;
+
+    if ( num_names == max_names ) {
+      max_names = max_names > 0 ? max_names * 2 : 64;
+      char **new_names = realloc( names, max_names * sizeof( char * ) );
+      if ( new_names == NULL ) {
+        success = 0;
+        break;
+      }
+      names = new_names;
+    }
+    if ( ( names[num_names] = strdup( entry->d_name ) ) == NULL )
+      success = 0;
+    else
+      num_names++;
+  }
+  closedir( dir );
+
+  if ( success )
+    qsort( names, num_names, sizeof( char * ), compare_names );
+  for ( int i = 0; success && i < num_names; i++ ) {
+    char *input = join_path( input_dir, names[i] );
+    char *output = join_path( output_dir, names[i] );
+    success = input != NULL && output != NULL && imgproc_batch_list_add( list, input, output );
+    free( input );
+    free( output );
+  }
+  if ( !success )
+    fprintf( stderr, "Error: out of memory reading directory %s\n", input_dir );
+
+  for ( int i = 0; i < num_names; i++ )
+    free( names[i] );
+  free( names );
+  return success;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Pipeline
+////////////////////////////////////////////////////////////////////////
+
+static int queue_has_room( const struct BatchRun *run, const struct BatchQueue *queue ) {
+  return queue->count + queue->reserved < run->capacity;
+}
+
+static void queue_push( struct BatchRun *run, struct BatchQueue *queue, const struct BatchItem *item ) {
+  queue->items[(queue->head + queue->count) % run->capacity] = *item;
+  queue->count++;
+  queue->reserved--;
+}
+
+static void queue_pop( struct BatchRun *run, struct BatchQueue *queue, struct BatchItem *item ) {
+  *item = queue->items[queue->head];
+  queue->head = (queue->head + 1) % run->capacity;
+  queue->count--;
+}
+
+// Do one stage of work on an image. Returns 1 if successful, 0 (after
+// printing an error message and freeing the image) if not.
+static int run_stage( struct BatchRun *run, enum BatchStage stage, struct BatchItem *item ) {
+  const struct ImgprocBatchList *list = run->list;
+  switch ( stage ) {
+  case STAGE_DECODE:
+    if ( img_read_native( list->inputs[item->index], &item->img ) != IMG_SUCCESS ) {
+      fprintf( stderr, "Error: couldn't read input image %s\n", list->inputs[item->index] );
+      return 0;
+    }
+    return 1;
+  case STAGE_TRANSFORM:
+    // each thread works on its own image, so the chain doesn't use the pool
+    if ( !imgproc_chain( NULL, run->ops, run->num_ops, &item->img ) ) {
+      fprintf( stderr, "Error: transformation chain failed for %s\n", list->inputs[item->index] );
+      img_cleanup( &item->img );
+      return 0;
+    }
+    return 1;
+  case STAGE_ENCODE: {
+    int rc = img_write_with_options( list->outputs[item->index], &item->img, &run->write_opts );
+    img_cleanup( &item->img );
+    if ( rc != IMG_SUCCESS ) {
+      fprintf( stderr, "Error: couldn't write output image %s\n", list->outputs[item->index] );
+      return 0;
+    }
+    return 1;
+  }
+  }
+  return 0;
+}
+
+// Pool task run by every thread: repeatedly claim the most advanced
+// piece of work there is room for, until every image has finished
+static void batch_worker( void *arg, int task ) {
+  struct BatchRun *run = arg;
+  (void) task;
+
+  pthread_mutex_lock( &run->lock );
+  while ( run->finished < run->list->num_images ) {
+    enum BatchStage stage;
+    struct BatchItem item;
+    struct BatchQueue *next;
+
+    if ( run->transformed.count > 0 ) {
+      stage = STAGE_ENCODE;
+      queue_pop( run, &run->transformed, &item );
+      next = NULL;
+    } else if ( run->decoded.count > 0 && queue_has_room( run, &run->transformed ) ) {
+      stage = STAGE_TRANSFORM;
+      queue_pop( run, &run->decoded, &item );
+      next = &run->transformed;
+    } else if ( run->next_input < run->list->num_images && queue_has_room( run, &run->decoded ) ) {
+      stage = STAGE_DECODE;
+      item.index = run->next_input++;
+      next = &run->decoded;
+    } else {
+      pthread_cond_wait( &run->changed, &run->lock );
+      continue;
+    }
+    if ( next != NULL )
+      next->reserved++;
+
+    pthread_mutex_unlock( &run->lock );
+    int success = run_stage( run, stage, &item );
+    pthread_mutex_lock( &run->lock );
+
+    if ( next != NULL && success ) {
+      queue_push( run, next, &item );
+    } else {
+      if ( next != NULL )
+        next->reserved--;
+      run->finished++;
+      if ( !success )
+        run->failed++;
+    }
+    pthread_cond_broadcast( &run->changed );
+  }
+  pthread_mutex_unlock( &run->lock );
+}
+
+int imgproc_batch_run( struct ImgprocPool *pool, const struct ImgprocBatchList *list,
+                       const enum ImgprocOp *ops, int num_ops,
+                       const struct ImgWriteOptions *write_opts, int queue_depth ) {
+  struct BatchRun run;
+  run.list = list;
+  run.ops = ops;
+  run.num_ops = num_ops;
+  if ( write_opts != NULL )
+    run.write_opts = *write_opts;
+  else
+    img_write_options_init( &run.write_opts );
+  // the pool's threads are all busy running stages
+  run.write_opts.pool = NULL;
+  run.capacity = queue_depth > 0 ? queue_depth : IMGPROC_BATCH_QUEUE_DEPTH_PER_THREAD * imgproc_pool_size( pool );
+
+  run.next_input = 0;
+  run.finished = 0;
+  run.failed = 0;
+  run.decoded.head = run.decoded.count = run.decoded.reserved = 0;
+  run.transformed.head = run.transformed.count = run.transformed.reserved = 0;
+  run.decoded.items = malloc( run.capacity * sizeof( struct BatchItem ) );
+  run.transformed.items = malloc( run.capacity * sizeof( struct BatchItem ) );
+  if ( run.decoded.items == NULL || run.transformed.items == NULL ) {
+    free( run.decoded.items );
+    free( run.transformed.items );
+    return -1;
+  }
+  pthread_mutex_init( &run.lock, NULL );
+  pthread_cond_init( &run.changed, NULL );
+
+  // one long-running task per thread
+  imgproc_pool_run( pool, imgproc_pool_size( pool ), batch_worker, &run );
+
+  pthread_cond_destroy( &run.changed );
+  pthread_mutex_destroy( &run.lock );
+  free( run.decoded.items );
+  free( run.transformed.items );
+  return run.failed;
+}
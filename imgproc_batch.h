@@ -0,0 +1,91 @@
+// Header for batch processing: reading, transforming, and writing many
+// images in one process. Decoding, transforming, and encoding run as
+// separate pipeline stages with bounded queues between them, so that
+// while one image is being encoded the next ones are being transformed
+// and decoded, and every thread of the pool has work as long as any
+// stage does.
+
+#ifndef IMGPROC_BATCH_H
+#define IMGPROC_BATCH_H
+
+#include "image.h"         // for struct ImgWriteOptions
+#include "imgproc_pool.h"  // for struct ImgprocPool
+#include "imgproc_chain.h" // for enum ImgprocOp
+
+//! Default number of images which may wait between two stages, per
+//! thread of the pool.
+#define IMGPROC_BATCH_QUEUE_DEPTH_PER_THREAD 2
+
+//! The input and output file names of a batch.
+struct ImgprocBatchList {
+  char **inputs;   // input file names
+  char **outputs;  // output file names
+  int num_images;
+  int capacity;    // allocated length of inputs and outputs
+};
+
+//! Initialize an empty list.
+//!
+//! @param list the list to initialize
+void imgproc_batch_list_init( struct ImgprocBatchList *list );
+
+//! Free the file names stored in a list, leaving it empty.
+//!
+//! @param list the list to clean up
+void imgproc_batch_list_cleanup( struct ImgprocBatchList *list );
+
+//! Append copies of an input and an output file name to a list.
+//!
+//! @param list the list
+//! @param input name of the input file
+//! @param output name of the output file
+//! @return 1 if successful, 0 if there is not enough memory
+int imgproc_batch_list_add( struct ImgprocBatchList *list, const char *input, const char *output );
+
+//! Append the images named in a manifest file: one image per line,
+//! its input and output file names separated by spaces or tabs. Blank
+//! lines and lines starting with '#' are ignored.
+//!
+//! @param list the list
+//! @param filename name of the manifest file
+//! @return 1 if successful, 0 (after printing an error message) if the
+//!         file couldn't be read or a line doesn't hold two names
+int imgproc_batch_list_read_manifest( struct ImgprocBatchList *list, const char *filename );
+
+//! Append every image file (.png, .pam, .ff, .farbfeld or .imgraw) in a
+//! directory, in order of name, each to be written to a file of the
+//! same name in output_dir.
+//!
+//! @param list the list
+//! @param input_dir the directory to read
+//! @param output_dir the directory for the output files
+//! @return 1 if successful, 0 (after printing an error message) if the
+//!         directory couldn't be read
+int imgproc_batch_list_read_dir( struct ImgprocBatchList *list, const char *input_dir, const char *output_dir );
+
+//! Read every image in a list, apply a chain of transformations to it
+//! (see imgproc_chain), and write it to its output file. Each thread
+//! of the pool works on whichever stage has work, preferring the later
+//! stages so that finished images leave the pipeline (and free their
+//! memory) first; a stage is only started if the queue after it has
+//! room, which bounds the number of images in memory at
+//! 2 * queue_depth plus one per thread. Images are processed one per
+//! thread, so the chain and the encoder run single-threaded.
+//! An image which fails at any stage is reported on stderr and
+//! skipped; the others are still processed.
+//!
+//! @param pool the pool to run on (NULL to use the calling thread only)
+//! @param list the images to process
+//! @param ops the stages of the chain
+//! @param num_ops number of stages
+//! @param write_opts encoder settings (NULL for the defaults); the
+//!        pool member is ignored
+//! @param queue_depth maximum number of images waiting between two
+//!        stages (0 for IMGPROC_BATCH_QUEUE_DEPTH_PER_THREAD per thread)
+//! @return number of images which couldn't be processed, or -1 if the
+//!         batch couldn't be started (out of memory)
+int imgproc_batch_run( struct ImgprocPool *pool, const struct ImgprocBatchList *list,
+                       const enum ImgprocOp *ops, int num_ops,
+                       const struct ImgWriteOptions *write_opts, int queue_depth );
+
+#endif // IMGPROC_BATCH_H
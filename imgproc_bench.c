@@ -0,0 +1,667 @@
+// Benchmark program for image decoding, the image transformations,
+// image encoding, and the low-level kernels
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "imgproc.h"
+#include "imgproc_kernels.h"
+#include "imgproc_pool.h"
+#include "imgproc_planar.h"
+#include "imgproc_batch.h"
+#include "pnglite.h"
+
+#define DEFAULT_REPS 5
+#define DEFAULT_WARMUP 1
+#define DEFAULT_MIN_SIZE 256
+#define DEFAULT_MAX_SIZE 16384
+
+// The kernel and thread scaling benchmarks use a random image of at
+// most this size
+#define MAX_KERNEL_SIZE 4096
+
+// The batch benchmark processes copies of a synthetic image of at most
+// this size
+#define MAX_BATCH_SIZE 1024
+
+struct Options {
+  int reps;
+  int warmup;
+  int min_size;
+  int max_size;
+  int threads;
+  int scaling_threads;
+  int kernels;
+  int batch_images;
+  int json;
+};
+
+// Summary of the timed runs of one operation, in seconds
+struct Timing {
+  double median;
+  double p95;
+};
+
+static struct Options s_opts = {
+  DEFAULT_REPS, DEFAULT_WARMUP, DEFAULT_MIN_SIZE, DEFAULT_MAX_SIZE, 1, 0, 0, 0, 0
+};
+
+// The same program is linked against the C and the assembly imgproc_*
+// functions, so every result says which one it came from
+static const char *s_program;
+
+// Return the current time in seconds from a monotonic clock
+static double now_sec( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles( const void *a, const void *b ) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+// Return the median and 95th percentile of the n values in times
+// (which is sorted in place)
+static struct Timing summarize( double *times, int n ) {
+  struct Timing t;
+  qsort( times, n, sizeof(double), compare_doubles );
+  t.median = (n % 2) ? times[n/2] : (times[n/2 - 1] + times[n/2]) / 2;
+  t.p95 = times[(95 * n + 99) / 100 - 1];
+  return t;
+}
+
+// Run stmt s_opts.warmup times untimed, then s_opts.reps times timed,
+// and store the summary of the timed runs in timing
+#define TIME_RUNS( timing, stmt ) do { \
+  for ( int warm_ = 0; warm_ < s_opts.warmup; warm_++ ) { \
+    stmt; \
+  } \
+  double times_[s_opts.reps]; \
+  for ( int rep_ = 0; rep_ < s_opts.reps; rep_++ ) { \
+    double start_ = now_sec(); \
+    stmt; \
+    times_[rep_] = now_sec() - start_; \
+  } \
+  (timing) = summarize( times_, s_opts.reps ); \
+} while ( 0 )
+
+static const char *format_name( int32_t format ) {
+  return (format == IMG_FORMAT_RGB24) ? "rgb24" : "rgba32";
+}
+
+static void print_header( void ) {
+  if ( s_opts.json )
+    return;
+  printf( "%s: dispatched isa is %s, %d warm-up and %d timed runs\n",
+          s_program, kernel_isa_name( kernel_active_isa() ), s_opts.warmup, s_opts.reps );
+  printf( "%-24s %-12s %-6s %-24s %3s %10s %10s %10s\n",
+          "image", "size", "format", "operation", "thr", "median ms", "p95 ms", "Mpix/s" );
+}
+
+// Print one result, either as a table row or as a line of JSON
+static void report( const char *image, const struct Image *img, const char *op,
+                    int threads, struct Timing t ) {
+  double mpix = (double) img->width * img->height / t.median / 1e6;
+  if ( s_opts.json ) {
+    printf( "{\"program\": \"%s\", \"isa\": \"%s\", \"image\": \"%s\", \"width\": %d, "
+            "\"height\": %d, \"format\": \"%s\", \"op\": \"%s\", \"threads\": %d, "
+            "\"reps\": %d, \"median_s\": %.6f, \"p95_s\": %.6f, \"mpix_per_s\": %.1f}\n",
+            s_program, kernel_isa_name( kernel_active_isa() ), image, img->width, img->height,
+            format_name( img->format ), op, threads, s_opts.reps, t.median, t.p95, mpix );
+  } else {
+    char size[32];
+    snprintf( size, sizeof(size), "%dx%d", img->width, img->height );
+    printf( "%-24s %-12s %-6s %-24s %3d %10.2f %10.2f %10.1f\n", image, size,
+            format_name( img->format ), op, threads, t.median * 1e3, t.p95 * 1e3, mpix );
+  }
+  fflush( stdout );
+}
+
+// Like report, for an operation on a batch of num_images images the
+// size of img, also giving the number of images per second
+static void report_batch( const char *image, const struct Image *img, const char *op,
+                          int threads, int num_images, struct Timing t ) {
+  double mpix = (double) img->width * img->height * num_images / t.median / 1e6;
+  double images_per_s = num_images / t.median;
+  if ( s_opts.json ) {
+    printf( "{\"program\": \"%s\", \"isa\": \"%s\", \"image\": \"%s\", \"width\": %d, "
+            "\"height\": %d, \"format\": \"%s\", \"op\": \"%s\", \"threads\": %d, "
+            "\"reps\": %d, \"images\": %d, \"median_s\": %.6f, \"p95_s\": %.6f, "
+            "\"mpix_per_s\": %.1f, \"images_per_s\": %.1f}\n",
+            s_program, kernel_isa_name( kernel_active_isa() ), image, img->width, img->height,
+            format_name( img->format ), op, threads, s_opts.reps, num_images, t.median, t.p95,
+            mpix, images_per_s );
+  } else {
+    char size[32];
+    snprintf( size, sizeof(size), "%dx%d", img->width, img->height );
+    printf( "%-24s %-12s %-6s %-24s %3d %10.2f %10.2f %10.1f %8.1f images/s\n", image, size,
+            format_name( img->format ), op, threads, t.median * 1e3, t.p95 * 1e3, mpix,
+            images_per_s );
+  }
+  fflush( stdout );
+}
+
+// Fill an image with deterministic pseudo-random pixels
+static void fill_random( struct Image *img ) {
+  uint32_t state = 0x12345678U;
+  for ( size_t i = 0; i < (size_t) img->stride * img->height; i++ ) {
+    state = state * 1664525U + 1013904223U;
+    img->data[i] = state;
+  }
+}
+
+// Fill an image with smooth gradients plus a little noise, which
+// compresses more like a photograph than random pixels do
+static void fill_synthetic( struct Image *img ) {
+  uint32_t state = 0x9E3779B9U;
+  for ( int32_t row = 0; row < img->height; row++ ) {
+    for ( int32_t col = 0; col < img->width; col++ ) {
+      state = state * 1664525U + 1013904223U;
+      uint32_t noise = state >> 29;
+      uint32_t r = (uint32_t) ((int64_t) row * 255 / img->height) ^ noise;
+      uint32_t g = (uint32_t) ((int64_t) col * 255 / img->width) ^ noise;
+      uint32_t b = (uint32_t) (row + col) & 0xFF;
+      img->data[compute_index( img, row, col )] = make_pixel( r, g, b, 255 );
+    }
+  }
+}
+
+static void transpose_mt( struct ImgprocPool *pool, struct Image *in, struct Image *out ) {
+  imgproc_transpose_mt( pool, in, out );
+}
+
+static const struct {
+  const char *name;
+  void (*fn)( struct ImgprocPool *, struct Image *, struct Image * );
+} s_transforms[] = {
+  { "complement", imgproc_complement_mt },
+  { "transpose", transpose_mt },
+  { "ellipse", imgproc_ellipse_mt },
+  { "emboss", imgproc_emboss_mt },
+};
+
+#define NUM_TRANSFORMS ((int) (sizeof(s_transforms) / sizeof(s_transforms[0])))
+
+////////////////////////////////////////////////////////////////////////
+// Whole images: decode, transformations, encode
+////////////////////////////////////////////////////////////////////////
+
+// Time every transformation of img, out of place. Without a pool,
+// RGBA32 images go through the imgproc_* functions this program is
+// linked with.
+static void bench_transforms( const char *name, struct Image *img, struct ImgprocPool *pool ) {
+  // every transformation writes all of its output pixels
+  struct Image out;
+  if ( img_init_uninitialized( &out, img->width, img->height, img->format ) != IMG_SUCCESS ) {
+    fprintf( stderr, "%s: couldn't allocate %dx%d output image, skipping transformations\n",
+             name, img->width, img->height );
+    return;
+  }
+
+  for ( int i = 0; i < NUM_TRANSFORMS; i++ ) {
+    // transpose needs a square image to work out of place
+    if ( s_transforms[i].fn == transpose_mt && img->width != img->height )
+      continue;
+    struct Timing t;
+    TIME_RUNS( t, s_transforms[i].fn( pool, img, &out ) );
+    report( name, img, s_transforms[i].name, imgproc_pool_size( pool ), t );
+  }
+
+  img_cleanup( &out );
+}
+
+// Time complement and emboss on img in packed form and in planar form
+// (see imgproc_planar.h), single-threaded since the planar functions
+// are. The planar results are given both on their own and including
+// the conversion from and back to the packed image, which is what a
+// caller holding a packed image would pay.
+static void bench_planar( const char *name, struct Image *img ) {
+  struct Image out;
+  struct PlanarImage planar, planar_out;
+  if ( img_init_uninitialized( &out, img->width, img->height, img->format ) != IMG_SUCCESS ) {
+    fprintf( stderr, "%s: couldn't allocate images, skipping planar comparison\n", name );
+    return;
+  }
+  if ( planar_init( &planar, img->width, img->height ) != IMG_SUCCESS ) {
+    fprintf( stderr, "%s: couldn't allocate images, skipping planar comparison\n", name );
+    img_cleanup( &out );
+    return;
+  }
+  if ( planar_init( &planar_out, img->width, img->height ) != IMG_SUCCESS ) {
+    fprintf( stderr, "%s: couldn't allocate images, skipping planar comparison\n", name );
+    planar_cleanup( &planar );
+    img_cleanup( &out );
+    return;
+  }
+
+  struct Timing t;
+  TIME_RUNS( t, planar_from_image( &planar, img ) );
+  report( name, img, "planar/split", 1, t );
+  TIME_RUNS( t, planar_to_image( &out, &planar ) );
+  report( name, img, "planar/join", 1, t );
+
+  TIME_RUNS( t, imgproc_complement_mt( NULL, img, &out ) );
+  report( name, img, "complement/packed", 1, t );
+  TIME_RUNS( t, planar_complement( &planar, &planar_out ) );
+  report( name, img, "complement/planar", 1, t );
+  TIME_RUNS( t, {
+    planar_from_image( &planar, img );
+    planar_complement( &planar, &planar_out );
+    planar_to_image( &out, &planar_out );
+  } );
+  report( name, img, "complement/planar+convert", 1, t );
+
+  TIME_RUNS( t, imgproc_emboss_mt( NULL, img, &out ) );
+  report( name, img, "emboss/packed", 1, t );
+  TIME_RUNS( t, planar_emboss( &planar, &planar_out ) );
+  report( name, img, "emboss/planar", 1, t );
+  TIME_RUNS( t, {
+    planar_from_image( &planar, img );
+    planar_emboss( &planar, &planar_out );
+    planar_to_image( &out, &planar_out );
+  } );
+  report( name, img, "emboss/planar+convert", 1, t );
+
+  planar_cleanup( &planar_out );
+  planar_cleanup( &planar );
+  img_cleanup( &out );
+}
+
+// Time writing img to the PNG file at path.
+// Returns 1 if successful, 0 otherwise.
+static int bench_encode( const char *name, struct Image *img, const char *path ) {
+  int rc = IMG_SUCCESS;
+  struct Timing t;
+  TIME_RUNS( t, if ( rc == IMG_SUCCESS ) rc = img_write( path, img ) );
+  if ( rc != IMG_SUCCESS ) {
+    fprintf( stderr, "%s: couldn't encode %dx%d image\n", name, img->width, img->height );
+    return 0;
+  }
+  report( name, img, "encode", 1, t );
+  return 1;
+}
+
+// Time reading the PNG file at path, reported as op. If keep is not
+// NULL, the last decoded image is stored in it (and must be cleaned up
+// by the caller.) Returns 1 if successful, 0 otherwise.
+static int bench_decode( const char *name, const char *path, const char *op, struct Image *keep ) {
+  struct Image img;
+  int have_img = 0;
+  struct Timing t;
+  TIME_RUNS( t, {
+    if ( have_img )
+      img_cleanup( &img );
+    have_img = img_read_native( path, &img ) == IMG_SUCCESS;
+  } );
+  if ( !have_img ) {
+    fprintf( stderr, "%s: couldn't decode image\n", name );
+    return 0;
+  }
+  report( name, &img, op, 1, t );
+  if ( keep != NULL )
+    *keep = img;
+  else
+    img_cleanup( &img );
+  return 1;
+}
+
+// Time decoding the PNG file at path straight into pixel bytes with
+// pnglite, unfiltering with the instruction set level (chosen for this
+// decoder alone), reported as op. img is the decoded image, for its size.
+static void bench_decode_simd( const char *path, const struct Image *img, int level, const char *op ) {
+  png_t png;
+  int rc = png_open_file_read( &png, path );
+  uint8_t *data = NULL;
+  if ( rc == PNG_NO_ERROR ) {
+    data = malloc( (size_t) png.width * png.height * png.bpp );
+    png_close_file( &png );
+  }
+  if ( data == NULL ) {
+    fprintf( stderr, "%s: couldn't allocate decode buffer\n", path );
+    return;
+  }
+  struct Timing t;
+  TIME_RUNS( t, {
+    png_t decoder;
+    if ( rc == PNG_NO_ERROR && (rc = png_open_file_mmap( &decoder, path )) == PNG_NO_ERROR ) {
+      png_set_simd( &decoder, level );
+      rc = png_get_data( &decoder, data );
+      png_close_file( &decoder );
+    }
+  } );
+  free( data );
+  if ( rc != PNG_NO_ERROR ) {
+    fprintf( stderr, "%s: couldn't decode image\n", path );
+    return;
+  }
+  report( path, img, op, 1, t );
+}
+
+static void bench_file( const char *path, struct ImgprocPool *pool, const char *tmp_path ) {
+  struct Image img;
+  if ( !bench_decode( path, path, "decode", &img ) )
+    return;
+
+  // decoding with each instruction set for unfiltering scanlines
+  static const char *const unfilter_ops[] = { "decode/scalar", "decode/sse2", "decode/ssse3" };
+  for ( int level = PNG_SIMD_NONE; level <= PNG_SIMD_SSSE3; level++ )
+    bench_decode_simd( path, &img, level, unfilter_ops[level] );
+
+  bench_transforms( path, &img, pool );
+  bench_planar( path, &img );
+  bench_encode( path, &img, tmp_path );
+  img_cleanup( &img );
+}
+
+// Benchmark a synthetic size x size image; it is decoded from the file
+// its encoding was written to
+static void bench_synthetic( int32_t size, struct ImgprocPool *pool, const char *tmp_path ) {
+  struct Image img;
+  if ( img_init( &img, size, size ) != IMG_SUCCESS ) {
+    fprintf( stderr, "synthetic: couldn't allocate %dx%d image, skipping\n", size, size );
+    return;
+  }
+  fill_synthetic( &img );
+  bench_transforms( "synthetic", &img, pool );
+  bench_planar( "synthetic", &img );
+  int encoded = bench_encode( "synthetic", &img, tmp_path );
+  img_cleanup( &img );
+  if ( encoded )
+    bench_decode( "synthetic", tmp_path, "decode", NULL );
+}
+
+////////////////////////////////////////////////////////////////////////
+// Kernel variants and thread scaling
+////////////////////////////////////////////////////////////////////////
+
+// The complement transformation as it was before the kernels: one
+// pixel at a time through the component accessors. This is the
+// baseline the kernel variants are measured against.
+static void complement_baseline( struct Image *in, struct Image *out ) {
+  for ( int row = 0; row < in->height; row++ ) {
+    for ( int col = 0; col < in->width; col++ ) {
+      uint32_t index = compute_index( in, row, col );
+      uint32_t pixel = in->data[index];
+      out->data[index] = make_pixel( 255 - get_r( pixel ), 255 - get_g( pixel ),
+                                     255 - get_b( pixel ), get_a( pixel ) );
+    }
+  }
+}
+
+// Time the baseline complement, every supported variant of the
+// kernels, and the emboss transformation with each variant dispatched
+static void bench_kernels( struct Image *in, struct Image *out ) {
+  size_t n = (size_t) in->stride * in->height;
+  enum KernelIsa dispatched = kernel_active_isa();
+  char op[64];
+  struct Timing t;
+
+  TIME_RUNS( t, complement_baseline( in, out ) );
+  report( "random", in, "complement/baseline", 1, t );
+
+  for ( int isa = 0; isa < KERNEL_ISA_COUNT; isa++ ) {
+    if ( !kernel_isa_supported( (enum KernelIsa) isa ) )
+      continue;
+    const char *isa_name = kernel_isa_name( (enum KernelIsa) isa );
+
+    if ( kernel_complement_impls[isa] != NULL ) {
+      TIME_RUNS( t, kernel_complement_impls[isa]( in->data, out->data, n ) );
+      snprintf( op, sizeof(op), "complement/%s", isa_name );
+      report( "random", in, op, 1, t );
+    }
+
+    if ( kernel_transpose_impls[isa] != NULL ) {
+      TIME_RUNS( t, kernel_transpose_impls[isa]( in->data, in->stride, out->data, out->stride,
+                                                 in->height, in->width ) );
+      snprintf( op, sizeof(op), "transpose/%s", isa_name );
+      report( "random", in, op, 1, t );
+
+      TIME_RUNS( t, kernel_transpose_inplace_impls[isa]( out->data, out->stride, out->width ) );
+      snprintf( op, sizeof(op), "transpose_inplace/%s", isa_name );
+      report( "random", in, op, 1, t );
+    }
+
+    if ( kernel_emboss_impls[isa] != NULL ) {
+      kernel_set_isa( (enum KernelIsa) isa );
+      TIME_RUNS( t, imgproc_emboss( in, out ) );
+      snprintf( op, sizeof(op), "emboss/%s", isa_name );
+      report( "random", in, op, 1, t );
+    }
+  }
+  kernel_set_isa( dispatched );
+}
+
+// Time every multithreaded transformation with 1 up to max_threads
+// threads
+static void bench_scaling( struct Image *in, struct Image *out, int max_threads ) {
+  for ( int threads = 1; threads <= max_threads; threads++ ) {
+    struct ImgprocPool *pool = imgproc_pool_create( threads );
+    if ( pool == NULL ) {
+      fprintf( stderr, "Error: couldn't create pool with %d threads\n", threads );
+      return;
+    }
+    for ( int i = 0; i < NUM_TRANSFORMS; i++ ) {
+      char op[64];
+      struct Timing t;
+      TIME_RUNS( t, s_transforms[i].fn( pool, in, out ) );
+      snprintf( op, sizeof(op), "%s_mt", s_transforms[i].name );
+      report( "random", in, op, threads, t );
+    }
+    imgproc_pool_destroy( pool );
+  }
+}
+
+////////////////////////////////////////////////////////////////////////
+// Batch processing
+////////////////////////////////////////////////////////////////////////
+
+// The chain applied to every image of the batch
+static const enum ImgprocOp s_batch_ops[] = { IMGPROC_OP_COMPLEMENT, IMGPROC_OP_EMBOSS };
+#define NUM_BATCH_OPS ( (int) ( sizeof( s_batch_ops ) / sizeof( s_batch_ops[0] ) ) )
+
+// Process every image of a list one at a time on the calling thread:
+// what a caller without the batch executor would do. Returns the
+// number of images which failed.
+static int batch_serial( const struct ImgprocBatchList *list ) {
+  int failed = 0;
+  for ( int i = 0; i < list->num_images; i++ ) {
+    struct Image img;
+    if ( img_read_native( list->inputs[i], &img ) != IMG_SUCCESS ) {
+      failed++;
+      continue;
+    }
+    if ( !imgproc_chain( NULL, s_batch_ops, NUM_BATCH_OPS, &img ) ||
+         img_write( list->outputs[i], &img ) != IMG_SUCCESS )
+      failed++;
+    img_cleanup( &img );
+  }
+  return failed;
+}
+
+// Time reading, transforming, and writing num_images PNG files, first
+// one image after another and then with imgproc_batch_run on the pool.
+// The files are copies of a synthetic image, in a temporary directory
+// under tmp_dir.
+static int bench_batch( int num_images, struct ImgprocPool *pool, const char *tmp_dir ) {
+  int32_t size = MAX_BATCH_SIZE;
+  if ( s_opts.max_size > 0 && s_opts.max_size < size )
+    size = s_opts.max_size;
+
+  char dir[4096];
+  snprintf( dir, sizeof(dir), "%s/imgproc_batch_XXXXXX", tmp_dir );
+  if ( mkdtemp( dir ) == NULL ) {
+    fprintf( stderr, "Error: couldn't create a temporary directory in %s\n", tmp_dir );
+    return 0;
+  }
+
+  struct Image img;
+  struct ImgprocBatchList list;
+  imgproc_batch_list_init( &list );
+  int allocated = img_init( &img, size, size ) == IMG_SUCCESS;
+  int success = allocated;
+  if ( !allocated ) {
+    fprintf( stderr, "Error: couldn't allocate %dx%d image\n", size, size );
+  } else {
+    fill_synthetic( &img );
+    for ( int i = 0; success && i < num_images; i++ ) {
+      char input[4200], output[4200];
+      snprintf( input, sizeof(input), "%s/in%04d.png", dir, i );
+      snprintf( output, sizeof(output), "%s/out%04d.png", dir, i );
+      if ( img_write( input, &img ) != IMG_SUCCESS ) {
+        fprintf( stderr, "Error: couldn't write %s\n", input );
+        success = 0;
+      } else if ( !imgproc_batch_list_add( &list, input, output ) ) {
+        fprintf( stderr, "Error: out of memory\n" );
+        success = 0;
+      }
+    }
+  }
+
+  if ( success ) {
+    struct Timing t;
+    int failed = 0;
+    TIME_RUNS( t, failed += batch_serial( &list ) );
+    report_batch( "synthetic", &img, "batch/serial", 1, num_images, t );
+    TIME_RUNS( t, failed += imgproc_batch_run( pool, &list, s_batch_ops, NUM_BATCH_OPS, NULL, 0 ) );
+    report_batch( "synthetic", &img, "batch/pipelined", imgproc_pool_size( pool ), num_images, t );
+    if ( failed != 0 ) {
+      fprintf( stderr, "Error: batch processing failed\n" );
+      success = 0;
+    }
+  }
+
+  for ( int i = 0; i < list.num_images; i++ ) {
+    unlink( list.inputs[i] );
+    unlink( list.outputs[i] );
+  }
+  rmdir( dir );
+  imgproc_batch_list_cleanup( &list );
+  if ( allocated )
+    img_cleanup( &img );
+  return success;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Main
+////////////////////////////////////////////////////////////////////////
+
+static void usage( void ) {
+  fprintf( stderr,
+           "Usage: %s [options] [image.png...]\n"
+           "Options:\n"
+           "  --reps N      timed runs per measurement (default %d)\n"
+           "  --warmup N    untimed runs before each measurement (default %d)\n"
+           "  --min-size N  side of the smallest synthetic image (default %d)\n"
+           "  --max-size N  side of the largest synthetic image (default %d, 0 for none)\n"
+           "  --threads N   threads used for the transformations (default 1)\n"
+           "  --kernels     also time every variant of the low-level kernels\n"
+           "  --scaling N   also time the transformations with 1 to N threads\n"
+           "  --batch N     also time processing a batch of N image files, one at\n"
+           "                a time and with the pipelined batch executor\n"
+           "  --json        print each result as one line of JSON\n",
+           s_program, DEFAULT_REPS, DEFAULT_WARMUP, DEFAULT_MIN_SIZE, DEFAULT_MAX_SIZE );
+  exit( 1 );
+}
+
+// Parse the value of the option at argv[*i], which must be at least min
+static int int_arg( int argc, char **argv, int *i, int min ) {
+  if ( *i + 1 >= argc )
+    usage();
+  char *end;
+  long val = strtol( argv[++*i], &end, 10 );
+  if ( *end != '\0' || val < min || val > 1000000 )
+    usage();
+  return (int) val;
+}
+
+int main( int argc, char **argv ) {
+  s_program = argv[0];
+
+  int i;
+  for ( i = 1; i < argc && strncmp( argv[i], "--", 2 ) == 0; i++ ) {
+    if ( strcmp( argv[i], "--reps" ) == 0 )
+      s_opts.reps = int_arg( argc, argv, &i, 1 );
+    else if ( strcmp( argv[i], "--warmup" ) == 0 )
+      s_opts.warmup = int_arg( argc, argv, &i, 0 );
+    else if ( strcmp( argv[i], "--min-size" ) == 0 )
+      s_opts.min_size = int_arg( argc, argv, &i, 1 );
+    else if ( strcmp( argv[i], "--max-size" ) == 0 )
+      s_opts.max_size = int_arg( argc, argv, &i, 0 );
+    else if ( strcmp( argv[i], "--threads" ) == 0 )
+      s_opts.threads = int_arg( argc, argv, &i, 1 );
+    else if ( strcmp( argv[i], "--scaling" ) == 0 )
+      s_opts.scaling_threads = int_arg( argc, argv, &i, 1 );
+    else if ( strcmp( argv[i], "--kernels" ) == 0 )
+      s_opts.kernels = 1;
+    else if ( strcmp( argv[i], "--batch" ) == 0 )
+      s_opts.batch_images = int_arg( argc, argv, &i, 1 );
+    else if ( strcmp( argv[i], "--json" ) == 0 )
+      s_opts.json = 1;
+    else
+      usage();
+  }
+
+  // encoded images are written to (and decoded from) a temporary file
+  const char *tmp_dir = getenv( "TMPDIR" ) != NULL ? getenv( "TMPDIR" ) : "/tmp";
+  char tmp_path[4096];
+  snprintf( tmp_path, sizeof(tmp_path), "%s/imgproc_bench_XXXXXX", tmp_dir );
+  int fd = mkstemp( tmp_path );
+  if ( fd < 0 ) {
+    fprintf( stderr, "Error: couldn't create a temporary file in %s\n", tmp_dir );
+    return 1;
+  }
+  close( fd );
+
+  struct ImgprocPool *pool = NULL;
+  if ( s_opts.threads > 1 && (pool = imgproc_pool_create( s_opts.threads )) == NULL ) {
+    fprintf( stderr, "Error: couldn't start %d threads\n", s_opts.threads );
+    unlink( tmp_path );
+    return 1;
+  }
+
+  print_header();
+
+  for ( ; i < argc; i++ )
+    bench_file( argv[i], pool, tmp_path );
+
+  // synthetic images, quadrupling the side each time
+  // (so 256, 1024, 4096 and 16384 by default)
+  for ( int64_t size = s_opts.min_size; s_opts.max_size > 0 && size <= s_opts.max_size; size *= 4 )
+    bench_synthetic( (int32_t) size, pool, tmp_path );
+
+  int rc = 0;
+  if ( s_opts.kernels || s_opts.scaling_threads > 0 ) {
+    int32_t size = MAX_KERNEL_SIZE;
+    if ( s_opts.max_size > 0 && s_opts.max_size < size )
+      size = s_opts.max_size;
+
+    struct Image in, out;
+    if ( img_init( &in, size, size ) != IMG_SUCCESS ) {
+      fprintf( stderr, "Error: couldn't allocate %dx%d images\n", size, size );
+      rc = 1;
+    } else if ( img_init( &out, size, size ) != IMG_SUCCESS ) {
+      fprintf( stderr, "Error: couldn't allocate %dx%d images\n", size, size );
+      img_cleanup( &in );
+      rc = 1;
+    } else {
+      fill_random( &in );
+      if ( s_opts.kernels )
+        bench_kernels( &in, &out );
+      if ( s_opts.scaling_threads > 0 )
+        bench_scaling( &in, &out, s_opts.scaling_threads );
+      img_cleanup( &in );
+      img_cleanup( &out );
+    }
+  }
+
+  if ( s_opts.batch_images > 0 && !bench_batch( s_opts.batch_images, pool, tmp_dir ) )
+    rc = 1;
+
+  imgproc_pool_destroy( pool );
+  unlink( tmp_path );
+  return rc;
+}
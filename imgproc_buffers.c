@@ -0,0 +1,145 @@
+// Buffer cache for pixel data and image file encoding/decoding
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "imgproc_buffers.h"
+
+// The smallest size class is 1 << MIN_CLASS_SHIFT bytes. Above it,
+// each power of two is divided into CLASS_STEPS classes, so rounding
+// a size up to its class wastes at most 25%.
+#define MIN_CLASS_SHIFT 6
+#define CLASS_STEPS 4
+#define NUM_CLASSES (((int) sizeof( size_t ) * 8 - MIN_CLASS_SHIFT) * CLASS_STEPS + 1)
+
+// Every block starts with a header, padded so that the buffer after it
+// is aligned. Cached blocks are linked through their headers.
+struct BufferHeader {
+  struct BufferHeader *next;
+  int size_class;
+};
+
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct BufferHeader *s_free[NUM_CLASSES];
+static size_t s_cache_limit = IMGPROC_BUFFER_CACHE_DEFAULT;
+static size_t s_cached_bytes;
+static size_t s_allocs, s_reused;
+
+// Return the class of a buffer of size bytes, and set *class_size to
+// the size of the buffers of that class. Returns -1 if size is too large.
+static int size_class( size_t size, size_t *class_size ) {
+  if ( size <= ((size_t) 1 << MIN_CLASS_SHIFT) ) {
+    *class_size = (size_t) 1 << MIN_CLASS_SHIFT;
+    return 0;
+  }
+  if ( size > SIZE_MAX / 2 )
+    return -1;
+
+  // 2^k <= size-1 < 2^(k+1), and (size-1) >> (k-2) is 4 to 7
+  int k = (int) sizeof( unsigned long long ) * 8 - 1 - __builtin_clzll( (unsigned long long) (size - 1) );
+  size_t step = (size_t) 1 << (k - 2);
+  size_t sub = ((size - 1) >> (k - 2)) - CLASS_STEPS;
+  *class_size = (CLASS_STEPS + sub + 1) * step;
+  return (k - MIN_CLASS_SHIFT) * CLASS_STEPS + (int) sub + 1;
+}
+
+static size_t class_size_of( int size_class ) {
+  if ( size_class == 0 )
+    return (size_t) 1 << MIN_CLASS_SHIFT;
+  int k = (size_class - 1) / CLASS_STEPS + MIN_CLASS_SHIFT;
+  size_t sub = (size_t) (size_class - 1) % CLASS_STEPS;
+  return (CLASS_STEPS + sub + 1) * ((size_t) 1 << (k - 2));
+}
+
+void *imgproc_buffer_alloc( size_t size ) {
+  size_t bytes;
+  int c = size_class( size, &bytes );
+  if ( c < 0 )
+    return NULL;
+
+  pthread_mutex_lock( &s_lock );
+  struct BufferHeader *block = s_free[c];
+  s_allocs++;
+  if ( block != NULL ) {
+    s_free[c] = block->next;
+    s_cached_bytes -= bytes;
+    s_reused++;
+  }
+  pthread_mutex_unlock( &s_lock );
+
+  if ( block == NULL ) {
+    void *mem;
+    if ( posix_memalign( &mem, IMGPROC_BUFFER_ALIGN, IMGPROC_BUFFER_ALIGN + bytes ) != 0 )
+      return NULL;
+    block = mem;
+    block->size_class = c;
+  }
+  return (uint8_t *) block + IMGPROC_BUFFER_ALIGN;
+}
+
+void imgproc_buffer_free( void *p ) {
+  if ( p == NULL )
+    return;
+
+  struct BufferHeader *block = (struct BufferHeader *) ((uint8_t *) p - IMGPROC_BUFFER_ALIGN);
+  size_t bytes = class_size_of( block->size_class );
+
+  pthread_mutex_lock( &s_lock );
+  int keep = s_cached_bytes + bytes <= s_cache_limit;
+  if ( keep ) {
+    block->next = s_free[block->size_class];
+    s_free[block->size_class] = block;
+    s_cached_bytes += bytes;
+  }
+  pthread_mutex_unlock( &s_lock );
+
+  if ( !keep )
+    free( block );
+}
+
+// Unlink cached blocks, largest first, until at most target bytes are
+// cached, and return them as a list. Called with s_lock held.
+static struct BufferHeader *take_cached( size_t target ) {
+  struct BufferHeader *taken = NULL;
+  for ( int c = NUM_CLASSES - 1; c >= 0 && s_cached_bytes > target; c-- ) {
+    while ( s_free[c] != NULL && s_cached_bytes > target ) {
+      struct BufferHeader *block = s_free[c];
+      s_free[c] = block->next;
+      s_cached_bytes -= class_size_of( c );
+      block->next = taken;
+      taken = block;
+    }
+  }
+  return taken;
+}
+
+static void free_blocks( struct BufferHeader *block ) {
+  while ( block != NULL ) {
+    struct BufferHeader *next = block->next;
+    free( block );
+    block = next;
+  }
+}
+
+void imgproc_buffer_set_cache_limit( size_t max_bytes ) {
+  pthread_mutex_lock( &s_lock );
+  s_cache_limit = max_bytes;
+  struct BufferHeader *taken = take_cached( max_bytes );
+  pthread_mutex_unlock( &s_lock );
+  free_blocks( taken );
+}
+
+void imgproc_buffer_trim( void ) {
+  pthread_mutex_lock( &s_lock );
+  struct BufferHeader *taken = take_cached( 0 );
+  pthread_mutex_unlock( &s_lock );
+  free_blocks( taken );
+}
+
+void imgproc_buffer_stats( struct ImgprocBufferStats *stats ) {
+  pthread_mutex_lock( &s_lock );
+  stats->allocs = s_allocs;
+  stats->reused = s_reused;
+  stats->cached_bytes = s_cached_bytes;
+  pthread_mutex_unlock( &s_lock );
+}
@@ -0,0 +1,56 @@
+// Header for the buffer cache used for pixel data and for pnglite's
+// and zlib's working memory. Freed buffers are kept on per-size free
+// lists and handed out again, so a program which reads, transforms,
+// and writes many images in a loop stops calling into the system
+// allocator (and stops mapping and unmapping large blocks) once it
+// has seen an image of each size. The cache is shared by all threads.
+
+#ifndef IMGPROC_BUFFERS_H
+#define IMGPROC_BUFFERS_H
+
+#include <stddef.h>
+
+//! Alignment of every buffer, in bytes (enough for image rows, see
+//! IMG_ROW_ALIGN, and for any vector type).
+#define IMGPROC_BUFFER_ALIGN 64
+
+//! Default limit on the total size of the buffers kept for reuse.
+#define IMGPROC_BUFFER_CACHE_DEFAULT (256u << 20)
+
+//! Counters describing the use of the buffer cache.
+struct ImgprocBufferStats {
+  size_t allocs;       // calls to imgproc_buffer_alloc
+  size_t reused;       // allocations satisfied from the cache
+  size_t cached_bytes; // total size of the buffers currently cached
+};
+
+//! Allocate a buffer of at least size bytes, aligned to
+//! IMGPROC_BUFFER_ALIGN. Its contents are not initialized. Sizes are
+//! rounded up to one of four classes per power of two, and a cached
+//! buffer of the same class is reused if there is one.
+//!
+//! @param size number of bytes needed
+//! @return pointer to the buffer, or NULL if there is not enough memory
+void *imgproc_buffer_alloc( size_t size );
+
+//! Return a buffer to the cache, or to the system if keeping it would
+//! exceed the cache limit.
+//!
+//! @param p a buffer from imgproc_buffer_alloc, or NULL
+void imgproc_buffer_free( void *p );
+
+//! Set the limit on the total size of the cached buffers, releasing
+//! cached buffers until it is met. 0 disables caching.
+//!
+//! @param max_bytes the new limit
+void imgproc_buffer_set_cache_limit( size_t max_bytes );
+
+//! Release every cached buffer to the system.
+void imgproc_buffer_trim( void );
+
+//! Get the cache's counters.
+//!
+//! @param stats set to the current counters
+void imgproc_buffer_stats( struct ImgprocBufferStats *stats );
+
+#endif // IMGPROC_BUFFERS_H
@@ -0,0 +1,74 @@
+// Execution of chains of image transformations
+
+#include "imgproc.h"
+#include "imgproc_kernels.h"
+#include "imgproc_chain.h"
+
+// A run of row-local stages, applied one band of rows at a time
+struct FusedJob {
+  struct Image *img;
+  const enum ImgprocOp *ops;
+  int num_ops;
+  int num_bands;
+};
+
+// Return whether a stage computes each output row from the same input
+// row only, so that it can be fused with its neighbors
+static int is_row_local( enum ImgprocOp op ) {
+  return op == IMGPROC_OP_COMPLEMENT || op == IMGPROC_OP_ELLIPSE;
+}
+
+static void fused_band( void *arg, int task ) {
+  struct FusedJob *job = arg;
+  struct Image *img = job->img;
+  int32_t row_begin, row_end;
+  imgproc_pool_band_rows( img->height, job->num_bands, task, &row_begin, &row_end );
+
+  for ( int32_t row = row_begin; row < row_end; row++ ) {
+    uint8_t *pixels = (uint8_t *) img->data + (size_t) compute_index( img, row, 0 ) * img_bytes_per_pixel( img );
+    for ( int i = 0; i < job->num_ops; i++ ) {
+      if ( job->ops[i] == IMGPROC_OP_COMPLEMENT ) {
+        kernel_complement_format( img->format, pixels, pixels, img->width );
+      } else {
+        int32_t start, end;
+        kernel_ellipse_span( img->width, img->height, row, &start, &end );
+        kernel_ellipse_row_format( img->format, pixels, pixels, img->width, start, end );
+      }
+    }
+  }
+}
+
+int imgproc_chain( struct ImgprocPool *pool, const enum ImgprocOp *ops, int num_ops, struct Image *img ) {
+  int i = 0;
+  while ( i < num_ops ) {
+    // find the run of row-local stages starting here
+    int run = 0;
+    while ( i + run < num_ops && is_row_local( ops[i + run] ) )
+      run++;
+
+    if ( run > 1 ) {
+      struct FusedJob job = { img, ops + i, run, imgproc_pool_num_bands( pool, img->height ) };
+      imgproc_pool_run( pool, job.num_bands, fused_band, &job );
+      i += run;
+      continue;
+    }
+
+    switch ( ops[i] ) {
+    case IMGPROC_OP_COMPLEMENT:
+      imgproc_complement_mt( pool, img, img );
+      break;
+    case IMGPROC_OP_ELLIPSE:
+      imgproc_ellipse_mt( pool, img, img );
+      break;
+    case IMGPROC_OP_TRANSPOSE:
+      if ( !imgproc_transpose_mt( pool, img, img ) )
+        return 0;
+      break;
+    case IMGPROC_OP_EMBOSS:
+      imgproc_emboss_mt( pool, img, img );
+      break;
+    }
+    i++;
+  }
+  return 1;
+}
@@ -0,0 +1,33 @@
+// Header for running a chain of image transformations in memory,
+// e.g. complement followed by ellipse followed by emboss, without
+// writing intermediate images to files.
+
+#ifndef IMGPROC_CHAIN_H
+#define IMGPROC_CHAIN_H
+
+#include "image.h"        // for struct Image
+#include "imgproc_pool.h" // for struct ImgprocPool
+
+//! The transformations which can be used as stages of a chain.
+enum ImgprocOp {
+  IMGPROC_OP_COMPLEMENT,
+  IMGPROC_OP_TRANSPOSE,
+  IMGPROC_OP_ELLIPSE,
+  IMGPROC_OP_EMBOSS,
+};
+
+//! Apply a sequence of transformations to an image, leaving the result
+//! in the same Image. Runs of consecutive row-local stages (complement
+//! and ellipse) are fused: each row goes through all of them while it
+//! is in cache, so the image is streamed through memory once per run
+//! instead of once per stage. Other stages run as separate passes.
+//!
+//! @param pool the pool to run on (NULL to use the calling thread only)
+//! @param ops the stages, in the order they should be applied
+//! @param num_ops number of stages
+//! @param img the Image to transform
+//! @return 1 if successful, 0 if a transpose stage failed because the
+//!         image is not square (no other stage can fail)
+int imgproc_chain( struct ImgprocPool *pool, const enum ImgprocOp *ops, int num_ops, struct Image *img );
+
+#endif // IMGPROC_CHAIN_H
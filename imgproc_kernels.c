@@ -0,0 +1,1426 @@
+// Low-level pixel kernels with runtime CPU dispatch
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "imgproc_kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KERNEL_HAVE_X86 1
+#include <immintrin.h>
+#else
+#define KERNEL_HAVE_X86 0
+#endif
+
+// XOR-ing a pixel with this mask inverts red, green, and blue
+// but leaves the alpha component (bits 0-7) alone
+#define COMPLEMENT_MASK 0xFFFFFF00U
+
+// Opaque black, used for pixels outside the ellipse
+#define OPAQUE_BLACK 0x000000FFU
+
+// Gray value 128 in the red, green, and blue components, used for
+// the top row and left column of embossed images
+#define EMBOSS_EDGE_GRAY 0x80808000U
+
+// Currently selected instruction set (see kernel_init)
+static enum KernelIsa s_active_isa = KERNEL_ISA_SCALAR;
+
+////////////////////////////////////////////////////////////////////////
+// Complement kernels
+////////////////////////////////////////////////////////////////////////
+
+static void complement_scalar( const uint32_t *in, uint32_t *out, size_t n ) {
+  for ( size_t i = 0; i < n; i++ ) {
+    out[i] = in[i] ^ COMPLEMENT_MASK;
+  }
+}
+
+// Two pixels per 64-bit word. memcpy is used for the loads and stores
+// since the pixel arrays are only guaranteed to be 4-byte aligned.
+static void complement_swar( const uint32_t *in, uint32_t *out, size_t n ) {
+  const uint64_t mask = ((uint64_t) COMPLEMENT_MASK << 32) | COMPLEMENT_MASK;
+  size_t i = 0;
+  for ( ; i + 2 <= n; i += 2 ) {
+    uint64_t w;
+    memcpy( &w, in + i, sizeof(w) );
+    w ^= mask;
+    memcpy( out + i, &w, sizeof(w) );
+  }
+  if ( i < n ) {
+    out[i] = in[i] ^ COMPLEMENT_MASK;
+  }
+}
+
+#if KERNEL_HAVE_X86
+static void complement_sse2( const uint32_t *in, uint32_t *out, size_t n ) {
+  const __m128i mask = _mm_set1_epi32( (int) COMPLEMENT_MASK );
+  size_t i = 0;
+  for ( ; i + 8 <= n; i += 8 ) {
+    __m128i a = _mm_loadu_si128( (const __m128i *) (in + i) );
+    __m128i b = _mm_loadu_si128( (const __m128i *) (in + i + 4) );
+    _mm_storeu_si128( (__m128i *) (out + i), _mm_xor_si128( a, mask ) );
+    _mm_storeu_si128( (__m128i *) (out + i + 4), _mm_xor_si128( b, mask ) );
+  }
+  complement_scalar( in + i, out + i, n - i );
+}
+
+__attribute__((target("avx2")))
+static void complement_avx2( const uint32_t *in, uint32_t *out, size_t n ) {
+  const __m256i mask = _mm256_set1_epi32( (int) COMPLEMENT_MASK );
+  size_t i = 0;
+  for ( ; i + 16 <= n; i += 16 ) {
+    __m256i a = _mm256_loadu_si256( (const __m256i *) (in + i) );
+    __m256i b = _mm256_loadu_si256( (const __m256i *) (in + i + 8) );
+    _mm256_storeu_si256( (__m256i *) (out + i), _mm256_xor_si256( a, mask ) );
+    _mm256_storeu_si256( (__m256i *) (out + i + 8), _mm256_xor_si256( b, mask ) );
+  }
+  complement_sse2( in + i, out + i, n - i );
+}
+#endif
+
+const complement_kernel_fn kernel_complement_impls[KERNEL_ISA_COUNT] = {
+  complement_scalar,
+  complement_swar,
+#if KERNEL_HAVE_X86
+  complement_sse2,
+  complement_avx2,
+#else
+  NULL,
+  NULL,
+#endif
+};
+
+////////////////////////////////////////////////////////////////////////
+// Transpose kernels
+////////////////////////////////////////////////////////////////////////
+
+// Blocks with at most this many pixels are small enough to be handled
+// by the simple loops at the bottom of the recursive decomposition
+#define TRANSPOSE_LEAF_PIXELS 256
+
+// Side length of the tiles walked by the SIMD kernels: a 64x64 tile of
+// source and destination pixels (32KB total) stays resident in L1/L2
+#define TRANSPOSE_TILE 64
+
+static void transpose_block_scalar( const uint32_t *src, size_t src_stride,
+                                    uint32_t *dst, size_t dst_stride,
+                                    size_t rows, size_t cols ) {
+  for ( size_t r = 0; r < rows; r++ ) {
+    for ( size_t c = 0; c < cols; c++ ) {
+      dst[c*dst_stride + r] = src[r*src_stride + c];
+    }
+  }
+}
+
+// Swap the rows x cols block x with the transpose of the cols x rows
+// block y (x and y must not overlap)
+static void transpose_swap_block_scalar( uint32_t *x, uint32_t *y, size_t stride,
+                                         size_t rows, size_t cols ) {
+  for ( size_t r = 0; r < rows; r++ ) {
+    for ( size_t c = 0; c < cols; c++ ) {
+      uint32_t tmp = x[r*stride + c];
+      x[r*stride + c] = y[c*stride + r];
+      y[c*stride + r] = tmp;
+    }
+  }
+}
+
+// Cache-oblivious transpose: split the longer dimension in half until
+// the block fits in cache, whatever the cache sizes happen to be
+static void transpose_recursive( const uint32_t *src, size_t src_stride,
+                                 uint32_t *dst, size_t dst_stride,
+                                 size_t rows, size_t cols ) {
+  if ( rows * cols <= TRANSPOSE_LEAF_PIXELS ) {
+    transpose_block_scalar( src, src_stride, dst, dst_stride, rows, cols );
+  } else if ( rows >= cols ) {
+    size_t h = rows / 2;
+    transpose_recursive( src, src_stride, dst, dst_stride, h, cols );
+    transpose_recursive( src + h*src_stride, src_stride, dst + h, dst_stride, rows - h, cols );
+  } else {
+    size_t h = cols / 2;
+    transpose_recursive( src, src_stride, dst, dst_stride, rows, h );
+    transpose_recursive( src + h, src_stride, dst + h*dst_stride, dst_stride, rows, cols - h );
+  }
+}
+
+static void transpose_swap_recursive( uint32_t *x, uint32_t *y, size_t stride,
+                                      size_t rows, size_t cols ) {
+  if ( rows * cols <= TRANSPOSE_LEAF_PIXELS ) {
+    transpose_swap_block_scalar( x, y, stride, rows, cols );
+  } else if ( rows >= cols ) {
+    size_t h = rows / 2;
+    transpose_swap_recursive( x, y, stride, h, cols );
+    transpose_swap_recursive( x + h*stride, y + h, stride, rows - h, cols );
+  } else {
+    size_t h = cols / 2;
+    transpose_swap_recursive( x, y, stride, rows, h );
+    transpose_swap_recursive( x + h, y + h*stride, stride, rows, cols - h );
+  }
+}
+
+// In place, the diagonal quadrants are transposed recursively and the
+// two off-diagonal quadrants are swapped with each other's transpose
+static void transpose_inplace_recursive( uint32_t *data, size_t stride, size_t n ) {
+  if ( n * n <= TRANSPOSE_LEAF_PIXELS ) {
+    for ( size_t r = 0; r < n; r++ )
+      transpose_swap_block_scalar( data + r*stride + r + 1, data + (r + 1)*stride + r, stride, 1, n - r - 1 );
+    return;
+  }
+  size_t h = n / 2;
+  transpose_inplace_recursive( data, stride, h );
+  transpose_inplace_recursive( data + h*stride + h, stride, n - h );
+  transpose_swap_recursive( data + h, data + h*stride, stride, h, n - h );
+}
+
+// Tiled drivers shared by the SIMD variants. BLOCK is the side length of
+// the register transpose, which must divide TRANSPOSE_TILE; pixels left
+// over at the right and bottom edges are handled by the scalar loops.
+#define DEFINE_TRANSPOSE_TILED( isa, BLOCK, ATTR ) \
+ATTR static void transpose_##isa( const uint32_t *src, size_t src_stride, \
+                                  uint32_t *dst, size_t dst_stride, \
+                                  size_t rows, size_t cols ) { \
+  size_t rows_b = rows - rows % BLOCK, cols_b = cols - cols % BLOCK; \
+  for ( size_t r0 = 0; r0 < rows_b; r0 += TRANSPOSE_TILE ) { \
+    size_t r1 = (r0 + TRANSPOSE_TILE < rows_b) ? r0 + TRANSPOSE_TILE : rows_b; \
+    for ( size_t c0 = 0; c0 < cols_b; c0 += TRANSPOSE_TILE ) { \
+      size_t c1 = (c0 + TRANSPOSE_TILE < cols_b) ? c0 + TRANSPOSE_TILE : cols_b; \
+      for ( size_t r = r0; r < r1; r += BLOCK ) \
+        for ( size_t c = c0; c < c1; c += BLOCK ) \
+          transpose_block_##isa( src + r*src_stride + c, src_stride, \
+                                 dst + c*dst_stride + r, dst_stride ); \
+    } \
+  } \
+  transpose_block_scalar( src + cols_b, src_stride, dst + cols_b*dst_stride, dst_stride, \
+                          rows_b, cols - cols_b ); \
+  transpose_block_scalar( src + rows_b*src_stride, src_stride, dst + rows_b, dst_stride, \
+                          rows - rows_b, cols ); \
+} \
+\
+ATTR static void transpose_swap_##isa( uint32_t *x, uint32_t *y, size_t stride, \
+                                       size_t rows, size_t cols ) { \
+  size_t rows_b = rows - rows % BLOCK, cols_b = cols - cols % BLOCK; \
+  for ( size_t r0 = 0; r0 < rows_b; r0 += TRANSPOSE_TILE ) { \
+    size_t r1 = (r0 + TRANSPOSE_TILE < rows_b) ? r0 + TRANSPOSE_TILE : rows_b; \
+    for ( size_t c0 = 0; c0 < cols_b; c0 += TRANSPOSE_TILE ) { \
+      size_t c1 = (c0 + TRANSPOSE_TILE < cols_b) ? c0 + TRANSPOSE_TILE : cols_b; \
+      for ( size_t r = r0; r < r1; r += BLOCK ) \
+        for ( size_t c = c0; c < c1; c += BLOCK ) \
+          transpose_swap_block_##isa( x + r*stride + c, y + c*stride + r, stride ); \
+    } \
+  } \
+  transpose_swap_block_scalar( x + cols_b, y + cols_b*stride, stride, rows_b, cols - cols_b ); \
+  transpose_swap_block_scalar( x + rows_b*stride, y + rows_b, stride, rows - rows_b, cols ); \
+} \
+\
+ATTR static void transpose_inplace_##isa( uint32_t *data, size_t stride, size_t n ) { \
+  size_t n_b = n - n % BLOCK; \
+  for ( size_t r0 = 0; r0 < n_b; r0 += TRANSPOSE_TILE ) { \
+    size_t r1 = (r0 + TRANSPOSE_TILE < n_b) ? r0 + TRANSPOSE_TILE : n_b; \
+    for ( size_t c0 = r0; c0 < n_b; c0 += TRANSPOSE_TILE ) { \
+      size_t c1 = (c0 + TRANSPOSE_TILE < n_b) ? c0 + TRANSPOSE_TILE : n_b; \
+      for ( size_t r = r0; r < r1; r += BLOCK ) \
+        for ( size_t c = (c0 > r) ? c0 : r; c < c1; c += BLOCK ) \
+          transpose_swap_block_##isa( data + r*stride + c, data + c*stride + r, stride ); \
+    } \
+  } \
+  transpose_swap_block_scalar( data + n_b, data + n_b*stride, stride, n_b, n - n_b ); \
+  transpose_inplace_recursive( data + n_b*stride + n_b, stride, n - n_b ); \
+}
+
+#if KERNEL_HAVE_X86
+// Transpose the 4x4 block in r0..r3 (one row per register)
+#define TRANSPOSE_4X4_SSE2( r0, r1, r2, r3 ) do { \
+  __m128i t0 = _mm_unpacklo_epi32( r0, r1 ); \
+  __m128i t1 = _mm_unpacklo_epi32( r2, r3 ); \
+  __m128i t2 = _mm_unpackhi_epi32( r0, r1 ); \
+  __m128i t3 = _mm_unpackhi_epi32( r2, r3 ); \
+  r0 = _mm_unpacklo_epi64( t0, t1 ); \
+  r1 = _mm_unpackhi_epi64( t0, t1 ); \
+  r2 = _mm_unpacklo_epi64( t2, t3 ); \
+  r3 = _mm_unpackhi_epi64( t2, t3 ); \
+} while (0)
+
+static inline void transpose_block_sse2( const uint32_t *src, size_t src_stride,
+                                         uint32_t *dst, size_t dst_stride ) {
+  __m128i r0 = _mm_loadu_si128( (const __m128i *) (src + 0*src_stride) );
+  __m128i r1 = _mm_loadu_si128( (const __m128i *) (src + 1*src_stride) );
+  __m128i r2 = _mm_loadu_si128( (const __m128i *) (src + 2*src_stride) );
+  __m128i r3 = _mm_loadu_si128( (const __m128i *) (src + 3*src_stride) );
+  TRANSPOSE_4X4_SSE2( r0, r1, r2, r3 );
+  _mm_storeu_si128( (__m128i *) (dst + 0*dst_stride), r0 );
+  _mm_storeu_si128( (__m128i *) (dst + 1*dst_stride), r1 );
+  _mm_storeu_si128( (__m128i *) (dst + 2*dst_stride), r2 );
+  _mm_storeu_si128( (__m128i *) (dst + 3*dst_stride), r3 );
+}
+
+// Swap block x with the transpose of block y. Both blocks are loaded
+// before anything is stored, so x == y (a diagonal block) also works.
+static inline void transpose_swap_block_sse2( uint32_t *x, uint32_t *y, size_t stride ) {
+  __m128i x0 = _mm_loadu_si128( (const __m128i *) (x + 0*stride) );
+  __m128i x1 = _mm_loadu_si128( (const __m128i *) (x + 1*stride) );
+  __m128i x2 = _mm_loadu_si128( (const __m128i *) (x + 2*stride) );
+  __m128i x3 = _mm_loadu_si128( (const __m128i *) (x + 3*stride) );
+  __m128i y0 = _mm_loadu_si128( (const __m128i *) (y + 0*stride) );
+  __m128i y1 = _mm_loadu_si128( (const __m128i *) (y + 1*stride) );
+  __m128i y2 = _mm_loadu_si128( (const __m128i *) (y + 2*stride) );
+  __m128i y3 = _mm_loadu_si128( (const __m128i *) (y + 3*stride) );
+  TRANSPOSE_4X4_SSE2( x0, x1, x2, x3 );
+  TRANSPOSE_4X4_SSE2( y0, y1, y2, y3 );
+  _mm_storeu_si128( (__m128i *) (y + 0*stride), x0 );
+  _mm_storeu_si128( (__m128i *) (y + 1*stride), x1 );
+  _mm_storeu_si128( (__m128i *) (y + 2*stride), x2 );
+  _mm_storeu_si128( (__m128i *) (y + 3*stride), x3 );
+  _mm_storeu_si128( (__m128i *) (x + 0*stride), y0 );
+  _mm_storeu_si128( (__m128i *) (x + 1*stride), y1 );
+  _mm_storeu_si128( (__m128i *) (x + 2*stride), y2 );
+  _mm_storeu_si128( (__m128i *) (x + 3*stride), y3 );
+}
+
+DEFINE_TRANSPOSE_TILED( sse2, 4, )
+
+// Transpose the 8x8 block in r[0..7] (one row per register): 32-bit and
+// 64-bit interleaves within each 128-bit lane, then swap lane halves
+__attribute__((target("avx2")))
+static inline void transpose_8x8_avx2( __m256i r[8] ) {
+  __m256i t0 = _mm256_unpacklo_epi32( r[0], r[1] );
+  __m256i t1 = _mm256_unpackhi_epi32( r[0], r[1] );
+  __m256i t2 = _mm256_unpacklo_epi32( r[2], r[3] );
+  __m256i t3 = _mm256_unpackhi_epi32( r[2], r[3] );
+  __m256i t4 = _mm256_unpacklo_epi32( r[4], r[5] );
+  __m256i t5 = _mm256_unpackhi_epi32( r[4], r[5] );
+  __m256i t6 = _mm256_unpacklo_epi32( r[6], r[7] );
+  __m256i t7 = _mm256_unpackhi_epi32( r[6], r[7] );
+  __m256i u0 = _mm256_unpacklo_epi64( t0, t2 );
+  __m256i u1 = _mm256_unpackhi_epi64( t0, t2 );
+  __m256i u2 = _mm256_unpacklo_epi64( t1, t3 );
+  __m256i u3 = _mm256_unpackhi_epi64( t1, t3 );
+  __m256i u4 = _mm256_unpacklo_epi64( t4, t6 );
+  __m256i u5 = _mm256_unpackhi_epi64( t4, t6 );
+  __m256i u6 = _mm256_unpacklo_epi64( t5, t7 );
+  __m256i u7 = _mm256_unpackhi_epi64( t5, t7 );
+  r[0] = _mm256_permute2x128_si256( u0, u4, 0x20 );
+  r[1] = _mm256_permute2x128_si256( u1, u5, 0x20 );
+  r[2] = _mm256_permute2x128_si256( u2, u6, 0x20 );
+  r[3] = _mm256_permute2x128_si256( u3, u7, 0x20 );
+  r[4] = _mm256_permute2x128_si256( u0, u4, 0x31 );
+  r[5] = _mm256_permute2x128_si256( u1, u5, 0x31 );
+  r[6] = _mm256_permute2x128_si256( u2, u6, 0x31 );
+  r[7] = _mm256_permute2x128_si256( u3, u7, 0x31 );
+}
+
+__attribute__((target("avx2")))
+static inline void transpose_block_avx2( const uint32_t *src, size_t src_stride,
+                                         uint32_t *dst, size_t dst_stride ) {
+  __m256i r[8];
+  for ( int i = 0; i < 8; i++ )
+    r[i] = _mm256_loadu_si256( (const __m256i *) (src + i*src_stride) );
+  transpose_8x8_avx2( r );
+  for ( int i = 0; i < 8; i++ )
+    _mm256_storeu_si256( (__m256i *) (dst + i*dst_stride), r[i] );
+}
+
+__attribute__((target("avx2")))
+static inline void transpose_swap_block_avx2( uint32_t *x, uint32_t *y, size_t stride ) {
+  __m256i xr[8], yr[8];
+  for ( int i = 0; i < 8; i++ ) {
+    xr[i] = _mm256_loadu_si256( (const __m256i *) (x + i*stride) );
+    yr[i] = _mm256_loadu_si256( (const __m256i *) (y + i*stride) );
+  }
+  transpose_8x8_avx2( xr );
+  transpose_8x8_avx2( yr );
+  for ( int i = 0; i < 8; i++ ) {
+    _mm256_storeu_si256( (__m256i *) (y + i*stride), xr[i] );
+    _mm256_storeu_si256( (__m256i *) (x + i*stride), yr[i] );
+  }
+}
+
+DEFINE_TRANSPOSE_TILED( avx2, 8, __attribute__((target("avx2"))) )
+#endif
+
+const transpose_kernel_fn kernel_transpose_impls[KERNEL_ISA_COUNT] = {
+  transpose_recursive,
+  transpose_recursive,
+#if KERNEL_HAVE_X86
+  transpose_sse2,
+  transpose_avx2,
+#else
+  NULL,
+  NULL,
+#endif
+};
+
+const transpose_inplace_kernel_fn kernel_transpose_inplace_impls[KERNEL_ISA_COUNT] = {
+  transpose_inplace_recursive,
+  transpose_inplace_recursive,
+#if KERNEL_HAVE_X86
+  transpose_inplace_sse2,
+  transpose_inplace_avx2,
+#else
+  NULL,
+  NULL,
+#endif
+};
+
+const transpose_swap_kernel_fn kernel_transpose_swap_impls[KERNEL_ISA_COUNT] = {
+  transpose_swap_recursive,
+  transpose_swap_recursive,
+#if KERNEL_HAVE_X86
+  transpose_swap_sse2,
+  transpose_swap_avx2,
+#else
+  NULL,
+  NULL,
+#endif
+};
+
+////////////////////////////////////////////////////////////////////////
+// Fill kernels
+////////////////////////////////////////////////////////////////////////
+
+static void fill_scalar( uint32_t *out, size_t n, uint32_t value ) {
+  for ( size_t i = 0; i < n; i++ ) {
+    out[i] = value;
+  }
+}
+
+static void fill_swar( uint32_t *out, size_t n, uint32_t value ) {
+  const uint64_t w = ((uint64_t) value << 32) | value;
+  size_t i = 0;
+  for ( ; i + 2 <= n; i += 2 ) {
+    memcpy( out + i, &w, sizeof(w) );
+  }
+  if ( i < n ) {
+    out[i] = value;
+  }
+}
+
+#if KERNEL_HAVE_X86
+static void fill_sse2( uint32_t *out, size_t n, uint32_t value ) {
+  const __m128i v = _mm_set1_epi32( (int) value );
+  size_t i = 0;
+  for ( ; i + 8 <= n; i += 8 ) {
+    _mm_storeu_si128( (__m128i *) (out + i), v );
+    _mm_storeu_si128( (__m128i *) (out + i + 4), v );
+  }
+  fill_scalar( out + i, n - i, value );
+}
+
+__attribute__((target("avx2")))
+static void fill_avx2( uint32_t *out, size_t n, uint32_t value ) {
+  const __m256i v = _mm256_set1_epi32( (int) value );
+  size_t i = 0;
+  for ( ; i + 16 <= n; i += 16 ) {
+    _mm256_storeu_si256( (__m256i *) (out + i), v );
+    _mm256_storeu_si256( (__m256i *) (out + i + 8), v );
+  }
+  fill_sse2( out + i, n - i, value );
+}
+#endif
+
+const fill_kernel_fn kernel_fill_impls[KERNEL_ISA_COUNT] = {
+  fill_scalar,
+  fill_swar,
+#if KERNEL_HAVE_X86
+  fill_sse2,
+  fill_avx2,
+#else
+  NULL,
+  NULL,
+#endif
+};
+
+////////////////////////////////////////////////////////////////////////
+// Byte swap kernels
+////////////////////////////////////////////////////////////////////////
+
+// out is not necessarily 4-byte aligned (PNG scanlines start after a
+// filter type byte), so every variant stores through memcpy or
+// unaligned vector stores.
+
+static void byteswap_scalar( const uint32_t *in, uint8_t *out, size_t n ) {
+  for ( size_t i = 0; i < n; i++ ) {
+    uint32_t p = __builtin_bswap32( in[i] );
+    memcpy( out + 4 * i, &p, sizeof(p) );
+  }
+}
+
+// Swapping all 8 bytes of a two-pixel word also swaps the two pixels,
+// which the 32-bit rotate undoes
+static void byteswap_swar( const uint32_t *in, uint8_t *out, size_t n ) {
+  size_t i = 0;
+  for ( ; i + 2 <= n; i += 2 ) {
+    uint64_t w;
+    memcpy( &w, in + i, sizeof(w) );
+    w = __builtin_bswap64( w );
+    w = (w << 32) | (w >> 32);
+    memcpy( out + 4 * i, &w, sizeof(w) );
+  }
+  byteswap_scalar( in + i, out + 4 * i, n - i );
+}
+
+#if KERNEL_HAVE_X86
+// SSE2 has no byte shuffle: swap the 16-bit halves of each pixel, then
+// the bytes within each half
+static inline __m128i byteswap_epi32_sse2( __m128i v ) {
+  v = _mm_shufflehi_epi16( _mm_shufflelo_epi16( v, 0xB1 ), 0xB1 );
+  return _mm_or_si128( _mm_slli_epi16( v, 8 ), _mm_srli_epi16( v, 8 ) );
+}
+
+static void byteswap_sse2( const uint32_t *in, uint8_t *out, size_t n ) {
+  size_t i = 0;
+  for ( ; i + 8 <= n; i += 8 ) {
+    __m128i a = _mm_loadu_si128( (const __m128i *) (in + i) );
+    __m128i b = _mm_loadu_si128( (const __m128i *) (in + i + 4) );
+    _mm_storeu_si128( (__m128i *) (out + 4 * i), byteswap_epi32_sse2( a ) );
+    _mm_storeu_si128( (__m128i *) (out + 4 * i + 16), byteswap_epi32_sse2( b ) );
+  }
+  byteswap_scalar( in + i, out + 4 * i, n - i );
+}
+
+__attribute__((target("avx2")))
+static void byteswap_avx2( const uint32_t *in, uint8_t *out, size_t n ) {
+  const __m256i shuf = _mm256_setr_epi8( 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                         3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12 );
+  size_t i = 0;
+  for ( ; i + 16 <= n; i += 16 ) {
+    __m256i a = _mm256_loadu_si256( (const __m256i *) (in + i) );
+    __m256i b = _mm256_loadu_si256( (const __m256i *) (in + i + 8) );
+    _mm256_storeu_si256( (__m256i *) (out + 4 * i), _mm256_shuffle_epi8( a, shuf ) );
+    _mm256_storeu_si256( (__m256i *) (out + 4 * i + 32), _mm256_shuffle_epi8( b, shuf ) );
+  }
+  byteswap_sse2( in + i, out + 4 * i, n - i );
+}
+#endif
+
+const byteswap_kernel_fn kernel_byteswap_impls[KERNEL_ISA_COUNT] = {
+  byteswap_scalar,
+  byteswap_swar,
+#if KERNEL_HAVE_X86
+  byteswap_sse2,
+  byteswap_avx2,
+#else
+  NULL,
+  NULL,
+#endif
+};
+
+////////////////////////////////////////////////////////////////////////
+// RGB expansion and narrowing kernels
+////////////////////////////////////////////////////////////////////////
+
+static void rgb_to_rgba_scalar( const uint8_t *in, uint32_t *out, size_t n ) {
+  for ( size_t i = 0; i < n; i++ ) {
+    const uint8_t *p = in + 3 * i;
+    out[i] = ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | 0xFFU;
+  }
+}
+
+#if KERNEL_HAVE_X86
+// Eight pixels per iteration: each 128-bit lane gets 12 input bytes
+// (four pixels), which vpshufb moves into place in reversed order with
+// zeros for alpha, then alpha is set. The second lane's load reads 4
+// bytes past its pixels, which must still be inside the input.
+__attribute__((target("avx2")))
+static void rgb_to_rgba_avx2( const uint8_t *in, uint32_t *out, size_t n ) {
+  const __m256i shuf = _mm256_setr_epi8( -1, 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9,
+                                         -1, 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9 );
+  const __m256i alpha = _mm256_set1_epi32( 0xFF );
+  size_t i = 0;
+  for ( ; 3 * i + 28 <= 3 * n; i += 8 ) {
+    __m128i lo = _mm_loadu_si128( (const __m128i *) (in + 3 * i) );
+    __m128i hi = _mm_loadu_si128( (const __m128i *) (in + 3 * i + 12) );
+    __m256i v = _mm256_inserti128_si256( _mm256_castsi128_si256( lo ), hi, 1 );
+    v = _mm256_or_si256( _mm256_shuffle_epi8( v, shuf ), alpha );
+    _mm256_storeu_si256( (__m256i *) (out + i), v );
+  }
+  rgb_to_rgba_scalar( in + 3 * i, out + i, n - i );
+}
+#endif
+
+// Without a byte shuffle there is nothing to gain over the scalar code,
+// so the SWAR and SSE2 entries use it
+const rgb_to_rgba_kernel_fn kernel_rgb_to_rgba_impls[KERNEL_ISA_COUNT] = {
+  rgb_to_rgba_scalar,
+  rgb_to_rgba_scalar,
+#if KERNEL_HAVE_X86
+  rgb_to_rgba_scalar,
+  rgb_to_rgba_avx2,
+#else
+  NULL,
+  NULL,
+#endif
+};
+
+static void rgba_to_rgb_scalar( const uint32_t *in, uint8_t *out, size_t n ) {
+  for ( size_t i = 0; i < n; i++ ) {
+    uint8_t *p = out + 3 * i;
+    p[0] = (uint8_t) (in[i] >> 24);
+    p[1] = (uint8_t) (in[i] >> 16);
+    p[2] = (uint8_t) (in[i] >> 8);
+  }
+}
+
+#if KERNEL_HAVE_X86
+// The reverse of rgb_to_rgba_avx2: vpshufb packs the color bytes of each
+// lane's four pixels into its low 12 bytes. Each lane is stored with a
+// 16-byte store whose last 4 bytes are overwritten by the next store,
+// so the loop stops while 4 bytes of output are left past the second.
+__attribute__((target("avx2")))
+static void rgba_to_rgb_avx2( const uint32_t *in, uint8_t *out, size_t n ) {
+  const __m256i shuf = _mm256_setr_epi8( 3, 2, 1, 7, 6, 5, 11, 10, 9, 15, 14, 13, -1, -1, -1, -1,
+                                         3, 2, 1, 7, 6, 5, 11, 10, 9, 15, 14, 13, -1, -1, -1, -1 );
+  size_t i = 0;
+  for ( ; 3 * i + 28 <= 3 * n; i += 8 ) {
+    __m256i v = _mm256_shuffle_epi8( _mm256_loadu_si256( (const __m256i *) (in + i) ), shuf );
+    _mm_storeu_si128( (__m128i *) (out + 3 * i), _mm256_castsi256_si128( v ) );
+    _mm_storeu_si128( (__m128i *) (out + 3 * i + 12), _mm256_extracti128_si256( v, 1 ) );
+  }
+  rgba_to_rgb_scalar( in + i, out + 3 * i, n - i );
+}
+#endif
+
+const rgba_to_rgb_kernel_fn kernel_rgba_to_rgb_impls[KERNEL_ISA_COUNT] = {
+  rgba_to_rgb_scalar,
+  rgba_to_rgb_scalar,
+#if KERNEL_HAVE_X86
+  rgba_to_rgb_scalar,
+  rgba_to_rgb_avx2,
+#else
+  NULL,
+  NULL,
+#endif
+};
+
+////////////////////////////////////////////////////////////////////////
+// Ellipse
+////////////////////////////////////////////////////////////////////////
+
+// One term of the ellipse inequality, floor(10000*d*d / (r*r)), or
+// INT64_MAX if that doesn't fit. 10000*d*d overflows 64 bits once |d|
+// passes about 3e7, so it is formed in 128 bits: exact for every
+// int32_t width and height. A zero radius only admits d == 0 (treating
+// 0/0 as 0).
+static int64_t ellipse_term( int64_t d, int64_t r ) {
+  if ( r == 0 )
+    return (d == 0) ? 0 : INT64_MAX;
+  unsigned __int128 num = (unsigned __int128) 10000 * (uint64_t) (d * d);
+  unsigned __int128 term = num / (uint64_t) (r * r);
+  return (term > INT64_MAX) ? INT64_MAX : (int64_t) term;
+}
+
+void kernel_ellipse_span( int32_t width, int32_t height, int32_t row,
+                          int32_t *start, int32_t *end ) {
+  int64_t a = width / 2;
+  int64_t b = height / 2;
+  int64_t y = b - row;
+
+  // budget left over for the horizontal term
+  int64_t ty = ellipse_term( y, b );
+  if ( ty > 10000 ) {
+    *start = *end = 0;
+    return;
+  }
+  int64_t budget = 10000 - ty;
+
+  // The horizontal term grows with |x|, so the row is inside the
+  // ellipse for |x| <= xmax. Estimate xmax = a*sqrt((budget+1)/10000)
+  // in floating point, then correct it with the exact integer test.
+  int64_t xmax = 0;
+  if ( a > 0 ) {
+    xmax = (int64_t) (a * sqrt( (budget + 1) / 10000.0 ));
+    while ( xmax > 0 && ellipse_term( xmax, a ) > budget )
+      xmax--;
+    while ( ellipse_term( xmax + 1, a ) <= budget )
+      xmax++;
+  }
+
+  int64_t first = a - xmax, last = a + xmax + 1;
+  *start = (int32_t) (first < 0 ? 0 : first);
+  *end = (int32_t) (last > width ? width : last);
+}
+
+void kernel_ellipse_row( const uint32_t *in, uint32_t *out, int32_t width,
+                         int32_t start, int32_t end ) {
+  kernel_fill( out, start, OPAQUE_BLACK );
+  if ( in != out )
+    memcpy( out + start, in + start, (size_t) (end - start) * sizeof(uint32_t) );
+  kernel_fill( out + end, width - end, OPAQUE_BLACK );
+}
+
+////////////////////////////////////////////////////////////////////////
+// Emboss kernels
+////////////////////////////////////////////////////////////////////////
+
+// Emboss one pixel p with upper-left neighbor q: the gray value in the
+// red, green, and blue components, and zero alpha
+static inline uint32_t emboss_gray( uint32_t p, uint32_t q ) {
+  int diff_r = (int) (q >> 24) - (int) (p >> 24);
+  int diff_g = (int) ((q >> 16) & 0xFF) - (int) ((p >> 16) & 0xFF);
+  int diff_b = (int) ((q >> 8) & 0xFF) - (int) ((p >> 8) & 0xFF);
+
+  // on ties red wins over green, and green over blue
+  int diff = diff_r;
+  if ( abs( diff_g ) > abs( diff ) )
+    diff = diff_g;
+  if ( abs( diff_b ) > abs( diff ) )
+    diff = diff_b;
+
+  int gray = diff + 128;
+  if ( gray > 255 )
+    gray = 255;
+  else if ( gray < 0 )
+    gray = 0;
+
+  return (uint32_t) gray * 0x01010100U;
+}
+
+static void emboss_scalar( const uint32_t *in, const uint32_t *ul, uint32_t *out, size_t n ) {
+  for ( size_t i = 0; i < n; i++ ) {
+    uint32_t p = in[i];
+    out[i] = emboss_gray( p, ul[i] ) | (p & 0xFF);
+  }
+}
+
+#if KERNEL_HAVE_X86
+// The SIMD kernels work on 32-bit lanes (one pixel per lane): extract
+// the channels, pick the difference with the largest magnitude using
+// strict comparisons (which preserves the red > green > blue priority),
+// add 128, then narrow to bytes with saturating packs, which performs
+// the clamp to 0..255. The packs and unpacks both operate within 128-bit
+// lanes, so narrowing two vectors and widening again restores the
+// original pixel order even for AVX2.
+
+static inline __m128i emboss_diff_sse2( __m128i p, __m128i q ) {
+  const __m128i m = _mm_set1_epi32( 0xFF );
+  __m128i d_r = _mm_sub_epi32( _mm_srli_epi32( q, 24 ), _mm_srli_epi32( p, 24 ) );
+  __m128i d_g = _mm_sub_epi32( _mm_and_si128( _mm_srli_epi32( q, 16 ), m ),
+                               _mm_and_si128( _mm_srli_epi32( p, 16 ), m ) );
+  __m128i d_b = _mm_sub_epi32( _mm_and_si128( _mm_srli_epi32( q, 8 ), m ),
+                               _mm_and_si128( _mm_srli_epi32( p, 8 ), m ) );
+
+  // |x| = (x ^ sign) - sign
+  __m128i s_r = _mm_srai_epi32( d_r, 31 ), s_g = _mm_srai_epi32( d_g, 31 ), s_b = _mm_srai_epi32( d_b, 31 );
+  __m128i a_r = _mm_sub_epi32( _mm_xor_si128( d_r, s_r ), s_r );
+  __m128i a_g = _mm_sub_epi32( _mm_xor_si128( d_g, s_g ), s_g );
+  __m128i a_b = _mm_sub_epi32( _mm_xor_si128( d_b, s_b ), s_b );
+
+  __m128i sel = _mm_cmpgt_epi32( a_g, a_r );
+  __m128i diff = _mm_or_si128( _mm_and_si128( sel, d_g ), _mm_andnot_si128( sel, d_r ) );
+  __m128i a_diff = _mm_or_si128( _mm_and_si128( sel, a_g ), _mm_andnot_si128( sel, a_r ) );
+  sel = _mm_cmpgt_epi32( a_b, a_diff );
+  diff = _mm_or_si128( _mm_and_si128( sel, d_b ), _mm_andnot_si128( sel, diff ) );
+
+  return _mm_add_epi32( diff, _mm_set1_epi32( 128 ) );
+}
+
+static void emboss_sse2( const uint32_t *in, const uint32_t *ul, uint32_t *out, size_t n ) {
+  const __m128i alpha_mask = _mm_set1_epi32( 0xFF );
+  const __m128i rgb_mask = _mm_set1_epi32( (int) 0xFFFFFF00U );
+  size_t i = 0;
+  for ( ; i + 8 <= n; i += 8 ) {
+    __m128i p0 = _mm_loadu_si128( (const __m128i *) (in + i) );
+    __m128i p1 = _mm_loadu_si128( (const __m128i *) (in + i + 4) );
+    __m128i g0 = emboss_diff_sse2( p0, _mm_loadu_si128( (const __m128i *) (ul + i) ) );
+    __m128i g1 = emboss_diff_sse2( p1, _mm_loadu_si128( (const __m128i *) (ul + i + 4) ) );
+
+    // clamp to 0..255 and replicate each gray byte into all four bytes
+    __m128i g8 = _mm_packus_epi16( _mm_packs_epi32( g0, g1 ), _mm_setzero_si128() );
+    __m128i g16 = _mm_unpacklo_epi8( g8, g8 );
+    g0 = _mm_unpacklo_epi16( g16, g16 );
+    g1 = _mm_unpackhi_epi16( g16, g16 );
+
+    _mm_storeu_si128( (__m128i *) (out + i),
+                      _mm_or_si128( _mm_and_si128( g0, rgb_mask ), _mm_and_si128( p0, alpha_mask ) ) );
+    _mm_storeu_si128( (__m128i *) (out + i + 4),
+                      _mm_or_si128( _mm_and_si128( g1, rgb_mask ), _mm_and_si128( p1, alpha_mask ) ) );
+  }
+  emboss_scalar( in + i, ul + i, out + i, n - i );
+}
+
+__attribute__((target("avx2")))
+static inline __m256i emboss_diff_avx2( __m256i p, __m256i q ) {
+  const __m256i m = _mm256_set1_epi32( 0xFF );
+  __m256i d_r = _mm256_sub_epi32( _mm256_srli_epi32( q, 24 ), _mm256_srli_epi32( p, 24 ) );
+  __m256i d_g = _mm256_sub_epi32( _mm256_and_si256( _mm256_srli_epi32( q, 16 ), m ),
+                                  _mm256_and_si256( _mm256_srli_epi32( p, 16 ), m ) );
+  __m256i d_b = _mm256_sub_epi32( _mm256_and_si256( _mm256_srli_epi32( q, 8 ), m ),
+                                  _mm256_and_si256( _mm256_srli_epi32( p, 8 ), m ) );
+  __m256i a_r = _mm256_abs_epi32( d_r );
+  __m256i a_g = _mm256_abs_epi32( d_g );
+  __m256i a_b = _mm256_abs_epi32( d_b );
+
+  __m256i sel = _mm256_cmpgt_epi32( a_g, a_r );
+  __m256i diff = _mm256_blendv_epi8( d_r, d_g, sel );
+  __m256i a_diff = _mm256_blendv_epi8( a_r, a_g, sel );
+  sel = _mm256_cmpgt_epi32( a_b, a_diff );
+  diff = _mm256_blendv_epi8( diff, d_b, sel );
+
+  return _mm256_add_epi32( diff, _mm256_set1_epi32( 128 ) );
+}
+
+__attribute__((target("avx2")))
+static void emboss_avx2( const uint32_t *in, const uint32_t *ul, uint32_t *out, size_t n ) {
+  const __m256i alpha_mask = _mm256_set1_epi32( 0xFF );
+  const __m256i rgb_mask = _mm256_set1_epi32( (int) 0xFFFFFF00U );
+  size_t i = 0;
+  for ( ; i + 16 <= n; i += 16 ) {
+    __m256i p0 = _mm256_loadu_si256( (const __m256i *) (in + i) );
+    __m256i p1 = _mm256_loadu_si256( (const __m256i *) (in + i + 8) );
+    __m256i g0 = emboss_diff_avx2( p0, _mm256_loadu_si256( (const __m256i *) (ul + i) ) );
+    __m256i g1 = emboss_diff_avx2( p1, _mm256_loadu_si256( (const __m256i *) (ul + i + 8) ) );
+
+    __m256i g8 = _mm256_packus_epi16( _mm256_packs_epi32( g0, g1 ), _mm256_setzero_si256() );
+    __m256i g16 = _mm256_unpacklo_epi8( g8, g8 );
+    g0 = _mm256_unpacklo_epi16( g16, g16 );
+    g1 = _mm256_unpackhi_epi16( g16, g16 );
+
+    _mm256_storeu_si256( (__m256i *) (out + i),
+                         _mm256_or_si256( _mm256_and_si256( g0, rgb_mask ), _mm256_and_si256( p0, alpha_mask ) ) );
+    _mm256_storeu_si256( (__m256i *) (out + i + 8),
+                         _mm256_or_si256( _mm256_and_si256( g1, rgb_mask ), _mm256_and_si256( p1, alpha_mask ) ) );
+  }
+  emboss_sse2( in + i, ul + i, out + i, n - i );
+}
+#endif
+
+const emboss_kernel_fn kernel_emboss_impls[KERNEL_ISA_COUNT] = {
+  emboss_scalar,
+  emboss_scalar,
+#if KERNEL_HAVE_X86
+  emboss_sse2,
+  emboss_avx2,
+#else
+  NULL,
+  NULL,
+#endif
+};
+
+////////////////////////////////////////////////////////////////////////
+// Planar kernels
+////////////////////////////////////////////////////////////////////////
+
+// Conversion between packed RGBA pixels and separate R, G, B, A planes.
+// The vector variants rely on x86 being little-endian: a pixel is the
+// bytes A, B, G, R in memory.
+
+static void deinterleave_scalar( const uint32_t *in, uint8_t *r, uint8_t *g, uint8_t *b, uint8_t *a, size_t n ) {
+  for ( size_t i = 0; i < n; i++ ) {
+    uint32_t p = in[i];
+    r[i] = (uint8_t) (p >> 24);
+    g[i] = (uint8_t) (p >> 16);
+    b[i] = (uint8_t) (p >> 8);
+    a[i] = (uint8_t) p;
+  }
+}
+
+static void interleave_scalar( const uint8_t *r, const uint8_t *g, const uint8_t *b, const uint8_t *a,
+                               uint32_t *out, size_t n ) {
+  for ( size_t i = 0; i < n; i++ ) {
+    out[i] = ((uint32_t) r[i] << 24) | ((uint32_t) g[i] << 16) | ((uint32_t) b[i] << 8) | a[i];
+  }
+}
+
+static void complement_plane_scalar( const uint8_t *in, uint8_t *out, size_t n ) {
+  for ( size_t i = 0; i < n; i++ ) {
+    out[i] = (uint8_t) ~in[i];
+  }
+}
+
+// Eight bytes per 64-bit word
+static void complement_plane_swar( const uint8_t *in, uint8_t *out, size_t n ) {
+  size_t i = 0;
+  for ( ; i + 8 <= n; i += 8 ) {
+    uint64_t w;
+    memcpy( &w, in + i, sizeof(w) );
+    w = ~w;
+    memcpy( out + i, &w, sizeof(w) );
+  }
+  complement_plane_scalar( in + i, out + i, n - i );
+}
+
+// The emboss gray value (see emboss_gray) from the color components of
+// a pixel and its upper-left neighbor
+static void emboss_planar_scalar( const uint8_t *r, const uint8_t *g, const uint8_t *b,
+                                  const uint8_t *ul_r, const uint8_t *ul_g, const uint8_t *ul_b,
+                                  uint8_t *out, size_t n ) {
+  for ( size_t i = 0; i < n; i++ ) {
+    uint32_t p = ((uint32_t) r[i] << 24) | ((uint32_t) g[i] << 16) | ((uint32_t) b[i] << 8);
+    uint32_t q = ((uint32_t) ul_r[i] << 24) | ((uint32_t) ul_g[i] << 16) | ((uint32_t) ul_b[i] << 8);
+    out[i] = (uint8_t) (emboss_gray( p, q ) >> 8);
+  }
+}
+
+#if KERNEL_HAVE_X86
+// 16 pixels per iteration. The channels are extracted into 32-bit lanes
+// and narrowed to bytes with two packs, which keep them in order.
+static void deinterleave_sse2( const uint32_t *in, uint8_t *r, uint8_t *g, uint8_t *b, uint8_t *a, size_t n ) {
+  const __m128i m = _mm_set1_epi32( 0xFF );
+  size_t i = 0;
+  for ( ; i + 16 <= n; i += 16 ) {
+    __m128i p0 = _mm_loadu_si128( (const __m128i *) (in + i) );
+    __m128i p1 = _mm_loadu_si128( (const __m128i *) (in + i + 4) );
+    __m128i p2 = _mm_loadu_si128( (const __m128i *) (in + i + 8) );
+    __m128i p3 = _mm_loadu_si128( (const __m128i *) (in + i + 12) );
+#define DEINTERLEAVE_PLANE_SSE2( plane, EXTRACT ) \
+    _mm_storeu_si128( (__m128i *) (plane + i), \
+                      _mm_packus_epi16( _mm_packs_epi32( EXTRACT( p0 ), EXTRACT( p1 ) ), \
+                                        _mm_packs_epi32( EXTRACT( p2 ), EXTRACT( p3 ) ) ) )
+#define EXTRACT_R( p ) _mm_srli_epi32( p, 24 )
+#define EXTRACT_G( p ) _mm_and_si128( _mm_srli_epi32( p, 16 ), m )
+#define EXTRACT_B( p ) _mm_and_si128( _mm_srli_epi32( p, 8 ), m )
+#define EXTRACT_A( p ) _mm_and_si128( p, m )
+    DEINTERLEAVE_PLANE_SSE2( r, EXTRACT_R );
+    DEINTERLEAVE_PLANE_SSE2( g, EXTRACT_G );
+    DEINTERLEAVE_PLANE_SSE2( b, EXTRACT_B );
+    DEINTERLEAVE_PLANE_SSE2( a, EXTRACT_A );
+#undef EXTRACT_R
+#undef EXTRACT_G
+#undef EXTRACT_B
+#undef EXTRACT_A
+#undef DEINTERLEAVE_PLANE_SSE2
+  }
+  deinterleave_scalar( in + i, r + i, g + i, b + i, a + i, n - i );
+}
+
+// 32 pixels per iteration. The packs work within 128-bit lanes, which
+// leaves the 4-pixel groups in the order 0, 2, 4, 6, 1, 3, 5, 7; a
+// 32-bit permute puts them back.
+__attribute__((target("avx2")))
+static void deinterleave_avx2( const uint32_t *in, uint8_t *r, uint8_t *g, uint8_t *b, uint8_t *a, size_t n ) {
+  const __m256i m = _mm256_set1_epi32( 0xFF );
+  const __m256i order = _mm256_setr_epi32( 0, 4, 1, 5, 2, 6, 3, 7 );
+  size_t i = 0;
+  for ( ; i + 32 <= n; i += 32 ) {
+    __m256i p0 = _mm256_loadu_si256( (const __m256i *) (in + i) );
+    __m256i p1 = _mm256_loadu_si256( (const __m256i *) (in + i + 8) );
+    __m256i p2 = _mm256_loadu_si256( (const __m256i *) (in + i + 16) );
+    __m256i p3 = _mm256_loadu_si256( (const __m256i *) (in + i + 24) );
+#define DEINTERLEAVE_PLANE_AVX2( plane, EXTRACT ) \
+    _mm256_storeu_si256( (__m256i *) (plane + i), _mm256_permutevar8x32_epi32( \
+      _mm256_packus_epi16( _mm256_packs_epi32( EXTRACT( p0 ), EXTRACT( p1 ) ), \
+                           _mm256_packs_epi32( EXTRACT( p2 ), EXTRACT( p3 ) ) ), order ) )
+#define EXTRACT_R( p ) _mm256_srli_epi32( p, 24 )
+#define EXTRACT_G( p ) _mm256_and_si256( _mm256_srli_epi32( p, 16 ), m )
+#define EXTRACT_B( p ) _mm256_and_si256( _mm256_srli_epi32( p, 8 ), m )
+#define EXTRACT_A( p ) _mm256_and_si256( p, m )
+    DEINTERLEAVE_PLANE_AVX2( r, EXTRACT_R );
+    DEINTERLEAVE_PLANE_AVX2( g, EXTRACT_G );
+    DEINTERLEAVE_PLANE_AVX2( b, EXTRACT_B );
+    DEINTERLEAVE_PLANE_AVX2( a, EXTRACT_A );
+#undef EXTRACT_R
+#undef EXTRACT_G
+#undef EXTRACT_B
+#undef EXTRACT_A
+#undef DEINTERLEAVE_PLANE_AVX2
+  }
+  deinterleave_sse2( in + i, r + i, g + i, b + i, a + i, n - i );
+}
+
+// 16 pixels per iteration: interleaving bytes A with B and G with R,
+// then the resulting 16-bit pairs, gives the pixels in memory order
+static void interleave_sse2( const uint8_t *r, const uint8_t *g, const uint8_t *b, const uint8_t *a,
+                             uint32_t *out, size_t n ) {
+  size_t i = 0;
+  for ( ; i + 16 <= n; i += 16 ) {
+    __m128i vr = _mm_loadu_si128( (const __m128i *) (r + i) );
+    __m128i vg = _mm_loadu_si128( (const __m128i *) (g + i) );
+    __m128i vb = _mm_loadu_si128( (const __m128i *) (b + i) );
+    __m128i va = _mm_loadu_si128( (const __m128i *) (a + i) );
+    __m128i ab_lo = _mm_unpacklo_epi8( va, vb ), ab_hi = _mm_unpackhi_epi8( va, vb );
+    __m128i gr_lo = _mm_unpacklo_epi8( vg, vr ), gr_hi = _mm_unpackhi_epi8( vg, vr );
+    _mm_storeu_si128( (__m128i *) (out + i), _mm_unpacklo_epi16( ab_lo, gr_lo ) );
+    _mm_storeu_si128( (__m128i *) (out + i + 4), _mm_unpackhi_epi16( ab_lo, gr_lo ) );
+    _mm_storeu_si128( (__m128i *) (out + i + 8), _mm_unpacklo_epi16( ab_hi, gr_hi ) );
+    _mm_storeu_si128( (__m128i *) (out + i + 12), _mm_unpackhi_epi16( ab_hi, gr_hi ) );
+  }
+  interleave_scalar( r + i, g + i, b + i, a + i, out + i, n - i );
+}
+
+// As for SSE2, 32 pixels per iteration. The unpacks work within 128-bit
+// lanes, so each result holds pixels from both halves of the input,
+// which the lane permutes sort out.
+__attribute__((target("avx2")))
+static void interleave_avx2( const uint8_t *r, const uint8_t *g, const uint8_t *b, const uint8_t *a,
+                             uint32_t *out, size_t n ) {
+  size_t i = 0;
+  for ( ; i + 32 <= n; i += 32 ) {
+    __m256i vr = _mm256_loadu_si256( (const __m256i *) (r + i) );
+    __m256i vg = _mm256_loadu_si256( (const __m256i *) (g + i) );
+    __m256i vb = _mm256_loadu_si256( (const __m256i *) (b + i) );
+    __m256i va = _mm256_loadu_si256( (const __m256i *) (a + i) );
+    __m256i ab_lo = _mm256_unpacklo_epi8( va, vb ), ab_hi = _mm256_unpackhi_epi8( va, vb );
+    __m256i gr_lo = _mm256_unpacklo_epi8( vg, vr ), gr_hi = _mm256_unpackhi_epi8( vg, vr );
+    __m256i p0 = _mm256_unpacklo_epi16( ab_lo, gr_lo ); // pixels 0-3, 16-19
+    __m256i p1 = _mm256_unpackhi_epi16( ab_lo, gr_lo ); // pixels 4-7, 20-23
+    __m256i p2 = _mm256_unpacklo_epi16( ab_hi, gr_hi ); // pixels 8-11, 24-27
+    __m256i p3 = _mm256_unpackhi_epi16( ab_hi, gr_hi ); // pixels 12-15, 28-31
+    _mm256_storeu_si256( (__m256i *) (out + i), _mm256_permute2x128_si256( p0, p1, 0x20 ) );
+    _mm256_storeu_si256( (__m256i *) (out + i + 8), _mm256_permute2x128_si256( p2, p3, 0x20 ) );
+    _mm256_storeu_si256( (__m256i *) (out + i + 16), _mm256_permute2x128_si256( p0, p1, 0x31 ) );
+    _mm256_storeu_si256( (__m256i *) (out + i + 24), _mm256_permute2x128_si256( p2, p3, 0x31 ) );
+  }
+  interleave_sse2( r + i, g + i, b + i, a + i, out + i, n - i );
+}
+
+static void complement_plane_sse2( const uint8_t *in, uint8_t *out, size_t n ) {
+  const __m128i ones = _mm_set1_epi8( -1 );
+  size_t i = 0;
+  for ( ; i + 32 <= n; i += 32 ) {
+    __m128i x = _mm_loadu_si128( (const __m128i *) (in + i) );
+    __m128i y = _mm_loadu_si128( (const __m128i *) (in + i + 16) );
+    _mm_storeu_si128( (__m128i *) (out + i), _mm_xor_si128( x, ones ) );
+    _mm_storeu_si128( (__m128i *) (out + i + 16), _mm_xor_si128( y, ones ) );
+  }
+  complement_plane_swar( in + i, out + i, n - i );
+}
+
+__attribute__((target("avx2")))
+static void complement_plane_avx2( const uint8_t *in, uint8_t *out, size_t n ) {
+  const __m256i ones = _mm256_set1_epi8( -1 );
+  size_t i = 0;
+  for ( ; i + 64 <= n; i += 64 ) {
+    __m256i x = _mm256_loadu_si256( (const __m256i *) (in + i) );
+    __m256i y = _mm256_loadu_si256( (const __m256i *) (in + i + 32) );
+    _mm256_storeu_si256( (__m256i *) (out + i), _mm256_xor_si256( x, ones ) );
+    _mm256_storeu_si256( (__m256i *) (out + i + 32), _mm256_xor_si256( y, ones ) );
+  }
+  complement_plane_sse2( in + i, out + i, n - i );
+}
+
+// Planar emboss works on 16-bit lanes, twice as many pixels per vector
+// as the packed kernels' 32-bit lanes: widen the channel bytes, pick
+// the difference with the largest magnitude (strict comparisons keep
+// the red > green > blue priority), add 128, and let the saturating
+// pack back to bytes do the clamp.
+static inline __m128i emboss_planar_diff_sse2( __m128i r, __m128i g, __m128i b,
+                                               __m128i ul_r, __m128i ul_g, __m128i ul_b ) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i d_r = _mm_sub_epi16( ul_r, r ), d_g = _mm_sub_epi16( ul_g, g ), d_b = _mm_sub_epi16( ul_b, b );
+  __m128i a_r = _mm_max_epi16( d_r, _mm_sub_epi16( zero, d_r ) );
+  __m128i a_g = _mm_max_epi16( d_g, _mm_sub_epi16( zero, d_g ) );
+  __m128i a_b = _mm_max_epi16( d_b, _mm_sub_epi16( zero, d_b ) );
+
+  __m128i sel = _mm_cmpgt_epi16( a_g, a_r );
+  __m128i diff = _mm_or_si128( _mm_and_si128( sel, d_g ), _mm_andnot_si128( sel, d_r ) );
+  __m128i a_diff = _mm_max_epi16( a_g, a_r );
+  sel = _mm_cmpgt_epi16( a_b, a_diff );
+  diff = _mm_or_si128( _mm_and_si128( sel, d_b ), _mm_andnot_si128( sel, diff ) );
+
+  return _mm_add_epi16( diff, _mm_set1_epi16( 128 ) );
+}
+
+static void emboss_planar_sse2( const uint8_t *r, const uint8_t *g, const uint8_t *b,
+                                const uint8_t *ul_r, const uint8_t *ul_g, const uint8_t *ul_b,
+                                uint8_t *out, size_t n ) {
+  const __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+  for ( ; i + 16 <= n; i += 16 ) {
+    __m128i vr = _mm_loadu_si128( (const __m128i *) (r + i) );
+    __m128i vg = _mm_loadu_si128( (const __m128i *) (g + i) );
+    __m128i vb = _mm_loadu_si128( (const __m128i *) (b + i) );
+    __m128i ur = _mm_loadu_si128( (const __m128i *) (ul_r + i) );
+    __m128i ug = _mm_loadu_si128( (const __m128i *) (ul_g + i) );
+    __m128i ub = _mm_loadu_si128( (const __m128i *) (ul_b + i) );
+    __m128i lo = emboss_planar_diff_sse2( _mm_unpacklo_epi8( vr, zero ), _mm_unpacklo_epi8( vg, zero ),
+                                          _mm_unpacklo_epi8( vb, zero ), _mm_unpacklo_epi8( ur, zero ),
+                                          _mm_unpacklo_epi8( ug, zero ), _mm_unpacklo_epi8( ub, zero ) );
+    __m128i hi = emboss_planar_diff_sse2( _mm_unpackhi_epi8( vr, zero ), _mm_unpackhi_epi8( vg, zero ),
+                                          _mm_unpackhi_epi8( vb, zero ), _mm_unpackhi_epi8( ur, zero ),
+                                          _mm_unpackhi_epi8( ug, zero ), _mm_unpackhi_epi8( ub, zero ) );
+    _mm_storeu_si128( (__m128i *) (out + i), _mm_packus_epi16( lo, hi ) );
+  }
+  emboss_planar_scalar( r + i, g + i, b + i, ul_r + i, ul_g + i, ul_b + i, out + i, n - i );
+}
+
+__attribute__((target("avx2")))
+static inline __m256i emboss_planar_diff_avx2( __m256i r, __m256i g, __m256i b,
+                                               __m256i ul_r, __m256i ul_g, __m256i ul_b ) {
+  __m256i d_r = _mm256_sub_epi16( ul_r, r ), d_g = _mm256_sub_epi16( ul_g, g ), d_b = _mm256_sub_epi16( ul_b, b );
+  __m256i a_r = _mm256_abs_epi16( d_r ), a_g = _mm256_abs_epi16( d_g ), a_b = _mm256_abs_epi16( d_b );
+
+  __m256i sel = _mm256_cmpgt_epi16( a_g, a_r );
+  __m256i diff = _mm256_blendv_epi8( d_r, d_g, sel );
+  __m256i a_diff = _mm256_max_epi16( a_g, a_r );
+  sel = _mm256_cmpgt_epi16( a_b, a_diff );
+  diff = _mm256_blendv_epi8( diff, d_b, sel );
+
+  return _mm256_add_epi16( diff, _mm256_set1_epi16( 128 ) );
+}
+
+// The unpacks and the pack all work within 128-bit lanes, so the bytes
+// come back out in their original order
+__attribute__((target("avx2")))
+static void emboss_planar_avx2( const uint8_t *r, const uint8_t *g, const uint8_t *b,
+                                const uint8_t *ul_r, const uint8_t *ul_g, const uint8_t *ul_b,
+                                uint8_t *out, size_t n ) {
+  const __m256i zero = _mm256_setzero_si256();
+  size_t i = 0;
+  for ( ; i + 32 <= n; i += 32 ) {
+    __m256i vr = _mm256_loadu_si256( (const __m256i *) (r + i) );
+    __m256i vg = _mm256_loadu_si256( (const __m256i *) (g + i) );
+    __m256i vb = _mm256_loadu_si256( (const __m256i *) (b + i) );
+    __m256i ur = _mm256_loadu_si256( (const __m256i *) (ul_r + i) );
+    __m256i ug = _mm256_loadu_si256( (const __m256i *) (ul_g + i) );
+    __m256i ub = _mm256_loadu_si256( (const __m256i *) (ul_b + i) );
+    __m256i lo = emboss_planar_diff_avx2( _mm256_unpacklo_epi8( vr, zero ), _mm256_unpacklo_epi8( vg, zero ),
+                                          _mm256_unpacklo_epi8( vb, zero ), _mm256_unpacklo_epi8( ur, zero ),
+                                          _mm256_unpacklo_epi8( ug, zero ), _mm256_unpacklo_epi8( ub, zero ) );
+    __m256i hi = emboss_planar_diff_avx2( _mm256_unpackhi_epi8( vr, zero ), _mm256_unpackhi_epi8( vg, zero ),
+                                          _mm256_unpackhi_epi8( vb, zero ), _mm256_unpackhi_epi8( ur, zero ),
+                                          _mm256_unpackhi_epi8( ug, zero ), _mm256_unpackhi_epi8( ub, zero ) );
+    _mm256_storeu_si256( (__m256i *) (out + i), _mm256_packus_epi16( lo, hi ) );
+  }
+  emboss_planar_sse2( r + i, g + i, b + i, ul_r + i, ul_g + i, ul_b + i, out + i, n - i );
+}
+#endif
+
+// There are no separate SWAR conversions or emboss; those entries use
+// the scalar code
+const deinterleave_kernel_fn kernel_deinterleave_impls[KERNEL_ISA_COUNT] = {
+  deinterleave_scalar,
+  deinterleave_scalar,
+#if KERNEL_HAVE_X86
+  deinterleave_sse2,
+  deinterleave_avx2,
+#else
+  NULL,
+  NULL,
+#endif
+};
+
+const interleave_kernel_fn kernel_interleave_impls[KERNEL_ISA_COUNT] = {
+  interleave_scalar,
+  interleave_scalar,
+#if KERNEL_HAVE_X86
+  interleave_sse2,
+  interleave_avx2,
+#else
+  NULL,
+  NULL,
+#endif
+};
+
+const complement_plane_kernel_fn kernel_complement_plane_impls[KERNEL_ISA_COUNT] = {
+  complement_plane_scalar,
+  complement_plane_swar,
+#if KERNEL_HAVE_X86
+  complement_plane_sse2,
+  complement_plane_avx2,
+#else
+  NULL,
+  NULL,
+#endif
+};
+
+const emboss_planar_kernel_fn kernel_emboss_planar_impls[KERNEL_ISA_COUNT] = {
+  emboss_planar_scalar,
+  emboss_planar_scalar,
+#if KERNEL_HAVE_X86
+  emboss_planar_sse2,
+  emboss_planar_avx2,
+#else
+  NULL,
+  NULL,
+#endif
+};
+
+////////////////////////////////////////////////////////////////////////
+// Packed pixel formats
+////////////////////////////////////////////////////////////////////////
+
+// RGB24 pixels (three bytes R, G, B) are widened to opaque RGBA32 in
+// small tiles, processed by the dispatched RGBA32 kernels, and narrowed
+// again, so every transformation gets the same SIMD code as RGBA32
+// images. Strides are in pixels.
+
+// Side length of the tiles, and number of pixels in a tile (four tiles,
+// 16KB, live on the stack at once)
+#define RGB24_TILE 32
+#define RGB24_TILE_PIXELS (RGB24_TILE * RGB24_TILE)
+
+static size_t min_size( size_t a, size_t b ) {
+  return a < b ? a : b;
+}
+
+// Widen a rows x cols block of RGB24 pixels into a packed tile
+static void load_tile_rgb24( const uint8_t *src, size_t stride, uint32_t *tile, size_t rows, size_t cols ) {
+  for ( size_t r = 0; r < rows; r++ )
+    kernel_rgb_to_rgba( src + r*stride*3, tile + r*cols, cols );
+}
+
+// Narrow a packed tile into a rows x cols block of RGB24 pixels
+static void store_tile_rgb24( const uint32_t *tile, uint8_t *dst, size_t stride, size_t rows, size_t cols ) {
+  for ( size_t r = 0; r < rows; r++ )
+    kernel_rgba_to_rgb( tile + r*cols, dst + r*stride*3, cols );
+}
+
+static void transpose_rgb24( const uint8_t *src, size_t src_stride, uint8_t *dst, size_t dst_stride,
+                             size_t rows, size_t cols ) {
+  uint32_t in[RGB24_TILE_PIXELS], out[RGB24_TILE_PIXELS];
+  for ( size_t r = 0; r < rows; r += RGB24_TILE ) {
+    size_t h = min_size( RGB24_TILE, rows - r );
+    for ( size_t c = 0; c < cols; c += RGB24_TILE ) {
+      size_t w = min_size( RGB24_TILE, cols - c );
+      load_tile_rgb24( src + (r*src_stride + c)*3, src_stride, in, h, w );
+      kernel_transpose( in, w, out, h, h, w );
+      store_tile_rgb24( out, dst + (c*dst_stride + r)*3, dst_stride, w, h );
+    }
+  }
+}
+
+// Swap the rows x cols block x with the transpose of the cols x rows
+// block y (x and y must not overlap)
+static void transpose_swap_rgb24( uint8_t *x, uint8_t *y, size_t stride, size_t rows, size_t cols ) {
+  uint32_t xt[RGB24_TILE_PIXELS], yt[RGB24_TILE_PIXELS];
+  uint32_t x_out[RGB24_TILE_PIXELS], y_out[RGB24_TILE_PIXELS];
+  for ( size_t r = 0; r < rows; r += RGB24_TILE ) {
+    size_t h = min_size( RGB24_TILE, rows - r );
+    for ( size_t c = 0; c < cols; c += RGB24_TILE ) {
+      size_t w = min_size( RGB24_TILE, cols - c );
+      uint8_t *xp = x + (r*stride + c)*3, *yp = y + (c*stride + r)*3;
+      load_tile_rgb24( xp, stride, xt, h, w );
+      load_tile_rgb24( yp, stride, yt, w, h );
+      kernel_transpose( xt, w, y_out, h, h, w );
+      kernel_transpose( yt, h, x_out, w, w, h );
+      store_tile_rgb24( x_out, xp, stride, h, w );
+      store_tile_rgb24( y_out, yp, stride, w, h );
+    }
+  }
+}
+
+static void transpose_inplace_rgb24( uint8_t *data, size_t stride, size_t n ) {
+  uint32_t tile[RGB24_TILE_PIXELS];
+  for ( size_t r = 0; r < n; r += RGB24_TILE ) {
+    size_t h = min_size( RGB24_TILE, n - r );
+    uint8_t *diag = data + (r*stride + r)*3;
+    load_tile_rgb24( diag, stride, tile, h, h );
+    kernel_transpose_inplace( tile, h, h );
+    store_tile_rgb24( tile, diag, stride, h, h );
+    // the strip right of the diagonal tile trades places with the
+    // strip below it
+    if ( r + h < n )
+      transpose_swap_rgb24( diag + h*3, diag + h*stride*3, stride, h, n - r - h );
+  }
+}
+
+static void emboss_row_rgb24( const uint8_t *in, const uint8_t *prev, uint8_t *out, int32_t width ) {
+  if ( width <= 0 )
+    return;
+
+  // the top row and the left column have no upper-left neighbor
+  if ( prev == NULL ) {
+    memset( out, 128, (size_t) width * 3 );
+    return;
+  }
+  uint32_t row[RGB24_TILE_PIXELS], ul[RGB24_TILE_PIXELS];
+  for ( size_t i = 1; i < (size_t) width; i += RGB24_TILE_PIXELS ) {
+    size_t n = min_size( RGB24_TILE_PIXELS, (size_t) width - i );
+    kernel_rgb_to_rgba( in + i*3, row, n );
+    kernel_rgb_to_rgba( prev + (i - 1)*3, ul, n );
+    kernel_emboss_impls[s_active_isa]( row, ul, row, n );
+    kernel_rgba_to_rgb( row, out + i*3, n );
+  }
+  memset( out, 128, 3 );
+}
+
+// Without an alpha channel, complementing the color components means
+// inverting every byte, which is done a 64-bit word at a time
+static void complement_rgb24( const uint8_t *in, uint8_t *out, size_t n ) {
+  size_t bytes = n * 3, i = 0;
+  for ( ; i + 8 <= bytes; i += 8 ) {
+    uint64_t w;
+    memcpy( &w, in + i, sizeof(w) );
+    w = ~w;
+    memcpy( out + i, &w, sizeof(w) );
+  }
+  for ( ; i < bytes; i++ )
+    out[i] = (uint8_t) ~in[i];
+}
+
+////////////////////////////////////////////////////////////////////////
+// Dispatch
+////////////////////////////////////////////////////////////////////////
+
+int kernel_isa_supported( enum KernelIsa isa ) {
+  switch ( isa ) {
+  case KERNEL_ISA_SCALAR:
+  case KERNEL_ISA_SWAR:
+    return 1;
+#if KERNEL_HAVE_X86
+  case KERNEL_ISA_SSE2:
+    return __builtin_cpu_supports( "sse2" ) != 0;
+  case KERNEL_ISA_AVX2:
+    // __builtin_cpu_supports checks both the cpuid feature bit and
+    // that the OS has enabled saving of the ymm registers
+    return __builtin_cpu_supports( "avx2" ) != 0;
+#endif
+  default:
+    return 0;
+  }
+}
+
+// Pick the best supported variant once, before main runs, so the
+// dispatched kernels never need to synchronize on first use.
+__attribute__((constructor))
+static void kernel_init( void ) {
+#if KERNEL_HAVE_X86
+  __builtin_cpu_init();
+#endif
+  s_active_isa = KERNEL_ISA_SCALAR;
+  for ( int isa = KERNEL_ISA_COUNT - 1; isa > KERNEL_ISA_SCALAR; isa-- ) {
+    if ( kernel_isa_supported( (enum KernelIsa) isa ) ) {
+      s_active_isa = (enum KernelIsa) isa;
+      break;
+    }
+  }
+}
+
+enum KernelIsa kernel_active_isa( void ) {
+  return s_active_isa;
+}
+
+int kernel_set_isa( enum KernelIsa isa ) {
+  if ( isa < 0 || isa >= KERNEL_ISA_COUNT || !kernel_isa_supported( isa ) )
+    return 0;
+  s_active_isa = isa;
+  return 1;
+}
+
+const char *kernel_isa_name( enum KernelIsa isa ) {
+  static const char *const names[KERNEL_ISA_COUNT] = { "scalar", "swar", "sse2", "avx2" };
+  if ( isa < 0 || isa >= KERNEL_ISA_COUNT )
+    return "unknown";
+  return names[isa];
+}
+
+void kernel_complement( const uint32_t *in, uint32_t *out, size_t n ) {
+  kernel_complement_impls[s_active_isa]( in, out, n );
+}
+
+void kernel_transpose( const uint32_t *src, size_t src_stride,
+                       uint32_t *dst, size_t dst_stride,
+                       size_t rows, size_t cols ) {
+  kernel_transpose_impls[s_active_isa]( src, src_stride, dst, dst_stride, rows, cols );
+}
+
+void kernel_transpose_inplace( uint32_t *data, size_t stride, size_t n ) {
+  kernel_transpose_inplace_impls[s_active_isa]( data, stride, n );
+}
+
+void kernel_transpose_swap( uint32_t *x, uint32_t *y, size_t stride, size_t rows, size_t cols ) {
+  kernel_transpose_swap_impls[s_active_isa]( x, y, stride, rows, cols );
+}
+
+void kernel_fill( uint32_t *out, size_t n, uint32_t value ) {
+  kernel_fill_impls[s_active_isa]( out, n, value );
+}
+
+void kernel_byteswap( const uint32_t *in, uint8_t *out, size_t n ) {
+  kernel_byteswap_impls[s_active_isa]( in, out, n );
+}
+
+void kernel_rgb_to_rgba( const uint8_t *in, uint32_t *out, size_t n ) {
+  kernel_rgb_to_rgba_impls[s_active_isa]( in, out, n );
+}
+
+void kernel_rgba_to_rgb( const uint32_t *in, uint8_t *out, size_t n ) {
+  kernel_rgba_to_rgb_impls[s_active_isa]( in, out, n );
+}
+
+void kernel_emboss_row( const uint32_t *in, const uint32_t *prev,
+                        uint32_t *out, int32_t width ) {
+  if ( width <= 0 )
+    return;
+
+  // the top row and the left column have no upper-left neighbor
+  if ( prev == NULL ) {
+    for ( int32_t i = 0; i < width; i++ )
+      out[i] = EMBOSS_EDGE_GRAY | (in[i] & 0xFF);
+    return;
+  }
+  out[0] = EMBOSS_EDGE_GRAY | (in[0] & 0xFF);
+  kernel_emboss_impls[s_active_isa]( in + 1, prev, out + 1, width - 1 );
+}
+
+void kernel_deinterleave( const uint32_t *in, uint8_t *r, uint8_t *g, uint8_t *b, uint8_t *a, size_t n ) {
+  kernel_deinterleave_impls[s_active_isa]( in, r, g, b, a, n );
+}
+
+void kernel_interleave( const uint8_t *r, const uint8_t *g, const uint8_t *b, const uint8_t *a,
+                        uint32_t *out, size_t n ) {
+  kernel_interleave_impls[s_active_isa]( r, g, b, a, out, n );
+}
+
+void kernel_complement_plane( const uint8_t *in, uint8_t *out, size_t n ) {
+  kernel_complement_plane_impls[s_active_isa]( in, out, n );
+}
+
+void kernel_emboss_planar_row( const uint8_t *const in[3], const uint8_t *const prev[3],
+                               uint8_t *out, int32_t width ) {
+  if ( width <= 0 )
+    return;
+
+  // the top row and the left column have no upper-left neighbor
+  if ( prev == NULL ) {
+    memset( out, 128, width );
+    return;
+  }
+  out[0] = 128;
+  kernel_emboss_planar_impls[s_active_isa]( in[0] + 1, in[1] + 1, in[2] + 1,
+                                            prev[0], prev[1], prev[2], out + 1, width - 1 );
+}
+
+void kernel_complement_format( int format, const void *in, void *out, size_t n ) {
+  if ( format == IMG_FORMAT_RGB24 )
+    complement_rgb24( in, out, n );
+  else
+    kernel_complement( in, out, n );
+}
+
+void kernel_transpose_format( int format, const void *src, size_t src_stride,
+                              void *dst, size_t dst_stride,
+                              size_t rows, size_t cols ) {
+  if ( format == IMG_FORMAT_RGB24 )
+    transpose_rgb24( src, src_stride, dst, dst_stride, rows, cols );
+  else
+    kernel_transpose( src, src_stride, dst, dst_stride, rows, cols );
+}
+
+void kernel_transpose_inplace_format( int format, void *data, size_t stride, size_t n ) {
+  if ( format == IMG_FORMAT_RGB24 )
+    transpose_inplace_rgb24( data, stride, n );
+  else
+    kernel_transpose_inplace( data, stride, n );
+}
+
+void kernel_transpose_swap_format( int format, void *x, void *y, size_t stride,
+                                   size_t rows, size_t cols ) {
+  if ( format == IMG_FORMAT_RGB24 )
+    transpose_swap_rgb24( x, y, stride, rows, cols );
+  else
+    kernel_transpose_swap( x, y, stride, rows, cols );
+}
+
+void kernel_ellipse_row_format( int format, const void *in, void *out, int32_t width,
+                                int32_t start, int32_t end ) {
+  if ( format != IMG_FORMAT_RGB24 ) {
+    kernel_ellipse_row( in, out, width, start, end );
+    return;
+  }
+  // opaque black is all zero bytes without an alpha channel
+  uint8_t *out_bytes = out;
+  memset( out_bytes, 0, (size_t) start * 3 );
+  if ( in != out )
+    memcpy( out_bytes + (size_t) start * 3, (const uint8_t *) in + (size_t) start * 3,
+            (size_t) (end - start) * 3 );
+  memset( out_bytes + (size_t) end * 3, 0, (size_t) (width - end) * 3 );
+}
+
+void kernel_emboss_row_format( int format, const void *in, const void *prev,
+                               void *out, int32_t width ) {
+  if ( format == IMG_FORMAT_RGB24 )
+    emboss_row_rgb24( in, prev, out, width );
+  else
+    kernel_emboss_row( in, prev, out, width );
+}
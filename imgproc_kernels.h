@@ -0,0 +1,343 @@
+// Header for low-level pixel kernels used by the image processing
+// functions. Kernels operate on runs of packed RGBA pixels and come
+// in several variants (scalar, SWAR, SSE2, AVX2); the best variant
+// supported by the CPU is selected once at program startup.
+
+#ifndef IMGPROC_KERNELS_H
+#define IMGPROC_KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "image.h" // for the IMG_FORMAT_* values
+
+//! Instruction set levels that kernels can be specialized for.
+//! Ordered from least to most capable.
+enum KernelIsa {
+  KERNEL_ISA_SCALAR,
+  KERNEL_ISA_SWAR,
+  KERNEL_ISA_SSE2,
+  KERNEL_ISA_AVX2,
+  KERNEL_ISA_COUNT
+};
+
+//! Signature of a kernel which complements the red, green, and blue
+//! components of n packed RGBA pixels, leaving alpha unchanged.
+//! in and out may be the same array.
+typedef void (*complement_kernel_fn)( const uint32_t *in, uint32_t *out, size_t n );
+
+//! Complement kernel variants, indexed by KernelIsa. An entry is
+//! NULL if that variant was not compiled in for this target.
+extern const complement_kernel_fn kernel_complement_impls[KERNEL_ISA_COUNT];
+
+//! Signature of a kernel which transposes a rows x cols block of pixels
+//! at src into a cols x rows block at dst, i.e. dst[c][r] = src[r][c].
+//! Strides are measured in pixels. src and dst must not overlap.
+typedef void (*transpose_kernel_fn)( const uint32_t *src, size_t src_stride,
+                                     uint32_t *dst, size_t dst_stride,
+                                     size_t rows, size_t cols );
+
+//! Signature of a kernel which transposes an n x n block of pixels
+//! in place.
+typedef void (*transpose_inplace_kernel_fn)( uint32_t *data, size_t stride, size_t n );
+
+//! Signature of a kernel which swaps the rows x cols block x with the
+//! transpose of the cols x rows block y, i.e. x[r][c] <-> y[c][r]. Both
+//! blocks use the same stride and must not overlap. This is the
+//! off-diagonal step of an in-place transpose.
+typedef void (*transpose_swap_kernel_fn)( uint32_t *x, uint32_t *y, size_t stride,
+                                          size_t rows, size_t cols );
+
+//! Transpose kernel variants, indexed by KernelIsa. The scalar and SWAR
+//! entries use a cache-oblivious recursive decomposition, the SIMD
+//! entries walk cache-sized tiles with 4x4 (SSE2) or 8x8 (AVX2)
+//! register transposes.
+extern const transpose_kernel_fn kernel_transpose_impls[KERNEL_ISA_COUNT];
+
+//! In-place transpose kernel variants, indexed by KernelIsa.
+extern const transpose_inplace_kernel_fn kernel_transpose_inplace_impls[KERNEL_ISA_COUNT];
+
+//! Transpose-and-swap kernel variants, indexed by KernelIsa.
+extern const transpose_swap_kernel_fn kernel_transpose_swap_impls[KERNEL_ISA_COUNT];
+
+//! Signature of a kernel which stores value into n consecutive pixels.
+typedef void (*fill_kernel_fn)( uint32_t *out, size_t n, uint32_t value );
+
+//! Fill kernel variants, indexed by KernelIsa.
+extern const fill_kernel_fn kernel_fill_impls[KERNEL_ISA_COUNT];
+
+//! Signature of a kernel which stores n packed RGBA pixels as the bytes
+//! R, G, B, A each (the order PNG uses), i.e. reverses the byte order
+//! of each pixel on a little-endian host. out need not be aligned and
+//! must not overlap in.
+typedef void (*byteswap_kernel_fn)( const uint32_t *in, uint8_t *out, size_t n );
+
+//! Byte swap kernel variants, indexed by KernelIsa.
+extern const byteswap_kernel_fn kernel_byteswap_impls[KERNEL_ISA_COUNT];
+
+//! Signature of a kernel which expands n pixels stored as the bytes
+//! R, G, B each into packed RGBA pixels with alpha 255.
+typedef void (*rgb_to_rgba_kernel_fn)( const uint8_t *in, uint32_t *out, size_t n );
+
+//! RGB expansion kernel variants, indexed by KernelIsa. Only AVX2 has
+//! a separate variant; the others use the scalar code.
+extern const rgb_to_rgba_kernel_fn kernel_rgb_to_rgba_impls[KERNEL_ISA_COUNT];
+
+//! Signature of a kernel which narrows n packed RGBA pixels to the bytes
+//! R, G, B each, dropping alpha. out must not overlap in.
+typedef void (*rgba_to_rgb_kernel_fn)( const uint32_t *in, uint8_t *out, size_t n );
+
+//! RGBA narrowing kernel variants, indexed by KernelIsa. Only AVX2 has
+//! a separate variant; the others use the scalar code.
+extern const rgba_to_rgb_kernel_fn kernel_rgba_to_rgb_impls[KERNEL_ISA_COUNT];
+
+//! Signature of a kernel which computes the emboss effect for n pixels:
+//! out[i] is the gray value derived from in[i] and its upper-left
+//! neighbor ul[i], with the alpha value of in[i]. out may be the same
+//! array as in.
+typedef void (*emboss_kernel_fn)( const uint32_t *in, const uint32_t *ul,
+                                  uint32_t *out, size_t n );
+
+//! Emboss kernel variants, indexed by KernelIsa. There is no separate
+//! SWAR emboss; that entry uses the scalar code.
+extern const emboss_kernel_fn kernel_emboss_impls[KERNEL_ISA_COUNT];
+
+//! Signature of a kernel which splits n packed RGBA pixels into separate
+//! planes of red, green, blue, and alpha bytes.
+typedef void (*deinterleave_kernel_fn)( const uint32_t *in, uint8_t *r, uint8_t *g,
+                                        uint8_t *b, uint8_t *a, size_t n );
+
+//! Deinterleave kernel variants, indexed by KernelIsa.
+extern const deinterleave_kernel_fn kernel_deinterleave_impls[KERNEL_ISA_COUNT];
+
+//! Signature of a kernel which combines n bytes from each of the red,
+//! green, blue, and alpha planes into packed RGBA pixels.
+typedef void (*interleave_kernel_fn)( const uint8_t *r, const uint8_t *g, const uint8_t *b,
+                                      const uint8_t *a, uint32_t *out, size_t n );
+
+//! Interleave kernel variants, indexed by KernelIsa.
+extern const interleave_kernel_fn kernel_interleave_impls[KERNEL_ISA_COUNT];
+
+//! Signature of a kernel which complements n bytes of one color plane.
+//! in and out may be the same array.
+typedef void (*complement_plane_kernel_fn)( const uint8_t *in, uint8_t *out, size_t n );
+
+//! Plane complement kernel variants, indexed by KernelIsa.
+extern const complement_plane_kernel_fn kernel_complement_plane_impls[KERNEL_ISA_COUNT];
+
+//! Signature of a kernel which computes the emboss gray value for n
+//! pixels held in planes: out[i] is derived from the color components
+//! r[i], g[i], b[i] and those of the upper-left neighbor, ul_r[i],
+//! ul_g[i], ul_b[i]. out may be the same array as r, g or b.
+typedef void (*emboss_planar_kernel_fn)( const uint8_t *r, const uint8_t *g, const uint8_t *b,
+                                         const uint8_t *ul_r, const uint8_t *ul_g, const uint8_t *ul_b,
+                                         uint8_t *out, size_t n );
+
+//! Planar emboss kernel variants, indexed by KernelIsa. There is no
+//! separate SWAR variant; that entry uses the scalar code.
+extern const emboss_planar_kernel_fn kernel_emboss_planar_impls[KERNEL_ISA_COUNT];
+
+//! Determine whether the running CPU supports the given instruction set.
+//!
+//! @param isa the instruction set level to check
+//! @return 1 if kernels for isa can be used, 0 otherwise
+int kernel_isa_supported( enum KernelIsa isa );
+
+//! Return the instruction set level currently used by the dispatched
+//! kernels (the best supported one unless overridden).
+//!
+//! @return the active KernelIsa
+enum KernelIsa kernel_active_isa( void );
+
+//! Override the instruction set level used by the dispatched kernels.
+//! Useful for benchmarking and testing individual variants.
+//!
+//! @param isa the instruction set level to use
+//! @return 1 if successful, 0 if isa is not supported on this CPU
+int kernel_set_isa( enum KernelIsa isa );
+
+//! Return a short printable name for an instruction set level.
+//!
+//! @param isa the instruction set level
+//! @return name such as "sse2"
+const char *kernel_isa_name( enum KernelIsa isa );
+
+//! Complement the color components of n pixels using the active variant.
+//!
+//! @param in pointer to the input pixels
+//! @param out pointer to the output pixels (may be the same as in)
+//! @param n number of pixels
+void kernel_complement( const uint32_t *in, uint32_t *out, size_t n );
+
+//! Transpose a rows x cols block of pixels using the active variant.
+//!
+//! @param src pointer to the first input pixel
+//! @param src_stride distance (in pixels) between input rows
+//! @param dst pointer to the first output pixel
+//! @param dst_stride distance (in pixels) between output rows
+//! @param rows number of input rows (output columns)
+//! @param cols number of input columns (output rows)
+void kernel_transpose( const uint32_t *src, size_t src_stride,
+                       uint32_t *dst, size_t dst_stride,
+                       size_t rows, size_t cols );
+
+//! Transpose an n x n block of pixels in place using the active variant.
+//!
+//! @param data pointer to the first pixel
+//! @param stride distance (in pixels) between rows
+//! @param n number of rows and columns
+void kernel_transpose_inplace( uint32_t *data, size_t stride, size_t n );
+
+//! Swap a rows x cols block with the transpose of a cols x rows block
+//! using the active variant.
+//!
+//! @param x pointer to the first pixel of the rows x cols block
+//! @param y pointer to the first pixel of the cols x rows block
+//! @param stride distance (in pixels) between rows of both blocks
+//! @param rows number of rows in x
+//! @param cols number of columns in x
+void kernel_transpose_swap( uint32_t *x, uint32_t *y, size_t stride, size_t rows, size_t cols );
+
+//! Store value into n consecutive pixels using the active variant.
+//!
+//! @param out pointer to the first pixel to fill
+//! @param n number of pixels
+//! @param value pixel value to store
+void kernel_fill( uint32_t *out, size_t n, uint32_t value );
+
+//! Store n pixels as R, G, B, A bytes using the active variant.
+//!
+//! @param in pointer to the input pixels
+//! @param out pointer to the output bytes (4*n of them)
+//! @param n number of pixels
+void kernel_byteswap( const uint32_t *in, uint8_t *out, size_t n );
+
+//! Expand n R, G, B pixels to opaque RGBA pixels using the active variant.
+//!
+//! @param in pointer to the input bytes (3*n of them)
+//! @param out pointer to the output pixels
+//! @param n number of pixels
+void kernel_rgb_to_rgba( const uint8_t *in, uint32_t *out, size_t n );
+
+//! Narrow n RGBA pixels to R, G, B bytes using the active variant.
+//!
+//! @param in pointer to the input pixels
+//! @param out pointer to the output bytes (3*n of them)
+//! @param n number of pixels
+void kernel_rgba_to_rgb( const uint32_t *in, uint8_t *out, size_t n );
+
+//! Split n packed RGBA pixels into planes using the active variant.
+//!
+//! @param in pointer to the input pixels
+//! @param r pointer to the output red plane
+//! @param g pointer to the output green plane
+//! @param b pointer to the output blue plane
+//! @param a pointer to the output alpha plane
+//! @param n number of pixels
+void kernel_deinterleave( const uint32_t *in, uint8_t *r, uint8_t *g, uint8_t *b, uint8_t *a, size_t n );
+
+//! Combine planes into n packed RGBA pixels using the active variant.
+//!
+//! @param r pointer to the input red plane
+//! @param g pointer to the input green plane
+//! @param b pointer to the input blue plane
+//! @param a pointer to the input alpha plane
+//! @param out pointer to the output pixels
+//! @param n number of pixels
+void kernel_interleave( const uint8_t *r, const uint8_t *g, const uint8_t *b, const uint8_t *a,
+                        uint32_t *out, size_t n );
+
+//! Complement n bytes of a color plane using the active variant.
+//!
+//! @param in pointer to the input bytes
+//! @param out pointer to the output bytes (may be the same as in)
+//! @param n number of bytes
+void kernel_complement_plane( const uint8_t *in, uint8_t *out, size_t n );
+
+//! Compute the range of columns [start, end) of a row which lie inside
+//! the ellipse described for imgproc_ellipse. The result is exactly the
+//! set of columns for which the documented floor formula holds, for
+//! every int32_t width and height (the products are formed in 128
+//! bits, so they can't overflow). If no pixels of the row are
+//! inside the ellipse, start and end are both set to 0.
+//!
+//! @param width image width
+//! @param height image height
+//! @param row the row to compute the span for
+//! @param start set to the first column inside the ellipse
+//! @param end set to one past the last column inside the ellipse
+void kernel_ellipse_span( int32_t width, int32_t height, int32_t row,
+                          int32_t *start, int32_t *end );
+
+//! Produce one row of ellipse output: copy the pixels in columns
+//! [start, end) from in to out and make every other pixel opaque black.
+//!
+//! @param in pointer to the input row
+//! @param out pointer to the output row (may be the same as in)
+//! @param width number of pixels in the row
+//! @param start first column inside the ellipse
+//! @param end one past the last column inside the ellipse
+void kernel_ellipse_row( const uint32_t *in, uint32_t *out, int32_t width,
+                         int32_t start, int32_t end );
+
+//! Produce one row of emboss output using the active variant.
+//!
+//! @param in pointer to the input row
+//! @param prev pointer to the input row above, or NULL for the top row
+//! @param out pointer to the output row (may be the same as in, as long
+//!            as prev has not been overwritten yet)
+//! @param width number of pixels in the row
+void kernel_emboss_row( const uint32_t *in, const uint32_t *prev,
+                        uint32_t *out, int32_t width );
+
+//! Produce the gray values of one row of emboss output from planar
+//! pixels using the active variant (see kernel_emboss_row).
+//!
+//! @param in pointers to the red, green, and blue bytes of the input row
+//! @param prev pointers to the red, green, and blue bytes of the input
+//!             row above, or NULL for the top row
+//! @param out pointer to the output gray values (may be in[0], in[1] or
+//!            in[2], as long as prev has not been overwritten yet)
+//! @param width number of pixels in the row
+void kernel_emboss_planar_row( const uint8_t *const in[3], const uint8_t *const prev[3],
+                               uint8_t *out, int32_t width );
+
+//! The *_format functions below perform the same operations as the
+//! RGBA32 kernels above, on rows of pixels in any IMG_FORMAT_* layout.
+//! RGBA32 pixels are handed to the dispatched kernels directly; RGB24
+//! pixels are widened to RGBA32 in small tiles on the stack, handed to
+//! the same kernels, and narrowed again (complement and ellipse work on
+//! the bytes directly, which is as fast.) Pointers
+//! are to the first byte of a pixel; strides and counts are in pixels.
+//!
+//! @param format the IMG_FORMAT_* value describing the pixels
+//! @param in pointer to the input pixels
+//! @param out pointer to the output pixels (may be the same as in)
+//! @param n number of pixels
+void kernel_complement_format( int format, const void *in, void *out, size_t n );
+
+//! Transpose a rows x cols block of pixels in any format
+//! (see kernel_transpose).
+void kernel_transpose_format( int format, const void *src, size_t src_stride,
+                              void *dst, size_t dst_stride,
+                              size_t rows, size_t cols );
+
+//! Transpose an n x n block of pixels in any format in place
+//! (see kernel_transpose_inplace).
+void kernel_transpose_inplace_format( int format, void *data, size_t stride, size_t n );
+
+//! Swap a block of pixels in any format with the transpose of another
+//! (see kernel_transpose_swap).
+void kernel_transpose_swap_format( int format, void *x, void *y, size_t stride,
+                                   size_t rows, size_t cols );
+
+//! Produce one row of ellipse output in any format
+//! (see kernel_ellipse_row).
+void kernel_ellipse_row_format( int format, const void *in, void *out, int32_t width,
+                                int32_t start, int32_t end );
+
+//! Produce one row of emboss output in any format
+//! (see kernel_emboss_row).
+void kernel_emboss_row_format( int format, const void *in, const void *prev,
+                               void *out, int32_t width );
+
+#endif // IMGPROC_KERNELS_H
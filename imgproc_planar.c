@@ -0,0 +1,110 @@
+// Planar (structure-of-arrays) images and their transformations
+
+#include <stdlib.h>
+#include <string.h>
+#include "imgproc_kernels.h"
+#include "imgproc_buffers.h"
+#include "imgproc_planar.h"
+
+// Each plane starts at a multiple of this many bytes from the start of
+// the allocation, so that vector loads of different planes don't split
+// cache lines in different ways
+#define PLANE_ALIGN 64
+
+int planar_init( struct PlanarImage *img, int32_t width, int32_t height ) {
+  size_t n = (size_t) width * (size_t) height;
+  size_t plane_size = (n + PLANE_ALIGN - 1) / PLANE_ALIGN * PLANE_ALIGN;
+
+  uint8_t *data = imgproc_buffer_alloc( plane_size * PLANAR_NUM_CHANNELS );
+  if ( data == NULL )
+    return IMG_ERR_MALLOC_FAILED;
+
+  img->width = width;
+  img->height = height;
+  for ( int c = 0; c < PLANAR_NUM_CHANNELS; c++ )
+    img->planes[c] = data + c * plane_size;
+  return IMG_SUCCESS;
+}
+
+void planar_cleanup( struct PlanarImage *img ) {
+  imgproc_buffer_free( img->planes[0] );
+  for ( int c = 0; c < PLANAR_NUM_CHANNELS; c++ )
+    img->planes[c] = NULL;
+}
+
+void planar_from_image( struct PlanarImage *dst, struct Image *src ) {
+  size_t width = src->width;
+
+  for ( int32_t row = 0; row < src->height; row++ ) {
+    size_t offset = (size_t) row * width;
+    uint8_t *r = dst->planes[PLANAR_R] + offset, *g = dst->planes[PLANAR_G] + offset;
+    uint8_t *b = dst->planes[PLANAR_B] + offset, *a = dst->planes[PLANAR_A] + offset;
+
+    if ( src->format == IMG_FORMAT_RGB24 ) {
+      const uint8_t *in = (const uint8_t *) src->data + (size_t) row * img_row_bytes( src );
+      for ( size_t i = 0; i < width; i++ ) {
+        r[i] = in[3 * i];
+        g[i] = in[3 * i + 1];
+        b[i] = in[3 * i + 2];
+      }
+      memset( a, 255, width );
+    } else {
+      kernel_deinterleave( src->data + (size_t) row * src->stride, r, g, b, a, width );
+    }
+  }
+}
+
+void planar_to_image( struct Image *dst, const struct PlanarImage *src ) {
+  size_t width = src->width;
+
+  for ( int32_t row = 0; row < src->height; row++ ) {
+    size_t offset = (size_t) row * width;
+    const uint8_t *r = src->planes[PLANAR_R] + offset, *g = src->planes[PLANAR_G] + offset;
+    const uint8_t *b = src->planes[PLANAR_B] + offset, *a = src->planes[PLANAR_A] + offset;
+
+    if ( dst->format == IMG_FORMAT_RGB24 ) {
+      uint8_t *out = (uint8_t *) dst->data + (size_t) row * img_row_bytes( dst );
+      for ( size_t i = 0; i < width; i++ ) {
+        out[3 * i] = r[i];
+        out[3 * i + 1] = g[i];
+        out[3 * i + 2] = b[i];
+      }
+    } else {
+      kernel_interleave( r, g, b, a, dst->data + (size_t) row * dst->stride, width );
+    }
+  }
+}
+
+void planar_complement( struct PlanarImage *input_img, struct PlanarImage *output_img ) {
+  size_t n = (size_t) input_img->width * (size_t) input_img->height;
+
+  for ( int c = PLANAR_R; c <= PLANAR_B; c++ )
+    kernel_complement_plane( input_img->planes[c], output_img->planes[c], n );
+  if ( output_img != input_img )
+    memcpy( output_img->planes[PLANAR_A], input_img->planes[PLANAR_A], n );
+}
+
+void planar_emboss( struct PlanarImage *input_img, struct PlanarImage *output_img ) {
+  int32_t width = input_img->width;
+
+  // Bottom to top, so that each row's upper neighbor is still intact
+  // when the output overwrites the input
+  for ( int32_t row = input_img->height - 1; row >= 0; row-- ) {
+    size_t offset = (size_t) row * width;
+    const uint8_t *in[3], *prev[3];
+    for ( int c = PLANAR_R; c <= PLANAR_B; c++ ) {
+      in[c] = input_img->planes[c] + offset;
+      if ( row > 0 )
+        prev[c] = in[c] - width;
+    }
+
+    uint8_t *gray = output_img->planes[PLANAR_R] + offset;
+    kernel_emboss_planar_row( in, row > 0 ? prev : NULL, gray, width );
+    memcpy( output_img->planes[PLANAR_G] + offset, gray, width );
+    memcpy( output_img->planes[PLANAR_B] + offset, gray, width );
+  }
+
+  if ( output_img != input_img )
+    memcpy( output_img->planes[PLANAR_A], input_img->planes[PLANAR_A],
+            (size_t) width * (size_t) input_img->height );
+}
@@ -0,0 +1,77 @@
+// Header for planar (structure-of-arrays) images, which keep the red,
+// green, blue, and alpha components in separate byte arrays instead of
+// packing each pixel into one uint32_t. Transformations which treat the
+// color channels alike can then load a whole vector of one channel at a
+// time and skip the alpha plane entirely, at the cost of converting
+// to and from the packed form used for reading and writing files.
+
+#ifndef IMGPROC_PLANAR_H
+#define IMGPROC_PLANAR_H
+
+#include <stdint.h>
+#include "image.h" // for struct Image
+
+//! Indices of the planes of a PlanarImage.
+enum PlanarChannel {
+  PLANAR_R,
+  PLANAR_G,
+  PLANAR_B,
+  PLANAR_A,
+  PLANAR_NUM_CHANNELS,
+};
+
+//! An image stored as one byte array per channel. Row r of a plane
+//! starts at planes[c] + r*width. All planes share one allocation.
+struct PlanarImage {
+  int32_t width;
+  int32_t height;
+  uint8_t *planes[PLANAR_NUM_CHANNELS];
+};
+
+//! Initialize a PlanarImage of the given dimensions. The plane contents
+//! are not initialized.
+//!
+//! @param img pointer to the PlanarImage to initialize
+//! @param width image width
+//! @param height image height
+//! @return IMG_SUCCESS if successful, IMG_ERR_MALLOC_FAILED otherwise
+int planar_init( struct PlanarImage *img, int32_t width, int32_t height );
+
+//! Free the planes of a PlanarImage.
+//!
+//! @param img pointer to the PlanarImage
+void planar_cleanup( struct PlanarImage *img );
+
+//! Split the pixels of a packed image into the planes of a PlanarImage
+//! with the same dimensions. RGB24 images get opaque alpha.
+//!
+//! @param dst pointer to the PlanarImage to store the pixels in
+//! @param src pointer to the Image (any IMG_FORMAT_*)
+void planar_from_image( struct PlanarImage *dst, struct Image *src );
+
+//! Combine the planes of a PlanarImage into the pixels of a packed image
+//! with the same dimensions. Alpha is dropped for RGB24 images.
+//!
+//! @param dst pointer to the Image (any IMG_FORMAT_*) to store the pixels in
+//! @param src pointer to the PlanarImage
+void planar_to_image( struct Image *dst, const struct PlanarImage *src );
+
+//! Planar version of imgproc_complement: complement the red, green,
+//! and blue planes. The alpha plane is only read to copy it when out
+//! is a different image.
+//!
+//! @param input_img pointer to the input PlanarImage
+//! @param output_img pointer to the output PlanarImage (same dimensions,
+//!                   may be the same as input_img)
+void planar_complement( struct PlanarImage *input_img, struct PlanarImage *output_img );
+
+//! Planar version of imgproc_emboss: store the emboss gray value of each
+//! pixel in the red, green, and blue planes. The alpha plane is only read
+//! to copy it when out is a different image.
+//!
+//! @param input_img pointer to the input PlanarImage
+//! @param output_img pointer to the output PlanarImage (same dimensions,
+//!                   may be the same as input_img)
+void planar_emboss( struct PlanarImage *input_img, struct PlanarImage *output_img );
+
+#endif // IMGPROC_PLANAR_H
@@ -0,0 +1,347 @@
+// Thread pool and multithreaded (row band) versions of the
+// image processing functions
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "imgproc.h"
+#include "imgproc_kernels.h"
+#include "imgproc_pool.h"
+#include "imgproc_buffers.h"
+
+// Each thread gets several bands so that a thread which is slowed down
+// (or a band which happens to be more expensive) doesn't hold up the rest
+#define BANDS_PER_THREAD 4
+
+// Rows per task for the in-place transpose (a multiple of every
+// register block size, so that only the last strip has ragged edges)
+#define TRANSPOSE_STRIP_ROWS 64
+
+struct ImgprocPool {
+  int num_threads;
+  pthread_t *workers;
+
+  // protects all fields below, and signals new tasks / completion
+  pthread_mutex_t lock;
+  pthread_cond_t work_ready;
+  pthread_cond_t work_done;
+
+  // the current job: tasks [next_task, num_tasks) are still unclaimed
+  void (*fn)( void *arg, int task );
+  void *arg;
+  int num_tasks;
+  int next_task;
+  int tasks_done;
+  int shutdown;
+
+  // serializes imgproc_pool_run calls made from different threads
+  pthread_mutex_t run_lock;
+};
+
+////////////////////////////////////////////////////////////////////////
+// Pool
+////////////////////////////////////////////////////////////////////////
+
+// Claim and execute tasks of the current job until none are left.
+// Must be called with pool->lock held, returns with it held.
+static void run_tasks( struct ImgprocPool *pool ) {
+  while ( pool->next_task < pool->num_tasks ) {
+    int task = pool->next_task++;
+    void (*fn)( void *, int ) = pool->fn;
+    void *arg = pool->arg;
+
+    pthread_mutex_unlock( &pool->lock );
+    fn( arg, task );
+    pthread_mutex_lock( &pool->lock );
+
+    if ( ++pool->tasks_done == pool->num_tasks )
+      pthread_cond_broadcast( &pool->work_done );
+  }
+}
+
+static void *worker_main( void *p ) {
+  struct ImgprocPool *pool = p;
+
+  pthread_mutex_lock( &pool->lock );
+  for (;;) {
+    while ( !pool->shutdown && pool->next_task >= pool->num_tasks )
+      pthread_cond_wait( &pool->work_ready, &pool->lock );
+    if ( pool->shutdown )
+      break;
+    run_tasks( pool );
+  }
+  pthread_mutex_unlock( &pool->lock );
+
+  return NULL;
+}
+
+struct ImgprocPool *imgproc_pool_create( int num_threads ) {
+  if ( num_threads < 1 )
+    return NULL;
+
+  struct ImgprocPool *pool = (struct ImgprocPool *) calloc( 1, sizeof( struct ImgprocPool ) );
+  if ( pool == NULL )
+    return NULL;
+
+  pool->workers = (pthread_t *) calloc( num_threads, sizeof( pthread_t ) );
+  if ( pool->workers == NULL ) {
+    free( pool );
+    return NULL;
+  }
+
+  pthread_mutex_init( &pool->lock, NULL );
+  pthread_mutex_init( &pool->run_lock, NULL );
+  pthread_cond_init( &pool->work_ready, NULL );
+  pthread_cond_init( &pool->work_done, NULL );
+
+  // the thread calling imgproc_pool_run does its share of the work
+  pool->num_threads = 1;
+  for ( int i = 0; i < num_threads - 1; i++ ) {
+    if ( pthread_create( &pool->workers[i], NULL, worker_main, pool ) != 0 ) {
+      imgproc_pool_destroy( pool );
+      return NULL;
+    }
+    pool->num_threads++;
+  }
+
+  return pool;
+}
+
+void imgproc_pool_destroy( struct ImgprocPool *pool ) {
+  if ( pool == NULL )
+    return;
+
+  pthread_mutex_lock( &pool->lock );
+  pool->shutdown = 1;
+  pthread_cond_broadcast( &pool->work_ready );
+  pthread_mutex_unlock( &pool->lock );
+
+  for ( int i = 0; i < pool->num_threads - 1; i++ )
+    pthread_join( pool->workers[i], NULL );
+
+  pthread_cond_destroy( &pool->work_done );
+  pthread_cond_destroy( &pool->work_ready );
+  pthread_mutex_destroy( &pool->run_lock );
+  pthread_mutex_destroy( &pool->lock );
+  free( pool->workers );
+  free( pool );
+}
+
+int imgproc_pool_size( struct ImgprocPool *pool ) {
+  return pool ? pool->num_threads : 1;
+}
+
+void imgproc_pool_run( struct ImgprocPool *pool, int num_tasks,
+                       void (*fn)( void *arg, int task ), void *arg ) {
+  if ( pool == NULL || pool->num_threads == 1 || num_tasks <= 1 ) {
+    for ( int task = 0; task < num_tasks; task++ )
+      fn( arg, task );
+    return;
+  }
+
+  pthread_mutex_lock( &pool->run_lock );
+  pthread_mutex_lock( &pool->lock );
+
+  pool->fn = fn;
+  pool->arg = arg;
+  pool->num_tasks = num_tasks;
+  pool->next_task = 0;
+  pool->tasks_done = 0;
+  pthread_cond_broadcast( &pool->work_ready );
+
+  run_tasks( pool );
+  while ( pool->tasks_done < pool->num_tasks )
+    pthread_cond_wait( &pool->work_done, &pool->lock );
+
+  pthread_mutex_unlock( &pool->lock );
+  pthread_mutex_unlock( &pool->run_lock );
+}
+
+////////////////////////////////////////////////////////////////////////
+// Row band executor
+////////////////////////////////////////////////////////////////////////
+
+// A transformation split into num_bands bands of consecutive rows
+struct BandJob {
+  struct Image *input_img;
+  struct Image *output_img;
+  int32_t num_rows;
+  int num_bands;
+  void (*run_rows)( struct BandJob *job, int band, int32_t row_begin, int32_t row_end );
+  // per-band scratch rows, used by transformations which run in place
+  uint8_t *carry;
+};
+
+int imgproc_pool_num_bands( struct ImgprocPool *pool, int32_t num_rows ) {
+  int num_bands = imgproc_pool_size( pool ) * BANDS_PER_THREAD;
+  return (num_bands > num_rows) ? (int) num_rows : num_bands;
+}
+
+void imgproc_pool_band_rows( int32_t num_rows, int num_bands, int band,
+                             int32_t *row_begin, int32_t *row_end ) {
+  *row_begin = (int32_t) ((int64_t) num_rows * band / num_bands);
+  *row_end = (int32_t) ((int64_t) num_rows * (band + 1) / num_bands);
+}
+
+static void band_task( void *arg, int task ) {
+  struct BandJob *job = arg;
+  int32_t row_begin, row_end;
+  imgproc_pool_band_rows( job->num_rows, job->num_bands, task, &row_begin, &row_end );
+  if ( row_begin < row_end )
+    job->run_rows( job, task, row_begin, row_end );
+}
+
+static void run_bands( struct ImgprocPool *pool, struct BandJob *job ) {
+  if ( job->num_bands == 0 )
+    job->num_bands = imgproc_pool_num_bands( pool, job->num_rows );
+  imgproc_pool_run( pool, job->num_bands, band_task, job );
+}
+
+// Address of a pixel, for any pixel format
+static void *pixel_ptr( struct Image *img, int32_t row, int32_t col ) {
+  return (uint8_t *) img->data + (size_t) compute_index( img, row, col ) * img_bytes_per_pixel( img );
+}
+
+static void *row_ptr( struct Image *img, int32_t row ) {
+  return pixel_ptr( img, row, 0 );
+}
+
+////////////////////////////////////////////////////////////////////////
+// Multithreaded transformations
+////////////////////////////////////////////////////////////////////////
+
+static void complement_rows( struct BandJob *job, int band, int32_t row_begin, int32_t row_end ) {
+  (void) band;
+  for ( int32_t row = row_begin; row < row_end; row++ )
+    kernel_complement_format( job->input_img->format, row_ptr( job->input_img, row ),
+                              row_ptr( job->output_img, row ), job->input_img->width );
+}
+
+void imgproc_complement_mt( struct ImgprocPool *pool, struct Image *input_img, struct Image *output_img ) {
+  if ( pool == NULL && input_img->format == IMG_FORMAT_RGBA32 ) {
+    imgproc_complement( input_img, output_img );
+    return;
+  }
+  struct BandJob job = { input_img, output_img, input_img->height, 0, complement_rows, NULL };
+  run_bands( pool, &job );
+}
+
+// Out of place, output rows [row_begin, row_end) are input columns
+// [row_begin, row_end)
+static void transpose_rows( struct BandJob *job, int band, int32_t row_begin, int32_t row_end ) {
+  (void) band;
+  struct Image *in = job->input_img, *out = job->output_img;
+  kernel_transpose_format( in->format, pixel_ptr( in, 0, row_begin ), compute_index( in, 1, 0 ),
+                           row_ptr( out, row_begin ), compute_index( out, 1, 0 ),
+                           in->height, row_end - row_begin );
+}
+
+// In place, a strip of rows [r0, r1) transposes its diagonal block and
+// swaps the rest of the strip with the corresponding strip of columns.
+// Strips never touch each other's pixels.
+static void transpose_inplace_strip( void *arg, int task ) {
+  struct Image *img = arg;
+  size_t n = img->width, stride = compute_index( img, 1, 0 );
+  size_t r0 = (size_t) task * TRANSPOSE_STRIP_ROWS;
+  size_t r1 = (r0 + TRANSPOSE_STRIP_ROWS < n) ? r0 + TRANSPOSE_STRIP_ROWS : n;
+
+  kernel_transpose_inplace_format( img->format, pixel_ptr( img, r0, r0 ), stride, r1 - r0 );
+  kernel_transpose_swap_format( img->format, pixel_ptr( img, r0, r1 ), pixel_ptr( img, r1, r0 ),
+                                stride, r1 - r0, n - r1 );
+}
+
+int imgproc_transpose_mt( struct ImgprocPool *pool, struct Image *input_img, struct Image *output_img ) {
+  if ( pool == NULL && input_img->format == IMG_FORMAT_RGBA32 )
+    return imgproc_transpose( input_img, output_img );
+  if ( input_img->width != input_img->height )
+    return 0;
+
+  if ( input_img == output_img || input_img->data == output_img->data ) {
+    int num_strips = (input_img->width + TRANSPOSE_STRIP_ROWS - 1) / TRANSPOSE_STRIP_ROWS;
+    imgproc_pool_run( pool, num_strips, transpose_inplace_strip, output_img );
+  } else {
+    struct BandJob job = { input_img, output_img, input_img->height, 0, transpose_rows, NULL };
+    run_bands( pool, &job );
+  }
+  return 1;
+}
+
+static void ellipse_rows( struct BandJob *job, int band, int32_t row_begin, int32_t row_end ) {
+  (void) band;
+  struct Image *in = job->input_img;
+  for ( int32_t row = row_begin; row < row_end; row++ ) {
+    int32_t start, end;
+    kernel_ellipse_span( in->width, in->height, row, &start, &end );
+    kernel_ellipse_row_format( in->format, row_ptr( in, row ), row_ptr( job->output_img, row ),
+                               in->width, start, end );
+  }
+}
+
+void imgproc_ellipse_mt( struct ImgprocPool *pool, struct Image *input_img, struct Image *output_img ) {
+  if ( pool == NULL && input_img->format == IMG_FORMAT_RGBA32 ) {
+    imgproc_ellipse( input_img, output_img );
+    return;
+  }
+  struct BandJob job = { input_img, output_img, input_img->height, 0, ellipse_rows, NULL };
+  run_bands( pool, &job );
+}
+
+static void emboss_rows( struct BandJob *job, int band, int32_t row_begin, int32_t row_end ) {
+  (void) band;
+  struct Image *in = job->input_img;
+  for ( int32_t row = row_begin; row < row_end; row++ )
+    kernel_emboss_row_format( in->format, row_ptr( in, row ), (row > 0) ? row_ptr( in, row - 1 ) : NULL,
+                              row_ptr( job->output_img, row ), in->width );
+}
+
+// In place, each band works from the bottom up, so the row above is
+// still unmodified when a row is computed. The row above a band's first
+// row belongs to the previous band, so it is copied into the band's
+// carry row before any band starts.
+static void emboss_rows_inplace( struct BandJob *job, int band, int32_t row_begin, int32_t row_end ) {
+  struct Image *img = job->output_img;
+  size_t row_bytes = (size_t) img->width * img_bytes_per_pixel( img );
+  for ( int32_t row = row_end - 1; row >= row_begin; row-- ) {
+    const void *prev;
+    if ( row == 0 )
+      prev = NULL;
+    else if ( row == row_begin )
+      prev = job->carry + band * row_bytes;
+    else
+      prev = row_ptr( img, row - 1 );
+    kernel_emboss_row_format( img->format, row_ptr( img, row ), prev, row_ptr( img, row ), img->width );
+  }
+}
+
+void imgproc_emboss_mt( struct ImgprocPool *pool, struct Image *input_img, struct Image *output_img ) {
+  if ( pool == NULL && input_img->format == IMG_FORMAT_RGBA32 ) {
+    imgproc_emboss( input_img, output_img );
+    return;
+  }
+
+  if ( input_img != output_img && input_img->data != output_img->data ) {
+    struct BandJob job = { input_img, output_img, input_img->height, 0, emboss_rows, NULL };
+    run_bands( pool, &job );
+    return;
+  }
+
+  struct BandJob job = { output_img, output_img, output_img->height, 0, emboss_rows_inplace, NULL };
+  size_t row_bytes = (size_t) output_img->width * img_bytes_per_pixel( output_img );
+  job.num_bands = imgproc_pool_num_bands( pool, job.num_rows );
+  if ( imgproc_pool_size( pool ) > 1 )
+    job.carry = (uint8_t *) imgproc_buffer_alloc( job.num_bands * row_bytes );
+  if ( job.carry == NULL ) {
+    // a single band needs no saved rows (this is also the fallback if
+    // there is no memory for them)
+    emboss_rows_inplace( &job, 0, 0, job.num_rows );
+    return;
+  }
+  for ( int band = 1; band < job.num_bands; band++ ) {
+    int32_t row_begin, row_end;
+    imgproc_pool_band_rows( job.num_rows, job.num_bands, band, &row_begin, &row_end );
+    if ( row_begin > 0 )
+      memcpy( job.carry + band * row_bytes, row_ptr( output_img, row_begin - 1 ), row_bytes );
+  }
+  run_bands( pool, &job );
+  imgproc_buffer_free( job.carry );
+}
@@ -0,0 +1,108 @@
+// Header for the thread pool used to run image transformations on
+// several cores at once, and for the multithreaded versions of the
+// imgproc_* functions which split an image into bands of rows.
+// Unlike the imgproc_* functions, which only handle IMG_FORMAT_RGBA32
+// images, the multithreaded versions accept every IMG_FORMAT_* (the
+// kernels for each format are chosen per image), so they are also the
+// entry points for processing RGB24 images, with or without a pool.
+// RGB24 rows are widened to RGBA32 in small tiles and run through the
+// SIMD kernels (see imgproc_kernels.h); the assembly imgproc_*
+// functions only ever see RGBA32 images.
+
+#ifndef IMGPROC_POOL_H
+#define IMGPROC_POOL_H
+
+#include "image.h" // for struct Image
+
+//! A fixed-size pool of worker threads (opaque type).
+struct ImgprocPool;
+
+//! Create a pool which runs jobs on num_threads threads. The thread
+//! calling imgproc_pool_run counts as one of them, so num_threads-1
+//! worker threads are started.
+//!
+//! @param num_threads total number of threads to use (at least 1)
+//! @return pointer to the new pool, or NULL if it couldn't be created
+struct ImgprocPool *imgproc_pool_create( int num_threads );
+
+//! Stop the worker threads and free the pool.
+//!
+//! @param pool the pool to destroy (may be NULL)
+void imgproc_pool_destroy( struct ImgprocPool *pool );
+
+//! Return the number of threads the pool runs jobs on.
+//!
+//! @param pool the pool (NULL means the calling thread only)
+//! @return number of threads
+int imgproc_pool_size( struct ImgprocPool *pool );
+
+//! Call fn(arg, task) once for every task in [0, num_tasks), spreading
+//! the calls over the pool's threads, and return when all have finished.
+//! Tasks are handed out in increasing order as threads become free.
+//!
+//! @param pool the pool (if NULL, the tasks run on the calling thread)
+//! @param num_tasks number of tasks
+//! @param fn function to call for each task
+//! @param arg argument passed to every call of fn
+void imgproc_pool_run( struct ImgprocPool *pool, int num_tasks,
+                       void (*fn)( void *arg, int task ), void *arg );
+
+//! Return the number of bands of rows to split an image into for
+//! running on a pool: a few per thread, so that a thread which is
+//! slowed down doesn't hold up the rest, but no more than one per row.
+//!
+//! @param pool the pool (NULL means the calling thread only)
+//! @param num_rows number of rows of the image
+//! @return number of bands (0 if num_rows is 0)
+int imgproc_pool_num_bands( struct ImgprocPool *pool, int32_t num_rows );
+
+//! Compute the rows belonging to one of num_bands bands of consecutive
+//! rows of nearly equal size. Together the bands cover every row once.
+//!
+//! @param num_rows number of rows of the image
+//! @param num_bands number of bands (at least 1)
+//! @param band the band, in [0, num_bands)
+//! @param row_begin set to the first row of the band
+//! @param row_end set to one past the last row of the band
+void imgproc_pool_band_rows( int32_t num_rows, int num_bands, int band,
+                             int32_t *row_begin, int32_t *row_end );
+
+//! Multithreaded version of imgproc_complement. If pool is NULL and the
+//! image is in IMG_FORMAT_RGBA32, imgproc_complement is called.
+//!
+//! @param pool the pool to run on
+//! @param input_img pointer to the input Image
+//! @param output_img pointer to the output Image
+void imgproc_complement_mt( struct ImgprocPool *pool, struct Image *input_img, struct Image *output_img );
+
+//! Multithreaded version of imgproc_transpose (including the in-place
+//! case where input_img and output_img are the same Image). If pool is
+//! NULL and the image is in IMG_FORMAT_RGBA32, imgproc_transpose is
+//! called.
+//!
+//! @param pool the pool to run on
+//! @param input_img pointer to the input Image
+//! @param output_img pointer to the output Image
+//! @return 1 if successful, 0 if the image is not square
+int imgproc_transpose_mt( struct ImgprocPool *pool, struct Image *input_img, struct Image *output_img );
+
+//! Multithreaded version of imgproc_ellipse. If pool is NULL and the
+//! image is in IMG_FORMAT_RGBA32, imgproc_ellipse is called.
+//!
+//! @param pool the pool to run on
+//! @param input_img pointer to the input Image
+//! @param output_img pointer to the output Image
+void imgproc_ellipse_mt( struct ImgprocPool *pool, struct Image *input_img, struct Image *output_img );
+
+//! Multithreaded version of imgproc_emboss. Each band reads the input
+//! row above its first row; if input_img and output_img are the same
+//! Image, those rows are copied to a small scratch buffer (one row per
+//! band) first. If pool is NULL and the image is in IMG_FORMAT_RGBA32,
+//! imgproc_emboss is called.
+//!
+//! @param pool the pool to run on
+//! @param input_img pointer to the input Image
+//! @param output_img pointer to the output Image
+void imgproc_emboss_mt( struct ImgprocPool *pool, struct Image *input_img, struct Image *output_img );
+
+#endif // IMGPROC_POOL_H
@@ -1,8 +1,18 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "tctest.h"
 #include "imgproc.h"
+#include "imgproc_kernels.h"
+#include "imgproc_pool.h"
+#include "imgproc_chain.h"
+#include "imgproc_planar.h"
+#include "imgproc_buffers.h"
+#include "imgproc_batch.h"
+#include "pnglite.h"
 
 // An expected color identified by a (non-zero) character code.
 // Used in the "struct Picture" data type.
@@ -87,6 +97,7 @@ struct Image *picture_to_img( const struct Picture *pic );
 uint32_t lookup_color(char c, const struct ExpectedColor *colors);
 bool images_equal( struct Image *a, struct Image *b );
 void destroy_img( struct Image *img );
+struct Image *to_rgb24( struct Image *img );
 
 // Test functions
 void test_get_r( TestObjs *objs );
@@ -100,6 +111,33 @@ void test_complement_basic( TestObjs *objs );
 void test_transpose_basic( TestObjs *objs );
 void test_ellipse_basic( TestObjs *objs );
 void test_emboss_basic( TestObjs *objs );
+void test_complement_kernels( TestObjs *objs );
+void test_transpose_in_place( TestObjs *objs );
+void test_transpose_kernels( TestObjs *objs );
+void test_ellipse_span( TestObjs *objs );
+void test_emboss_kernels( TestObjs *objs );
+void test_multithreaded( TestObjs *objs );
+void test_chain( TestObjs *objs );
+void test_in_place( TestObjs *objs );
+void test_transforms_each_isa( TestObjs *objs );
+void test_rgb24( TestObjs *objs );
+void test_png_read_rows( TestObjs *objs );
+void test_png_write_rows( TestObjs *objs );
+void test_png_filter_modes( TestObjs *objs );
+void test_write_options( TestObjs *objs );
+void test_png_unfilter_simd( TestObjs *objs );
+void test_byteswap_kernels( TestObjs *objs );
+void test_rgb_to_rgba_kernels( TestObjs *objs );
+void test_png_mmap( TestObjs *objs );
+void test_png_write_parallel( TestObjs *objs );
+void test_raw_formats( TestObjs *objs );
+void test_mapped_format( TestObjs *objs );
+void test_planar_kernels( TestObjs *objs );
+void test_planar( TestObjs *objs );
+void test_row_stride( TestObjs *objs );
+void test_buffer_cache( TestObjs *objs );
+void test_uninitialized_output( TestObjs *objs );
+void test_batch( TestObjs *objs );
 // TODO: add prototypes for additional test functions
 
 int main( int argc, char **argv ) {
@@ -122,8 +160,35 @@ int main( int argc, char **argv ) {
   // TEST( test_is_in_ellipse) ;
   TEST( test_complement_basic );
   TEST( test_transpose_basic );
-  // TEST( test_ellipse_basic );
-  // TEST( test_emboss_basic );
+  TEST( test_ellipse_basic );
+  TEST( test_emboss_basic );
+  TEST( test_complement_kernels );
+  TEST( test_transpose_in_place );
+  TEST( test_transpose_kernels );
+  TEST( test_ellipse_span );
+  TEST( test_emboss_kernels );
+  TEST( test_multithreaded );
+  TEST( test_chain );
+  TEST( test_in_place );
+  TEST( test_transforms_each_isa );
+  TEST( test_rgb24 );
+  TEST( test_png_read_rows );
+  TEST( test_png_write_rows );
+  TEST( test_png_filter_modes );
+  TEST( test_write_options );
+  TEST( test_png_unfilter_simd );
+  TEST( test_byteswap_kernels );
+  TEST( test_rgb_to_rgba_kernels );
+  TEST( test_png_mmap );
+  TEST( test_png_write_parallel );
+  TEST( test_raw_formats );
+  TEST( test_mapped_format );
+  TEST( test_planar_kernels );
+  TEST( test_planar );
+  TEST( test_row_stride );
+  TEST( test_buffer_cache );
+  TEST( test_uninitialized_output );
+  TEST( test_batch );
 
   TEST_FINI();
 }
@@ -202,9 +267,8 @@ struct Image *picture_to_img( const struct Picture *pic ) {
 
   for ( int i = 0; i < pic->height; ++i ) {
     for ( int j = 0; j < pic->width; ++j ) {
-      int index = i * img->width + j;
-      uint32_t color = lookup_color( pic->data[index], pic->colors );
-      img->data[index] = color;
+      uint32_t color = lookup_color( pic->data[i * pic->width + j], pic->colors );
+      img->data[compute_index( img, i, j )] = color;
     }
   }
 
@@ -222,13 +286,22 @@ uint32_t lookup_color(char c, const struct ExpectedColor *colors) {
 
 // Returns true IFF both Image objects are identical
 bool images_equal( struct Image *a, struct Image *b ) {
-  if ( a->width != b->width || a->height != b->height )
+  if ( a->width != b->width || a->height != b->height || a->format != b->format )
     return false;
 
+  // the padding at the end of each row doesn't count
+  if ( a->format != IMG_FORMAT_RGBA32 ) {
+    size_t row_bytes = (size_t) a->width * img_bytes_per_pixel( a );
+    for ( int i = 0; i < a->height; ++i )
+      if ( memcmp( (uint8_t *) a->data + i * img_row_bytes( a ), (uint8_t *) b->data + i * img_row_bytes( b ),
+                   row_bytes ) != 0 )
+        return false;
+    return true;
+  }
+
   for ( int i = 0; i < a->height; ++i )
     for ( int j = 0; j < a->width; ++j ) {
-      int index = i*a->width + j;
-      if ( a->data[index] != b->data[index] )
+      if ( a->data[compute_index( a, i, j )] != b->data[compute_index( b, i, j )] )
         return false;
     }
 
@@ -241,6 +314,22 @@ void destroy_img( struct Image *img ) {
   free( img );
 }
 
+// Make an RGB24 copy of an (opaque) RGBA32 image
+struct Image *to_rgb24( struct Image *img ) {
+  struct Image *rgb = (struct Image *) malloc( sizeof( struct Image ) );
+  img_init_format( rgb, img->width, img->height, IMG_FORMAT_RGB24 );
+  for ( int i = 0; i < img->height; i++ ) {
+    uint8_t *bytes = (uint8_t *) rgb->data + i * img_row_bytes( rgb );
+    for ( int j = 0; j < img->width; j++ ) {
+      uint32_t pixel = img->data[compute_index( img, i, j )];
+      bytes[j*3 + 0] = get_r( pixel );
+      bytes[j*3 + 1] = get_g( pixel );
+      bytes[j*3 + 2] = get_b( pixel );
+    }
+  }
+  return rgb;
+}
+
 
 // Test functions
 ////////////////////////////////////////////////////////////////////////
@@ -326,12 +415,12 @@ void test_complement_basic( TestObjs *objs ) {
   {
     imgproc_complement( objs->smiley, objs->smiley_out );
 
-    int height = objs->sq_test->height;
-    int width = objs->sq_test->width;
+    int height = objs->smiley->height;
+    int width = objs->smiley->width;
 
     for ( int i = 0; i < height; ++i ) {
       for ( int j = 0; j < width; ++j ) {
-        int index = i*width + j;
+        int index = compute_index( objs->smiley, i, j );
         uint32_t pixel = objs->smiley_out->data[ index ];
         uint32_t expected_color = ~( objs->smiley->data[ index ] ) & 0xFFFFFF00;
         uint32_t expected_alpha = objs->smiley->data[ index ] & 0xFF;
@@ -348,7 +437,7 @@ void test_complement_basic( TestObjs *objs ) {
 
     for ( int i = 0; i < height; ++i ) {
       for ( int j = 0; j < width; ++j ) {
-        int index = i*width + j;
+        int index = compute_index( objs->sq_test, i, j );
         uint32_t pixel = objs->sq_test_out->data[ index ];
         uint32_t expected_color = ~( objs->sq_test->data[ index ] ) & 0xFFFFFF00;
         uint32_t expected_alpha = objs->sq_test->data[ index ] & 0xFF;
@@ -460,3 +549,1468 @@ void test_emboss_basic( TestObjs *objs ) {
 
   destroy_img( smiley_emboss_expected );
 }
+
+void test_complement_kernels( TestObjs *objs ) {
+  // odd length so that every variant has to handle a tail
+  uint32_t in[37], out[37];
+  uint32_t state = 1;
+  for ( int i = 0; i < 37; i++ ) {
+    state = state * 1664525U + 1013904223U;
+    in[i] = state;
+  }
+
+  // every supported variant must agree with the definition
+  for ( int isa = 0; isa < KERNEL_ISA_COUNT; isa++ ) {
+    if ( kernel_complement_impls[isa] == NULL || !kernel_isa_supported( isa ) )
+      continue;
+    kernel_complement_impls[isa]( in, out, 37 );
+    for ( int i = 0; i < 37; i++ )
+      ASSERT( out[i] == ((~in[i] & 0xFFFFFF00) | (in[i] & 0xFF)) );
+  }
+}
+
+void test_transpose_in_place( TestObjs *objs ) {
+  struct Image *expected = picture_to_img( &objs->sq_test_pic );
+  imgproc_transpose( objs->sq_test, objs->sq_test_out );
+
+  // transposing the image onto itself must give the same result
+  ASSERT( imgproc_transpose( objs->sq_test, objs->sq_test ) );
+  ASSERT( images_equal( objs->sq_test, objs->sq_test_out ) );
+
+  // and transposing it back restores the original
+  ASSERT( imgproc_transpose( objs->sq_test, objs->sq_test ) );
+  ASSERT( images_equal( objs->sq_test, expected ) );
+
+  destroy_img( expected );
+}
+
+void test_transpose_kernels( TestObjs *objs ) {
+  // sizes which are not multiples of the tile or register block sizes
+  enum { N = 77, ROWS = 70, COLS = 29 };
+  static uint32_t src[N*N], dst[N*N], sq[N*N];
+  for ( int i = 0; i < N*N; i++ )
+    src[i] = i;
+
+  for ( int isa = 0; isa < KERNEL_ISA_COUNT; isa++ ) {
+    if ( kernel_transpose_impls[isa] == NULL || !kernel_isa_supported( isa ) )
+      continue;
+
+    // rectangular block, with distinct source and destination strides
+    kernel_transpose_impls[isa]( src, N, dst, ROWS + 3, ROWS, COLS );
+    for ( int r = 0; r < ROWS; r++ )
+      for ( int c = 0; c < COLS; c++ )
+        ASSERT( dst[c*(ROWS + 3) + r] == src[r*N + c] );
+
+    // whole square, in place
+    for ( int i = 0; i < N*N; i++ )
+      sq[i] = src[i];
+    kernel_transpose_inplace_impls[isa]( sq, N, N );
+    for ( int r = 0; r < N; r++ )
+      for ( int c = 0; c < N; c++ )
+        ASSERT( sq[c*N + r] == src[r*N + c] );
+  }
+}
+
+void test_ellipse_span( TestObjs *objs ) {
+  // odd/even sizes, degenerate sizes, and widths large enough that
+  // 10000*x*x overflows 32-bit arithmetic
+  const int32_t sizes[][2] = { {16, 10}, {17, 11}, {1, 1}, {1, 7}, {9, 1}, {2500, 3}, {4001, 1203} };
+
+  for ( int i = 0; i < (int) (sizeof(sizes) / sizeof(sizes[0])); i++ ) {
+    int32_t w = sizes[i][0], h = sizes[i][1];
+    int64_t a = w / 2, b = h / 2;
+    for ( int32_t row = 0; row < h; row++ ) {
+      int32_t start, end;
+      kernel_ellipse_span( w, h, row, &start, &end );
+      ASSERT( 0 <= start && start <= end && end <= w );
+
+      int64_t y = b - row;
+      for ( int32_t col = 0; col < w; col++ ) {
+        int64_t x = a - col;
+        int64_t tx = (a == 0) ? (x == 0 ? 0 : 10001) : (10000 * x * x) / (a * a);
+        int64_t ty = (b == 0) ? (y == 0 ? 0 : 10001) : (10000 * y * y) / (b * b);
+        int inside = tx + ty <= 10000;
+        ASSERT( inside == (col >= start && col < end) );
+      }
+    }
+  }
+
+  // widths for which 10000*x*x overflows 64 bits (checked against
+  // spans computed with arbitrary precision)
+  int32_t start, end;
+  kernel_ellipse_span( 80000000, 5, 1, &start, &end );
+  ASSERT( start == 5356675 && end == 74643326 );
+  kernel_ellipse_span( 80000000, 5, 2, &start, &end );
+  ASSERT( start == 0 && end == 80000000 );
+  kernel_ellipse_span( INT32_MAX, 3, 0, &start, &end );
+  ASSERT( start == 1063004405 && end == 1084479242 );
+  kernel_ellipse_span( INT32_MAX, 3, 1, &start, &end );
+  ASSERT( start == 0 && end == INT32_MAX );
+}
+
+void test_emboss_kernels( TestObjs *objs ) {
+  // component values chosen so that ties between the red, green, and
+  // blue differences and clamping at both ends happen often
+  const uint32_t vals[] = { 0, 1, 2, 127, 128, 129, 254, 255 };
+  enum { N = 203 };
+  uint32_t in[N], ul[N], expected[N], out[N];
+  uint32_t state = 7;
+  for ( int i = 0; i < N; i++ ) {
+    uint32_t c[8];
+    for ( int j = 0; j < 8; j++ ) {
+      state = state * 1664525U + 1013904223U;
+      c[j] = vals[state >> 29];
+    }
+    in[i] = make_pixel( c[0], c[1], c[2], c[3] );
+    ul[i] = make_pixel( c[4], c[5], c[6], c[7] );
+  }
+  kernel_emboss_impls[KERNEL_ISA_SCALAR]( in, ul, expected, N );
+
+  // every supported variant must be bit-exact with the scalar code,
+  // including when writing over its input
+  for ( int isa = 0; isa < KERNEL_ISA_COUNT; isa++ ) {
+    if ( kernel_emboss_impls[isa] == NULL || !kernel_isa_supported( isa ) )
+      continue;
+    kernel_emboss_impls[isa]( in, ul, out, N );
+    for ( int i = 0; i < N; i++ )
+      ASSERT( out[i] == expected[i] );
+    for ( int i = 0; i < N; i++ )
+      out[i] = in[i];
+    kernel_emboss_impls[isa]( out, ul, out, N );
+    for ( int i = 0; i < N; i++ )
+      ASSERT( out[i] == expected[i] );
+  }
+}
+
+void test_multithreaded( TestObjs *objs ) {
+  // the bands cover every row once, in order, and there are no more
+  // bands than rows
+  const int32_t row_counts[] = { 0, 1, 3, 301 };
+  for ( int i = 0; i < (int) (sizeof( row_counts ) / sizeof( row_counts[0] )); i++ ) {
+    int num_bands = imgproc_pool_num_bands( NULL, row_counts[i] );
+    ASSERT( num_bands <= row_counts[i] && (num_bands > 0 || row_counts[i] == 0) );
+    int32_t next = 0;
+    for ( int band = 0; band < num_bands; band++ ) {
+      int32_t row_begin, row_end;
+      imgproc_pool_band_rows( row_counts[i], num_bands, band, &row_begin, &row_end );
+      ASSERT( row_begin == next && row_end >= row_begin );
+      next = row_end;
+    }
+    ASSERT( next == row_counts[i] );
+  }
+
+  // big enough for every thread to get several bands and transpose strips
+  struct Image *in = (struct Image *) malloc( sizeof( struct Image ) );
+  struct Image *expected = (struct Image *) malloc( sizeof( struct Image ) );
+  struct Image *actual = (struct Image *) malloc( sizeof( struct Image ) );
+  img_init( in, 301, 301 );
+  img_init( expected, 301, 301 );
+  img_init( actual, 301, 301 );
+  uint32_t state = 3;
+  for ( int i = 0; i < 301*301; i++ ) {
+    state = state * 1664525U + 1013904223U;
+    in->data[i] = state;
+  }
+
+  struct ImgprocPool *pool = imgproc_pool_create( 3 );
+  ASSERT( pool != NULL );
+  ASSERT( imgproc_pool_size( pool ) == 3 );
+
+  imgproc_complement( in, expected );
+  imgproc_complement_mt( pool, in, actual );
+  ASSERT( images_equal( expected, actual ) );
+
+  imgproc_ellipse( in, expected );
+  imgproc_ellipse_mt( pool, in, actual );
+  ASSERT( images_equal( expected, actual ) );
+
+  imgproc_emboss( in, expected );
+  imgproc_emboss_mt( pool, in, actual );
+  ASSERT( images_equal( expected, actual ) );
+  imgproc_emboss_mt( pool, actual, actual );
+  imgproc_emboss( expected, expected );
+  ASSERT( images_equal( expected, actual ) );
+
+  imgproc_transpose( in, expected );
+  ASSERT( imgproc_transpose_mt( pool, in, actual ) );
+  ASSERT( images_equal( expected, actual ) );
+  ASSERT( imgproc_transpose_mt( pool, in, in ) );
+  ASSERT( images_equal( expected, in ) );
+
+  // non-square images can't be transposed
+  ASSERT( !imgproc_transpose_mt( pool, objs->smiley, objs->smiley_out ) );
+
+  imgproc_pool_destroy( pool );
+  destroy_img( in );
+  destroy_img( expected );
+  destroy_img( actual );
+}
+
+void test_chain( TestObjs *objs ) {
+  // apply the stages one at a time for the expected result
+  struct Image *step = (struct Image *) malloc( sizeof( struct Image ) );
+  img_init( step, objs->sq_test->width, objs->sq_test->height );
+  imgproc_ellipse( objs->sq_test, objs->sq_test_out );
+  imgproc_complement( objs->sq_test_out, step );
+  imgproc_emboss( step, objs->sq_test_out );
+  imgproc_transpose( objs->sq_test_out, step );
+
+  // the chain fuses ellipse and complement into one pass
+  const enum ImgprocOp ops[] = {
+    IMGPROC_OP_ELLIPSE, IMGPROC_OP_COMPLEMENT, IMGPROC_OP_EMBOSS, IMGPROC_OP_TRANSPOSE,
+  };
+  ASSERT( imgproc_chain( NULL, ops, 4, objs->sq_test ) );
+  ASSERT( images_equal( objs->sq_test, step ) );
+
+  // transposing a non-square image fails
+  ASSERT( !imgproc_chain( NULL, ops + 3, 1, objs->smiley ) );
+
+  destroy_img( step );
+}
+
+void test_in_place( TestObjs *objs ) {
+  struct Image *copy = (struct Image *) malloc( sizeof( struct Image ) );
+  img_init( copy, objs->smiley->width, objs->smiley->height );
+
+  // each in-place function must produce the same pixels as the
+  // out-of-place version
+  memcpy( copy->data, objs->smiley->data, img_row_bytes( objs->smiley ) * objs->smiley->height );
+  imgproc_complement( objs->smiley, objs->smiley_out );
+  imgproc_complement_inplace( copy );
+  ASSERT( images_equal( objs->smiley_out, copy ) );
+
+  memcpy( copy->data, objs->smiley->data, img_row_bytes( objs->smiley ) * objs->smiley->height );
+  imgproc_ellipse( objs->smiley, objs->smiley_out );
+  imgproc_ellipse_inplace( copy );
+  ASSERT( images_equal( objs->smiley_out, copy ) );
+
+  memcpy( copy->data, objs->smiley->data, img_row_bytes( objs->smiley ) * objs->smiley->height );
+  imgproc_emboss( objs->smiley, objs->smiley_out );
+  imgproc_emboss_inplace( copy );
+  ASSERT( images_equal( objs->smiley_out, copy ) );
+
+  // transpose fails on a non-square image, leaving it unchanged
+  memcpy( copy->data, objs->smiley->data, img_row_bytes( objs->smiley ) * objs->smiley->height );
+  ASSERT( !imgproc_transpose_inplace( copy ) );
+  ASSERT( images_equal( objs->smiley, copy ) );
+
+  imgproc_transpose( objs->sq_test, objs->sq_test_out );
+  ASSERT( imgproc_transpose_inplace( objs->sq_test ) );
+  ASSERT( images_equal( objs->sq_test_out, objs->sq_test ) );
+
+  destroy_img( copy );
+}
+
+void test_transforms_each_isa( TestObjs *objs ) {
+  // odd sizes, so that every vector loop has a scalar tail
+  struct Image *in = (struct Image *) malloc( sizeof( struct Image ) );
+  struct Image *expected = (struct Image *) malloc( sizeof( struct Image ) );
+  struct Image *actual = (struct Image *) malloc( sizeof( struct Image ) );
+  img_init( in, 37, 37 );
+  img_init( expected, 37, 37 );
+  img_init( actual, 37, 37 );
+  uint32_t state = 11;
+  for ( int i = 0; i < 37*37; i++ ) {
+    state = state * 1664525U + 1013904223U;
+    in->data[i] = state;
+  }
+
+  // the multithreaded versions use the scalar kernels as a reference
+  enum KernelIsa dispatched = kernel_active_isa();
+  struct ImgprocPool *pool = imgproc_pool_create( 2 );
+  ASSERT( pool != NULL );
+
+  for ( int isa = 0; isa < KERNEL_ISA_COUNT; isa++ ) {
+    if ( !kernel_isa_supported( isa ) )
+      continue;
+
+    kernel_set_isa( KERNEL_ISA_SCALAR );
+    imgproc_complement_mt( pool, in, expected );
+    kernel_set_isa( isa );
+    imgproc_complement( in, actual );
+    ASSERT( images_equal( expected, actual ) );
+
+    kernel_set_isa( KERNEL_ISA_SCALAR );
+    imgproc_ellipse_mt( pool, in, expected );
+    kernel_set_isa( isa );
+    imgproc_ellipse( in, actual );
+    ASSERT( images_equal( expected, actual ) );
+
+    kernel_set_isa( KERNEL_ISA_SCALAR );
+    imgproc_emboss_mt( pool, in, expected );
+    kernel_set_isa( isa );
+    imgproc_emboss( in, actual );
+    ASSERT( images_equal( expected, actual ) );
+
+    kernel_set_isa( KERNEL_ISA_SCALAR );
+    imgproc_transpose_mt( pool, in, expected );
+    kernel_set_isa( isa );
+    ASSERT( imgproc_transpose( in, actual ) );
+    ASSERT( images_equal( expected, actual ) );
+    ASSERT( imgproc_transpose( actual, actual ) );
+    ASSERT( imgproc_transpose( expected, expected ) );
+    ASSERT( images_equal( expected, actual ) );
+  }
+
+  kernel_set_isa( dispatched );
+  imgproc_pool_destroy( pool );
+  destroy_img( in );
+  destroy_img( expected );
+  destroy_img( actual );
+}
+
+void test_rgb24( TestObjs *objs ) {
+  // an opaque image, big enough for several bands and transpose strips
+  struct Image *in = (struct Image *) malloc( sizeof( struct Image ) );
+  struct Image *out = (struct Image *) malloc( sizeof( struct Image ) );
+  img_init( in, 131, 131 );
+  img_init( out, 131, 131 );
+  uint32_t state = 5;
+  for ( int i = 0; i < 131*131; i++ ) {
+    state = state * 1664525U + 1013904223U;
+    in->data[i] = state | 0xFF;
+  }
+  struct Image *rgb_in = to_rgb24( in );
+  struct Image *rgb_out = (struct Image *) malloc( sizeof( struct Image ) );
+  img_init_format( rgb_out, 131, 131, IMG_FORMAT_RGB24 );
+  ASSERT( img_bytes_per_pixel( rgb_out ) == 3 );
+
+  struct ImgprocPool *pool = imgproc_pool_create( 3 );
+  ASSERT( pool != NULL );
+
+  // every transformation must give the same colors as for RGBA32,
+  // with and without threads, out of place and in place
+  struct ImgprocPool *pools[] = { NULL, pool };
+  for ( int i = 0; i < 2; i++ ) {
+    struct Image *expected, *copy;
+
+    imgproc_complement( in, out );
+    expected = to_rgb24( out );
+    imgproc_complement_mt( pools[i], rgb_in, rgb_out );
+    ASSERT( images_equal( expected, rgb_out ) );
+    copy = to_rgb24( in );
+    imgproc_complement_mt( pools[i], copy, copy );
+    ASSERT( images_equal( expected, copy ) );
+    destroy_img( expected );
+    destroy_img( copy );
+
+    imgproc_ellipse( in, out );
+    expected = to_rgb24( out );
+    imgproc_ellipse_mt( pools[i], rgb_in, rgb_out );
+    ASSERT( images_equal( expected, rgb_out ) );
+    copy = to_rgb24( in );
+    imgproc_ellipse_mt( pools[i], copy, copy );
+    ASSERT( images_equal( expected, copy ) );
+    destroy_img( expected );
+    destroy_img( copy );
+
+    imgproc_emboss( in, out );
+    expected = to_rgb24( out );
+    imgproc_emboss_mt( pools[i], rgb_in, rgb_out );
+    ASSERT( images_equal( expected, rgb_out ) );
+    copy = to_rgb24( in );
+    imgproc_emboss_mt( pools[i], copy, copy );
+    ASSERT( images_equal( expected, copy ) );
+    destroy_img( expected );
+    destroy_img( copy );
+
+    imgproc_transpose( in, out );
+    expected = to_rgb24( out );
+    ASSERT( imgproc_transpose_mt( pools[i], rgb_in, rgb_out ) );
+    ASSERT( images_equal( expected, rgb_out ) );
+    copy = to_rgb24( in );
+    ASSERT( imgproc_transpose_mt( pools[i], copy, copy ) );
+    ASSERT( images_equal( expected, copy ) );
+    destroy_img( expected );
+    destroy_img( copy );
+  }
+
+  // chains fuse row-local stages for RGB24 too
+  const enum ImgprocOp ops[] = { IMGPROC_OP_COMPLEMENT, IMGPROC_OP_ELLIPSE };
+  imgproc_complement( in, out );
+  imgproc_ellipse( out, out );
+  struct Image *expected = to_rgb24( out );
+  ASSERT( imgproc_chain( pool, ops, 2, rgb_in ) );
+  ASSERT( images_equal( expected, rgb_in ) );
+  destroy_img( expected );
+
+  imgproc_pool_destroy( pool );
+  destroy_img( in );
+  destroy_img( out );
+  destroy_img( rgb_in );
+  destroy_img( rgb_out );
+}
+
+void test_png_read_rows( TestObjs *objs ) {
+  // a file with filtered scanlines, decoded a few rows at a time,
+  // must match the whole-image decode
+  struct Image whole;
+  ASSERT( img_read_native( "input/kittens.png", &whole ) == IMG_SUCCESS );
+  ASSERT( whole.format == IMG_FORMAT_RGB24 );
+
+  png_t png;
+  ASSERT( png_open_file_read( &png, "input/kittens.png" ) == PNG_NO_ERROR );
+  ASSERT( png.width == (unsigned) whole.width && png.height == (unsigned) whole.height );
+  size_t row_bytes = (size_t) whole.width * 3;
+  uint8_t *rows = (uint8_t *) malloc( row_bytes * 7 );
+  const uint8_t *expected = (const uint8_t *) whole.data;
+  unsigned total = 0, n;
+  int rc;
+  while ( (rc = png_read_rows( &png, rows, 7, &n )) == PNG_NO_ERROR || rc == PNG_DONE ) {
+    ASSERT( n <= 7 && total + n <= png.height );
+    for ( unsigned i = 0; i < n; i++ )
+      ASSERT( memcmp( rows + i * row_bytes, expected + (total + i) * img_row_bytes( &whole ), row_bytes ) == 0 );
+    total += n;
+    if ( rc == PNG_DONE )
+      break;
+    ASSERT( n == 7 );
+  }
+  ASSERT( rc == PNG_DONE );
+  ASSERT( total == png.height );
+  ASSERT( png_read_rows( &png, rows, 7, &n ) == PNG_DONE && n == 0 );
+  png_close_file( &png );
+  free( rows );
+  img_cleanup( &whole );
+
+  // a written image read back one row at a time, stopping early
+  struct Image *img = to_rgb24( objs->smiley );
+  char path[] = "/tmp/imgproc_tests_XXXXXX";
+  int fd = mkstemp( path );
+  ASSERT( fd >= 0 );
+  close( fd );
+  ASSERT( img_write( path, img ) == IMG_SUCCESS );
+  ASSERT( png_open_file_read( &png, path ) == PNG_NO_ERROR );
+  uint8_t row[16 * 3];
+  for ( int i = 0; i < 5; i++ ) {
+    ASSERT( png_read_rows( &png, row, 1, &n ) == PNG_NO_ERROR && n == 1 );
+    ASSERT( memcmp( row, (uint8_t *) img->data + i * img_row_bytes( img ), sizeof(row) ) == 0 );
+  }
+  png_read_end( &png );
+  png_close_file( &png );
+  unlink( path );
+  destroy_img( img );
+}
+
+void test_png_write_rows( TestObjs *objs ) {
+  (void) objs;
+  png_init( 0, 0 );
+
+  // random pixels don't compress, so the image data is split over
+  // several IDAT chunks
+  const unsigned width = 301, height = 257, row_bytes = width * 4;
+  uint8_t *data = (uint8_t *) malloc( row_bytes * height );
+  uint32_t state = 17;
+  for ( unsigned i = 0; i < row_bytes * height; i++ ) {
+    state = state * 1664525U + 1013904223U;
+    data[i] = state >> 24;
+  }
+
+  char path[] = "/tmp/imgproc_tests_XXXXXX";
+  int fd = mkstemp( path );
+  ASSERT( fd >= 0 );
+  close( fd );
+
+  // written in uneven batches of rows
+  png_t png;
+  ASSERT( png_open_file_write( &png, path ) == PNG_NO_ERROR );
+  ASSERT( png_write_begin( &png, width, height, 8, PNG_TRUECOLOR_ALPHA ) == PNG_NO_ERROR );
+  ASSERT( png_write_rows( &png, data, 1 ) == PNG_NO_ERROR );
+  ASSERT( png_write_rows( &png, data + row_bytes, 100 ) == PNG_NO_ERROR );
+  ASSERT( png_write_rows( &png, data + 101 * row_bytes, height - 101 ) == PNG_NO_ERROR );
+  ASSERT( png_write_rows( &png, data, 1 ) == PNG_WRONG_ARGUMENTS );
+  ASSERT( png_write_end( &png ) == PNG_NO_ERROR );
+  png_close_file( &png );
+
+  uint8_t *decoded = (uint8_t *) malloc( row_bytes * height );
+  ASSERT( png_open_file_read( &png, path ) == PNG_NO_ERROR );
+  ASSERT( png.width == width && png.height == height && png.color_type == PNG_TRUECOLOR_ALPHA );
+  ASSERT( png_get_data( &png, decoded ) == PNG_NO_ERROR );
+  png_close_file( &png );
+  ASSERT( memcmp( data, decoded, row_bytes * height ) == 0 );
+
+  // an image can't be finished before all of its rows are written
+  ASSERT( png_open_file_write( &png, path ) == PNG_NO_ERROR );
+  ASSERT( png_write_begin( &png, width, height, 8, PNG_TRUECOLOR_ALPHA ) == PNG_NO_ERROR );
+  ASSERT( png_write_rows( &png, data, 10 ) == PNG_NO_ERROR );
+  ASSERT( png_write_end( &png ) == PNG_WRONG_ARGUMENTS );
+  png_close_file( &png );
+
+  unlink( path );
+  free( data );
+  free( decoded );
+}
+
+void test_png_filter_modes( TestObjs *objs ) {
+  (void) objs;
+  png_init( 0, 0 );
+
+  char path[] = "/tmp/imgproc_tests_XXXXXX";
+  int fd = mkstemp( path );
+  ASSERT( fd >= 0 );
+  close( fd );
+
+  // gradients with a little noise, which every filter type suits
+  // somewhere; odd widths leave partial vectors at the end of rows
+  const unsigned width = 67, height = 45;
+  const int colors[] = { PNG_TRUECOLOR, PNG_TRUECOLOR_ALPHA };
+  const int bpps[] = { 3, 4 };
+  for ( int i = 0; i < 2; i++ ) {
+    unsigned row_bytes = width * bpps[i];
+    uint8_t *data = (uint8_t *) malloc( row_bytes * height );
+    uint8_t *decoded = (uint8_t *) malloc( row_bytes * height );
+    uint32_t state = 3;
+    for ( unsigned row = 0; row < height; row++ ) {
+      for ( unsigned j = 0; j < row_bytes; j++ ) {
+        state = state * 1664525U + 1013904223U;
+        data[row * row_bytes + j] = (uint8_t) (row * 5 + j * (j % 3 + 1) + (state >> 30));
+      }
+    }
+
+    long sizes[3];
+    const int modes[] = { PNG_FILTER_MODE_NONE, PNG_FILTER_MODE_FAST, PNG_FILTER_MODE_ADAPTIVE };
+    for ( int m = 0; m < 3; m++ ) {
+      png_t png;
+      ASSERT( png_open_file_write( &png, path ) == PNG_NO_ERROR );
+      ASSERT( png_set_filter_mode( &png, modes[m] ) == PNG_NO_ERROR );
+      ASSERT( png_set_data( &png, width, height, 8, colors[i], data ) == PNG_NO_ERROR );
+      png_close_file( &png );
+
+      FILE *f = fopen( path, "rb" );
+      ASSERT( f != NULL );
+      fseek( f, 0, SEEK_END );
+      sizes[m] = ftell( f );
+      fclose( f );
+
+      ASSERT( png_open_file_read( &png, path ) == PNG_NO_ERROR );
+      ASSERT( png_get_data( &png, decoded ) == PNG_NO_ERROR );
+      png_close_file( &png );
+      ASSERT( memcmp( data, decoded, row_bytes * height ) == 0 );
+    }
+    // (the heuristic doesn't promise adaptive beats fast)
+    ASSERT( sizes[1] < sizes[0] );
+    ASSERT( sizes[2] < sizes[0] );
+
+    free( data );
+    free( decoded );
+  }
+
+  png_t png;
+  ASSERT( png_open_file_write( &png, path ) == PNG_NO_ERROR );
+  ASSERT( png_set_filter_mode( &png, 7 ) == PNG_WRONG_ARGUMENTS );
+  png_close_file( &png );
+  unlink( path );
+}
+
+void test_write_options( TestObjs *objs ) {
+  char path[] = "/tmp/imgproc_tests_XXXXXX";
+  int fd = mkstemp( path );
+  ASSERT( fd >= 0 );
+  close( fd );
+
+  // every combination of settings must give back the same image
+  const int levels[] = { 0, 1, 9 };
+  for ( int i = 0; i < 3; i++ ) {
+    for ( int strategy = IMG_STRATEGY_DEFAULT; strategy <= IMG_STRATEGY_RLE; strategy++ ) {
+      struct ImgWriteOptions opts;
+      img_write_options_init( &opts );
+      opts.level = levels[i];
+      opts.strategy = strategy;
+      opts.mem_level = 1 + 4 * i;
+      opts.window_bits = 9 + 3 * i;
+      opts.filter = i % 3;
+      ASSERT( img_write_with_options( path, objs->smiley, &opts ) == IMG_SUCCESS );
+
+      struct Image back;
+      ASSERT( img_read( path, &back ) == IMG_SUCCESS );
+      ASSERT( images_equal( objs->smiley, &back ) );
+      img_cleanup( &back );
+    }
+  }
+
+  struct ImgWriteOptions bad;
+  img_write_options_init( &bad );
+  bad.level = 10;
+  ASSERT( img_write_with_options( path, objs->smiley, &bad ) == IMG_ERR_BAD_OPTIONS );
+  img_write_options_init( &bad );
+  bad.strategy = 4;
+  ASSERT( img_write_with_options( path, objs->smiley, &bad ) == IMG_ERR_BAD_OPTIONS );
+  img_write_options_init( &bad );
+  bad.window_bits = 16;
+  ASSERT( img_write_with_options( path, objs->smiley, &bad ) == IMG_ERR_BAD_OPTIONS );
+  img_write_options_init( &bad );
+  bad.filter = 3;
+  ASSERT( img_write_with_options( path, objs->smiley, &bad ) == IMG_ERR_BAD_OPTIONS );
+
+  // pnglite's checks agree with its setters
+  ASSERT( png_check_compression( 9, PNG_STRATEGY_RLE, 9, 9 ) == PNG_NO_ERROR );
+  ASSERT( png_check_compression( -2, PNG_STRATEGY_DEFAULT, 8, 15 ) == PNG_WRONG_ARGUMENTS );
+  ASSERT( png_check_compression( 6, PNG_STRATEGY_RLE + 1, 8, 15 ) == PNG_WRONG_ARGUMENTS );
+  ASSERT( png_check_compression( 6, PNG_STRATEGY_DEFAULT, 0, 15 ) == PNG_WRONG_ARGUMENTS );
+  ASSERT( png_check_filter_mode( PNG_FILTER_MODE_NONE ) == PNG_NO_ERROR );
+  ASSERT( png_check_filter_mode( -1 ) == PNG_WRONG_ARGUMENTS );
+
+  // a rejected write leaves the existing file alone
+  struct Image back;
+  ASSERT( img_read( path, &back ) == IMG_SUCCESS );
+  ASSERT( images_equal( objs->smiley, &back ) );
+  img_cleanup( &back );
+
+  unlink( path );
+}
+
+// Decode a PNG file with pnglite, unfiltering with the instruction set
+// level. Returns the pixel bytes (to be freed), or NULL on failure.
+static uint8_t *decode_png_simd( const char *path, int level, size_t *size ) {
+  png_t png;
+  if ( png_open_file_read( &png, path ) != PNG_NO_ERROR )
+    return NULL;
+  png_set_simd( &png, level );
+  *size = (size_t) png.width * png.height * png.bpp;
+  uint8_t *data = (uint8_t *) malloc( *size );
+  if ( data != NULL && png_get_data( &png, data ) != PNG_NO_ERROR ) {
+    free( data );
+    data = NULL;
+  }
+  png_close_file( &png );
+  return data;
+}
+
+// Check that every vector unfilter level decodes path the same way as
+// the scalar code
+static void check_unfilter_levels( const char *path ) {
+  size_t scalar_size, simd_size;
+  uint8_t *scalar = decode_png_simd( path, PNG_SIMD_NONE, &scalar_size );
+  ASSERT( scalar != NULL );
+  for ( int level = PNG_SIMD_SSE2; level <= PNG_SIMD_SSSE3; level++ ) {
+    uint8_t *simd = decode_png_simd( path, level, &simd_size );
+    ASSERT( simd != NULL );
+    ASSERT( simd_size == scalar_size && memcmp( scalar, simd, scalar_size ) == 0 );
+    free( simd );
+  }
+  free( scalar );
+}
+
+void test_png_unfilter_simd( TestObjs *objs ) {
+  (void) objs;
+  png_init( 0, 0 );
+
+  // the vector and the scalar unfilter code must decode every bundled
+  // input (RGB and RGBA, all filter types) the same way
+  const char *files[] = { "input/dice.png", "input/ingo.png", "input/kittens.png", "input/landscape.png" };
+  for ( int i = 0; i < 4; i++ )
+    check_unfilter_levels( files[i] );
+
+  // and images written with adaptive filtering, whose widths leave
+  // partial vectors at the end of rows
+  char path[] = "/tmp/imgproc_tests_XXXXXX";
+  int fd = mkstemp( path );
+  ASSERT( fd >= 0 );
+  close( fd );
+  for ( int format = IMG_FORMAT_RGBA32; format <= IMG_FORMAT_RGB24; format++ ) {
+    struct Image img, back;
+    ASSERT( img_init_format( &img, 53, 41, format ) == IMG_SUCCESS );
+    uint8_t *bytes = (uint8_t *) img.data;
+    size_t n = (size_t) 53 * 41 * img_bytes_per_pixel( &img );
+    uint32_t state = 11;
+    for ( size_t j = 0; j < n; j++ ) {
+      state = state * 1664525U + 1013904223U;
+      bytes[j] = (uint8_t) (j / 7 + (j % 13) * (state >> 29));
+    }
+    ASSERT( img_write( path, &img ) == IMG_SUCCESS );
+    check_unfilter_levels( path );
+    ASSERT( img_read_native( path, &back ) == IMG_SUCCESS );
+    ASSERT( images_equal( &img, &back ) );
+    img_cleanup( &back );
+    img_cleanup( &img );
+  }
+  unlink( path );
+}
+
+void test_byteswap_kernels( TestObjs *objs ) {
+  // odd length so that every variant has to handle a tail, and an
+  // unaligned destination like the scanlines pnglite filters
+  uint32_t in[37];
+  uint8_t buf[4 * 37 + 1];
+  uint8_t *out = buf + 1;
+  uint32_t state = 1;
+  for ( int i = 0; i < 37; i++ ) {
+    state = state * 1664525U + 1013904223U;
+    in[i] = state;
+  }
+
+  for ( int isa = 0; isa < KERNEL_ISA_COUNT; isa++ ) {
+    if ( kernel_byteswap_impls[isa] == NULL || !kernel_isa_supported( isa ) )
+      continue;
+    kernel_byteswap_impls[isa]( in, out, 37 );
+    for ( int i = 0; i < 37; i++ ) {
+      ASSERT( out[4 * i] == get_r( in[i] ) );
+      ASSERT( out[4 * i + 1] == get_g( in[i] ) );
+      ASSERT( out[4 * i + 2] == get_b( in[i] ) );
+      ASSERT( out[4 * i + 3] == get_a( in[i] ) );
+    }
+  }
+}
+
+void test_rgb_to_rgba_kernels( TestObjs *objs ) {
+  // lengths around the vector width, since the vector loop must not
+  // read past the last input byte
+  uint8_t in[3 * 37];
+  uint32_t out[37];
+  uint32_t state = 1;
+  for ( int i = 0; i < 3 * 37; i++ ) {
+    state = state * 1664525U + 1013904223U;
+    in[i] = (uint8_t) (state >> 24);
+  }
+
+  for ( int isa = 0; isa < KERNEL_ISA_COUNT; isa++ ) {
+    if ( kernel_rgb_to_rgba_impls[isa] == NULL || !kernel_isa_supported( isa ) )
+      continue;
+    for ( int n = 0; n <= 37; n++ ) {
+      // in + 3 * (37 - n) puts the last pixel at the end of the array
+      const uint8_t *src = in + 3 * (37 - n);
+      kernel_rgb_to_rgba_impls[isa]( src, out, n );
+      for ( int i = 0; i < n; i++ )
+        ASSERT( out[i] == make_pixel( src[3 * i], src[3 * i + 1], src[3 * i + 2], 255 ) );
+    }
+  }
+
+  // narrowing drops alpha, and must not write past the last output byte
+  uint32_t pixels[37];
+  uint8_t narrowed[3 * 37 + 8];
+  for ( int i = 0; i < 37; i++ ) {
+    state = state * 1664525U + 1013904223U;
+    pixels[i] = state;
+  }
+  for ( int isa = 0; isa < KERNEL_ISA_COUNT; isa++ ) {
+    if ( kernel_rgba_to_rgb_impls[isa] == NULL || !kernel_isa_supported( isa ) )
+      continue;
+    for ( int n = 0; n <= 37; n++ ) {
+      memset( narrowed, 0xA5, sizeof( narrowed ) );
+      kernel_rgba_to_rgb_impls[isa]( pixels, narrowed, n );
+      for ( int i = 0; i < n; i++ ) {
+        ASSERT( narrowed[3 * i] == get_r( pixels[i] ) );
+        ASSERT( narrowed[3 * i + 1] == get_g( pixels[i] ) );
+        ASSERT( narrowed[3 * i + 2] == get_b( pixels[i] ) );
+      }
+      for ( size_t i = 3 * n; i < sizeof( narrowed ); i++ )
+        ASSERT( narrowed[i] == 0xA5 );
+    }
+  }
+}
+
+void test_png_mmap( TestObjs *objs ) {
+  (void) objs;
+  png_init( 0, 0 );
+
+  // a mapped file decodes the same as one read with stdio
+  png_t png;
+  ASSERT( png_open_file_read( &png, "input/kittens.png" ) == PNG_NO_ERROR );
+  size_t size = (size_t) png.width * png.height * png.bpp;
+  uint8_t *expected = (uint8_t *) malloc( size );
+  uint8_t *decoded = (uint8_t *) malloc( size );
+  ASSERT( png_get_data( &png, expected ) == PNG_NO_ERROR );
+  png_close_file( &png );
+
+  ASSERT( png_open_file_mmap( &png, "input/kittens.png" ) == PNG_NO_ERROR );
+  ASSERT( png.width * png.height * png.bpp == size );
+  ASSERT( png_get_data( &png, decoded ) == PNG_NO_ERROR );
+  png_close_file( &png );
+  ASSERT( memcmp( expected, decoded, size ) == 0 );
+
+  // a truncated file opens, but decoding it fails instead of reading
+  // past the end of the mapping
+  FILE *in = fopen( "input/kittens.png", "rb" );
+  ASSERT( in != NULL );
+  fseek( in, 0, SEEK_END );
+  long file_size = ftell( in );
+  rewind( in );
+  uint8_t *contents = (uint8_t *) malloc( file_size );
+  ASSERT( fread( contents, 1, file_size, in ) == (size_t) file_size );
+  fclose( in );
+
+  char path[] = "/tmp/imgproc_tests_XXXXXX";
+  int fd = mkstemp( path );
+  ASSERT( fd >= 0 );
+  ASSERT( write( fd, contents, file_size / 2 ) == file_size / 2 );
+  close( fd );
+
+  ASSERT( png_open_file_mmap( &png, path ) == PNG_NO_ERROR );
+  ASSERT( png_get_data( &png, decoded ) != PNG_NO_ERROR );
+  png_close_file( &png );
+
+  // a file which isn't a png at all is rejected when it is opened
+  ASSERT( png_open_file_mmap( &png, "Makefile" ) == PNG_HEADER_ERROR );
+
+  unlink( path );
+  free( contents );
+  free( expected );
+  free( decoded );
+}
+
+// png_run_tasks_t running the tasks one after the other, last first,
+// so that no band can rely on the one before it being done
+static void run_tasks_backwards( void *runner, int num_tasks, png_task_t task, void *arg ) {
+  (void) runner;
+  for ( int i = num_tasks - 1; i >= 0; i-- )
+    task( arg, i );
+}
+
+void test_png_write_parallel( TestObjs *objs ) {
+  (void) objs;
+  png_init( 0, 0 );
+
+  // a compressible but not trivial image, with rows narrower than
+  // the deflate window so that priming a band takes several rows
+  const unsigned width = 301, height = 157;
+  size_t row_bytes = (size_t) width * 4;
+  uint8_t *data = (uint8_t *) malloc( row_bytes * height );
+  uint8_t *decoded = (uint8_t *) malloc( row_bytes * height );
+  uint32_t state = 5;
+  for ( unsigned i = 0; i < row_bytes * height; i++ ) {
+    state = state * 1664525U + 1013904223U;
+    data[i] = (uint8_t) ((i % row_bytes) / 4 + (state >> 29));
+  }
+
+  char path[] = "/tmp/imgproc_tests_XXXXXX";
+  int fd = mkstemp( path );
+  ASSERT( fd >= 0 );
+  close( fd );
+
+  // band counts from one to more than there are rows, with different
+  // window sizes and levels (which go into the zlib header)
+  const unsigned bands[] = { 1, 2, 7, 1000 };
+  for ( int i = 0; i < 4; i++ ) {
+    png_t png;
+    ASSERT( png_open_file_write( &png, path ) == PNG_NO_ERROR );
+    ASSERT( png_set_compression( &png, 3 * i, PNG_STRATEGY_DEFAULT, 8, 9 + 2 * i ) == PNG_NO_ERROR );
+    ASSERT( png_write_begin( &png, width, height, 8, PNG_TRUECOLOR_ALPHA ) == PNG_NO_ERROR );
+    ASSERT( png_write_rows_parallel( &png, data, row_bytes, NULL, bands[i], run_tasks_backwards, NULL ) == PNG_NO_ERROR );
+    png_close_file( &png );
+
+    memset( decoded, 0, row_bytes * height );
+    ASSERT( png_open_file_read( &png, path ) == PNG_NO_ERROR );
+    ASSERT( png.width == width && png.height == height );
+    ASSERT( png_get_data( &png, decoded ) == PNG_NO_ERROR );
+    png_close_file( &png );
+    ASSERT( memcmp( data, decoded, row_bytes * height ) == 0 );
+  }
+
+  // img_write with a pool splits large enough images into bands
+  struct Image big, back;
+  ASSERT( img_init( &big, 1024, 1024 ) == IMG_SUCCESS );
+  for ( int32_t i = 0; i < 1024 * 1024; i++ )
+    big.data[i] = make_pixel( i % 1024, i / 4096, (i * 7) % 251, 255 );
+  struct ImgWriteOptions opts;
+  img_write_options_init( &opts );
+  opts.pool = imgproc_pool_create( 3 );
+  ASSERT( img_write_with_options( path, &big, &opts ) == IMG_SUCCESS );
+  ASSERT( img_read( path, &back ) == IMG_SUCCESS );
+  ASSERT( images_equal( &big, &back ) );
+  imgproc_pool_destroy( opts.pool );
+  img_cleanup( &back );
+  img_cleanup( &big );
+
+  unlink( path );
+  free( data );
+  free( decoded );
+}
+
+void test_raw_formats( TestObjs *objs ) {
+  const char *suffixes[] = { ".pam", ".ff", ".imgraw" };
+  struct Image *rgb = to_rgb24( objs->smiley );
+  for ( int i = 0; i < 3; i++ ) {
+    char path[64];
+    snprintf( path, sizeof( path ), "/tmp/imgproc_tests_XXXXXX%s", suffixes[i] );
+    int fd = mkstemps( path, (int) strlen( suffixes[i] ) );
+    ASSERT( fd >= 0 );
+    close( fd );
+
+    // RGBA images round trip exactly
+    struct Image back;
+    ASSERT( img_write( path, objs->smiley ) == IMG_SUCCESS );
+    ASSERT( img_read( path, &back ) == IMG_SUCCESS );
+    ASSERT( images_equal( objs->smiley, &back ) );
+    img_cleanup( &back );
+
+    // so do RGB24 images, which are expanded to opaque RGBA by img_read
+    ASSERT( img_write( path, rgb ) == IMG_SUCCESS );
+    ASSERT( img_read_native( path, &back ) == IMG_SUCCESS );
+    // PAM and the native format keep them in RGB form, farbfeld always
+    // has alpha
+    ASSERT( back.format == (i != 1 ? IMG_FORMAT_RGB24 : IMG_FORMAT_RGBA32) );
+    img_cleanup( &back );
+    ASSERT( img_read( path, &back ) == IMG_SUCCESS );
+    ASSERT( back.format == IMG_FORMAT_RGBA32 );
+    for ( int32_t r = 0; r < back.height; r++ )
+      for ( int32_t c = 0; c < back.width; c++ )
+        ASSERT( back.data[compute_index( &back, r, c )] == (objs->smiley->data[compute_index( objs->smiley, r, c )] | 0xFF) );
+    img_cleanup( &back );
+
+    unlink( path );
+  }
+
+  // 16 bit farbfeld values are rounded to the nearest 8 bit value,
+  // not truncated to their high byte
+  {
+    char path[] = "/tmp/imgproc_tests_XXXXXX.ff";
+    int fd = mkstemps( path, 3 );
+    ASSERT( fd >= 0 );
+    const unsigned char ff[] = {
+      'f', 'a', 'r', 'b', 'f', 'e', 'l', 'd', 0, 0, 0, 2, 0, 0, 0, 1,
+      0x81, 0x00, 0x00, 0xFF, 0xFF, 0xFF, 0x00, 0x00,
+      0x80, 0x80, 0x7F, 0x7F, 0x00, 0x80, 0xFF, 0x7F,
+    };
+    ASSERT( write( fd, ff, sizeof( ff ) ) == (ssize_t) sizeof( ff ) );
+    close( fd );
+    struct Image back;
+    ASSERT( img_read( path, &back ) == IMG_SUCCESS );
+    ASSERT( back.width == 2 && back.height == 1 );
+    ASSERT( back.data[0] == make_pixel( 0x80, 0x01, 0xFF, 0x00 ) );
+    ASSERT( back.data[1] == make_pixel( 0x80, 0x7F, 0x00, 0xFF ) );
+    img_cleanup( &back );
+    unlink( path );
+  }
+
+  // PAM rows are stored without the row padding
+  char path[] = "/tmp/imgproc_tests_XXXXXX.pam";
+  int fd = mkstemps( path, 4 );
+  ASSERT( fd >= 0 );
+  close( fd );
+  ASSERT( img_write( path, rgb ) == IMG_SUCCESS );
+  FILE *in = fopen( path, "rb" );
+  char line[256];
+  long offset = 0;
+  while ( fgets( line, sizeof( line ), in ) != NULL && strcmp( line, "ENDHDR\n" ) != 0 )
+    ;
+  offset = ftell( in );
+  fseek( in, 0, SEEK_END );
+  ASSERT( ftell( in ) - offset == (long) rgb->width * rgb->height * 3 );
+  fclose( in );
+
+  // a truncated file is an error
+  ASSERT( truncate( path, offset + 10 ) == 0 );
+  struct Image back;
+  ASSERT( img_read( path, &back ) == IMG_ERR_COULD_NOT_OPEN );
+
+  unlink( path );
+  destroy_img( rgb );
+}
+
+void test_mapped_format( TestObjs *objs ) {
+  char path[] = "/tmp/imgproc_tests_XXXXXX.imgraw";
+  int fd = mkstemps( path, 7 );
+  ASSERT( fd >= 0 );
+  close( fd );
+
+  // the file is a header block followed by the rows as img_init lays
+  // them out, padding included
+  ASSERT( img_write( path, objs->smiley ) == IMG_SUCCESS );
+  struct stat st;
+  ASSERT( stat( path, &st ) == 0 );
+  ASSERT( st.st_size == IMG_ROW_ALIGN + (off_t) img_row_bytes( objs->smiley ) * objs->smiley->height );
+
+  // and is used in place, not copied
+  struct Image mapped;
+  ASSERT( img_read( path, &mapped ) == IMG_SUCCESS );
+  ASSERT( mapped.alloc == IMG_ALLOC_MAPPED );
+  ASSERT( (uintptr_t) mapped.data % IMG_ROW_ALIGN == 0 );
+  ASSERT( mapped.stride == objs->smiley->stride );
+  ASSERT( images_equal( objs->smiley, &mapped ) );
+
+  // changing the pixels doesn't change the file, and the image can be
+  // written back to the file it is mapped from
+  imgproc_complement( &mapped, &mapped );
+  imgproc_complement( objs->smiley, objs->smiley_out );
+  ASSERT( images_equal( objs->smiley_out, &mapped ) );
+  struct Image back;
+  ASSERT( img_read( path, &back ) == IMG_SUCCESS );
+  ASSERT( images_equal( objs->smiley, &back ) );
+  img_cleanup( &back );
+  ASSERT( img_write( path, &mapped ) == IMG_SUCCESS );
+  ASSERT( images_equal( objs->smiley_out, &mapped ) );
+  img_cleanup( &mapped );
+  ASSERT( img_read( path, &back ) == IMG_SUCCESS );
+  ASSERT( images_equal( objs->smiley_out, &back ) );
+  img_cleanup( &back );
+
+  // an image with a stride of its own is written with the usual one
+  struct Image wide = { 0 };
+  wide.width = wide.height = 5;
+  wide.stride = 7;
+  wide.format = IMG_FORMAT_RGBA32;
+  wide.data = (uint32_t *) malloc( (size_t) 7 * 5 * sizeof( uint32_t ) );
+  ASSERT( wide.data != NULL );
+  for ( int i = 0; i < 7 * 5; i++ )
+    wide.data[i] = (uint32_t) i * 0x01020304U;
+  ASSERT( img_write( path, &wide ) == IMG_SUCCESS );
+  ASSERT( img_read( path, &back ) == IMG_SUCCESS );
+  ASSERT( back.alloc == IMG_ALLOC_MAPPED && back.stride == IMG_ROW_ALIGN / 4 );
+  ASSERT( images_equal( &wide, &back ) );
+  img_cleanup( &back );
+  img_cleanup( &wide );
+
+  // RGB24 images are mapped by img_read_native, and expanded by img_read
+  struct Image *rgb = to_rgb24( objs->smiley );
+  ASSERT( img_write( path, rgb ) == IMG_SUCCESS );
+  ASSERT( img_read_native( path, &back ) == IMG_SUCCESS );
+  ASSERT( back.alloc == IMG_ALLOC_MAPPED && back.format == IMG_FORMAT_RGB24 );
+  ASSERT( images_equal( rgb, &back ) );
+  img_cleanup( &back );
+  ASSERT( img_read( path, &back ) == IMG_SUCCESS );
+  ASSERT( back.alloc == IMG_ALLOC_CACHE && back.format == IMG_FORMAT_RGBA32 );
+  for ( int32_t r = 0; r < back.height; r++ )
+    for ( int32_t c = 0; c < back.width; c++ )
+      ASSERT( back.data[compute_index( &back, r, c )] == (objs->smiley->data[compute_index( objs->smiley, r, c )] | 0xFF) );
+  img_cleanup( &back );
+  destroy_img( rgb );
+
+  // a truncated file is an error
+  ASSERT( stat( path, &st ) == 0 );
+  ASSERT( truncate( path, st.st_size - 1 ) == 0 );
+  ASSERT( img_read( path, &back ) == IMG_ERR_COULD_NOT_OPEN );
+
+  unlink( path );
+}
+
+void test_planar_kernels( TestObjs *objs ) {
+  (void) objs;
+  // component values chosen as for test_emboss_kernels, and a length
+  // which leaves a scalar tail after every vector loop
+  const uint8_t vals[] = { 0, 1, 2, 127, 128, 129, 254, 255 };
+  enum { N = 203 };
+  uint32_t pixels[N], out[N];
+  uint8_t planes[4][N], ul[3][N], expected[N], actual[N];
+  uint32_t state = 13;
+  for ( int i = 0; i < N; i++ ) {
+    state = state * 1664525U + 1013904223U;
+    pixels[i] = state;
+    for ( int c = 0; c < 3; c++ ) {
+      state = state * 1664525U + 1013904223U;
+      ul[c][i] = vals[state >> 29];
+    }
+  }
+
+  for ( int isa = 0; isa < KERNEL_ISA_COUNT; isa++ ) {
+    if ( kernel_deinterleave_impls[isa] == NULL || !kernel_isa_supported( isa ) )
+      continue;
+
+    // splitting and recombining gives back the same pixels
+    kernel_deinterleave_impls[isa]( pixels, planes[0], planes[1], planes[2], planes[3], N );
+    for ( int i = 0; i < N; i++ ) {
+      ASSERT( planes[0][i] == get_r( pixels[i] ) );
+      ASSERT( planes[1][i] == get_g( pixels[i] ) );
+      ASSERT( planes[2][i] == get_b( pixels[i] ) );
+      ASSERT( planes[3][i] == get_a( pixels[i] ) );
+    }
+    kernel_interleave_impls[isa]( planes[0], planes[1], planes[2], planes[3], out, N );
+    for ( int i = 0; i < N; i++ )
+      ASSERT( out[i] == pixels[i] );
+
+    kernel_complement_plane_impls[isa]( planes[0], actual, N );
+    for ( int i = 0; i < N; i++ )
+      ASSERT( actual[i] == (uint8_t) ~planes[0][i] );
+
+    // emboss is bit-exact with the packed scalar kernel, including when
+    // writing over one of its inputs
+    for ( int i = 0; i < N; i++ ) {
+      planes[0][i] = vals[pixels[i] >> 29];
+      planes[1][i] = vals[(pixels[i] >> 26) & 7];
+      planes[2][i] = vals[(pixels[i] >> 23) & 7];
+    }
+    for ( int i = 0; i < N; i++ ) {
+      uint32_t p = make_pixel( planes[0][i], planes[1][i], planes[2][i], 255 );
+      uint32_t q = make_pixel( ul[0][i], ul[1][i], ul[2][i], 255 );
+      kernel_emboss_impls[KERNEL_ISA_SCALAR]( &p, &q, &p, 1 );
+      expected[i] = get_r( p );
+    }
+    kernel_emboss_planar_impls[isa]( planes[0], planes[1], planes[2], ul[0], ul[1], ul[2], actual, N );
+    ASSERT( memcmp( expected, actual, N ) == 0 );
+    kernel_emboss_planar_impls[isa]( planes[0], planes[1], planes[2], ul[0], ul[1], ul[2], planes[1], N );
+    ASSERT( memcmp( expected, planes[1], N ) == 0 );
+  }
+}
+
+void test_planar( TestObjs *objs ) {
+  (void) objs;
+  // odd sizes, so that every vector loop has a scalar tail
+  struct Image *in = (struct Image *) malloc( sizeof( struct Image ) );
+  struct Image *expected = (struct Image *) malloc( sizeof( struct Image ) );
+  struct Image *actual = (struct Image *) malloc( sizeof( struct Image ) );
+  img_init( in, 67, 37 );
+  img_init( expected, 67, 37 );
+  img_init( actual, 67, 37 );
+  uint32_t state = 17;
+  for ( int i = 0; i < 67*37; i++ ) {
+    state = state * 1664525U + 1013904223U;
+    in->data[i] = state;
+  }
+
+  struct PlanarImage planar, planar_out;
+  ASSERT( planar_init( &planar, 67, 37 ) == IMG_SUCCESS );
+  ASSERT( planar_init( &planar_out, 67, 37 ) == IMG_SUCCESS );
+
+  enum KernelIsa dispatched = kernel_active_isa();
+  for ( int isa = 0; isa < KERNEL_ISA_COUNT; isa++ ) {
+    if ( !kernel_isa_supported( isa ) )
+      continue;
+    kernel_set_isa( isa );
+
+    planar_from_image( &planar, in );
+    planar_to_image( actual, &planar );
+    ASSERT( images_equal( in, actual ) );
+
+    // the planar transformations match the packed ones, both into a
+    // separate image and in place
+    imgproc_complement( in, expected );
+    planar_complement( &planar, &planar_out );
+    planar_to_image( actual, &planar_out );
+    ASSERT( images_equal( expected, actual ) );
+    planar_complement( &planar, &planar );
+    planar_to_image( actual, &planar );
+    ASSERT( images_equal( expected, actual ) );
+
+    planar_from_image( &planar, in );
+    imgproc_emboss( in, expected );
+    planar_emboss( &planar, &planar_out );
+    planar_to_image( actual, &planar_out );
+    ASSERT( images_equal( expected, actual ) );
+    planar_emboss( &planar, &planar );
+    planar_to_image( actual, &planar );
+    ASSERT( images_equal( expected, actual ) );
+  }
+  kernel_set_isa( dispatched );
+
+  // RGB24 images get opaque alpha
+  struct Image rgb;
+  ASSERT( img_init_format( &rgb, 67, 37, IMG_FORMAT_RGB24 ) == IMG_SUCCESS );
+  for ( int row = 0; row < 37; row++ ) {
+    uint8_t *bytes = (uint8_t *) rgb.data + row * img_row_bytes( &rgb );
+    for ( int i = 0; i < 67*3; i++ )
+      bytes[i] = (uint8_t) (row + i * 7);
+  }
+  planar_from_image( &planar, &rgb );
+  for ( int row = 0; row < 37; row++ ) {
+    const uint8_t *bytes = (const uint8_t *) rgb.data + row * img_row_bytes( &rgb );
+    for ( int i = 0; i < 67; i++ ) {
+      ASSERT( planar.planes[PLANAR_R][row * 67 + i] == bytes[3 * i] );
+      ASSERT( planar.planes[PLANAR_B][row * 67 + i] == bytes[3 * i + 2] );
+      ASSERT( planar.planes[PLANAR_A][row * 67 + i] == 255 );
+    }
+  }
+  memset( rgb.data, 0, 37 * img_row_bytes( &rgb ) );
+  planar_to_image( &rgb, &planar );
+  for ( int row = 0; row < 37; row++ ) {
+    const uint8_t *bytes = (const uint8_t *) rgb.data + row * img_row_bytes( &rgb );
+    for ( int i = 0; i < 67*3; i++ )
+      ASSERT( bytes[i] == (uint8_t) (row + i * 7) );
+  }
+
+  img_cleanup( &rgb );
+  planar_cleanup( &planar );
+  planar_cleanup( &planar_out );
+  destroy_img( in );
+  destroy_img( expected );
+  destroy_img( actual );
+}
+
+void test_row_stride( TestObjs *objs ) {
+  (void) objs;
+  // rows are aligned and padded for both formats
+  struct Image img;
+  ASSERT( img_init( &img, 5, 3 ) == IMG_SUCCESS );
+  ASSERT( img.stride == 16 && img_row_bytes( &img ) == 64 );
+  ASSERT( (uintptr_t) img.data % IMG_ROW_ALIGN == 0 );
+  ASSERT( compute_index( &img, 2, 3 ) == 35 );
+  img_cleanup( &img );
+  ASSERT( img_init_format( &img, 65, 3, IMG_FORMAT_RGB24 ) == IMG_SUCCESS );
+  ASSERT( img.stride == 128 && img_row_bytes( &img ) == 384 );
+  ASSERT( (uintptr_t) img.data % IMG_ROW_ALIGN == 0 );
+  img_cleanup( &img );
+
+  // the transformations honor each image's own stride, so an output
+  // with wider padding than the input gets the same pixels
+  struct Image *in = (struct Image *) malloc( sizeof( struct Image ) );
+  struct Image *expected = (struct Image *) malloc( sizeof( struct Image ) );
+  struct Image wide;
+  img_init( in, 37, 37 );
+  img_init( expected, 37, 37 );
+  uint32_t state = 19;
+  for ( int i = 0; i < 37 * in->stride; i++ ) {
+    state = state * 1664525U + 1013904223U;
+    in->data[i] = state;
+  }
+  wide.width = wide.height = 37;
+  wide.format = IMG_FORMAT_RGBA32;
+  wide.stride = 41;
+  // a program filling in an Image itself says where its pixels came
+  // from, so that img_cleanup can release them
+  wide.data = (uint32_t *) img_alloc_data( (size_t) 41 * 37 * sizeof( uint32_t ) );
+  wide.alloc = IMG_ALLOC_CACHE;
+  ASSERT( wide.data != NULL && (uintptr_t) wide.data % IMG_ROW_ALIGN == 0 );
+
+  for ( int i = 0; i < 41 * 37; i++ )
+    wide.data[i] = 0xDEADBEEF;
+  imgproc_complement( in, expected );
+  imgproc_complement( in, &wide );
+  ASSERT( images_equal( expected, &wide ) );
+  // the padding is left alone
+  for ( int i = 0; i < 37; i++ )
+    for ( int j = 37; j < 41; j++ )
+      ASSERT( wide.data[compute_index( &wide, i, j )] == 0xDEADBEEF );
+
+  imgproc_ellipse( in, expected );
+  imgproc_ellipse( in, &wide );
+  ASSERT( images_equal( expected, &wide ) );
+
+  imgproc_emboss( in, expected );
+  imgproc_emboss( in, &wide );
+  ASSERT( images_equal( expected, &wide ) );
+
+  ASSERT( imgproc_transpose( in, expected ) );
+  ASSERT( imgproc_transpose( in, &wide ) );
+  ASSERT( images_equal( expected, &wide ) );
+  ASSERT( imgproc_transpose( &wide, in ) );
+  ASSERT( imgproc_transpose( expected, expected ) );
+  ASSERT( imgproc_transpose( &wide, &wide ) );
+  ASSERT( images_equal( in, expected ) );
+  ASSERT( images_equal( in, &wide ) );
+
+  img_cleanup( &wide );
+
+  // so can pixels from malloc, which img_cleanup passes to free()
+  // (a zero-initialized Image has alloc == IMG_ALLOC_MALLOC)
+  struct Image heap = { 0 };
+  heap.width = heap.height = heap.stride = 37;
+  heap.format = IMG_FORMAT_RGBA32;
+  heap.data = (uint32_t *) malloc( (size_t) 37 * 37 * sizeof( uint32_t ) );
+  ASSERT( heap.data != NULL );
+  imgproc_complement( in, &heap );
+  imgproc_complement( in, expected );
+  ASSERT( images_equal( expected, &heap ) );
+  img_cleanup( &heap );
+
+  destroy_img( in );
+  destroy_img( expected );
+}
+
+void test_buffer_cache( TestObjs *objs ) {
+  (void) objs;
+  // buffers are aligned, and a freed buffer is handed out again
+  struct ImgprocBufferStats before, after;
+  imgproc_buffer_trim();
+  const size_t sizes[] = { 0, 1, 64, 65, 1000, 4096, 100000, 3 << 20 };
+  for ( int i = 0; i < 8; i++ ) {
+    uint8_t *p = imgproc_buffer_alloc( sizes[i] );
+    ASSERT( p != NULL );
+    ASSERT( (uintptr_t) p % IMGPROC_BUFFER_ALIGN == 0 );
+    memset( p, 0xAB, sizes[i] );
+    imgproc_buffer_free( p );
+    imgproc_buffer_stats( &before );
+    ASSERT( before.cached_bytes >= sizes[i] );
+    uint8_t *q = imgproc_buffer_alloc( sizes[i] );
+    imgproc_buffer_stats( &after );
+    ASSERT( q == p );
+    ASSERT( after.reused == before.reused + 1 );
+    imgproc_buffer_free( q );
+  }
+  imgproc_buffer_free( NULL );
+
+  // sizes are rounded up to a class, 1000 bytes to 1024
+  uint8_t *p = imgproc_buffer_alloc( 1000 );
+  imgproc_buffer_free( p );
+  ASSERT( imgproc_buffer_alloc( 1024 ) == p );
+  imgproc_buffer_free( p );
+  uint8_t *q = imgproc_buffer_alloc( 1025 );
+  ASSERT( q != p );
+  imgproc_buffer_free( q );
+
+  // with caching disabled, nothing is kept
+  imgproc_buffer_set_cache_limit( 0 );
+  imgproc_buffer_stats( &after );
+  ASSERT( after.cached_bytes == 0 );
+  imgproc_buffer_free( imgproc_buffer_alloc( 1000 ) );
+  imgproc_buffer_stats( &after );
+  ASSERT( after.cached_bytes == 0 );
+  imgproc_buffer_set_cache_limit( IMGPROC_BUFFER_CACHE_DEFAULT );
+
+  // once an image has been read and written, doing it again takes
+  // every buffer (pnglite's and zlib's included) from the cache
+  char path[] = "/tmp/imgproc_tests_XXXXXX";
+  int fd = mkstemp( path );
+  ASSERT( fd >= 0 );
+  close( fd );
+  png_init( imgproc_buffer_alloc, imgproc_buffer_free );
+  for ( int i = 0; i < 3; i++ ) {
+    struct Image img;
+    imgproc_buffer_stats( &before );
+    ASSERT( img_read( "input/kittens.png", &img ) == IMG_SUCCESS );
+    imgproc_complement( &img, &img );
+    ASSERT( img_write( path, &img ) == IMG_SUCCESS );
+    img_cleanup( &img );
+    imgproc_buffer_stats( &after );
+    ASSERT( after.allocs > before.allocs );
+    if ( i > 0 )
+      ASSERT( after.reused - before.reused == after.allocs - before.allocs );
+  }
+  unlink( path );
+}
+
+void test_uninitialized_output( TestObjs *objs ) {
+  (void) objs;
+  struct Image img;
+  ASSERT( img_init_uninitialized( &img, 37, 29, IMG_FORMAT_RGB24 ) == IMG_SUCCESS );
+  ASSERT( img.width == 37 && img.height == 29 && img.format == IMG_FORMAT_RGB24 );
+  ASSERT( img.stride == 64 && (uintptr_t) img.data % IMG_ROW_ALIGN == 0 );
+  img_cleanup( &img );
+
+  // every transformation writes all of its output pixels, so an output
+  // holding garbage ends up the same as one filled with opaque black
+  struct ImgprocPool *pool = imgproc_pool_create( 2 );
+  ASSERT( pool != NULL );
+  for ( int format = IMG_FORMAT_RGBA32; format <= IMG_FORMAT_RGB24; format++ ) {
+    struct Image in, expected, actual;
+    ASSERT( img_init_format( &in, 37, 37, format ) == IMG_SUCCESS );
+    ASSERT( img_init_format( &expected, 37, 37, format ) == IMG_SUCCESS );
+    ASSERT( img_init_uninitialized( &actual, 37, 37, format ) == IMG_SUCCESS );
+    uint32_t state = 23;
+    for ( size_t i = 0; i < 37 * img_row_bytes( &in ); i++ ) {
+      state = state * 1664525U + 1013904223U;
+      ((uint8_t *) in.data)[i] = (uint8_t) (state >> 24);
+    }
+
+    for ( int op = 0; op < 4; op++ ) {
+      memset( actual.data, 0xA5, 37 * img_row_bytes( &actual ) );
+      switch ( op ) {
+      case 0:
+        imgproc_complement_mt( pool, &in, &expected );
+        imgproc_complement_mt( pool, &in, &actual );
+        break;
+      case 1:
+        ASSERT( imgproc_transpose_mt( pool, &in, &expected ) );
+        ASSERT( imgproc_transpose_mt( pool, &in, &actual ) );
+        break;
+      case 2:
+        imgproc_ellipse_mt( pool, &in, &expected );
+        imgproc_ellipse_mt( pool, &in, &actual );
+        break;
+      case 3:
+        imgproc_emboss_mt( pool, &in, &expected );
+        imgproc_emboss_mt( pool, &in, &actual );
+        break;
+      }
+      ASSERT( images_equal( &expected, &actual ) );
+    }
+
+    img_cleanup( &in );
+    img_cleanup( &expected );
+    img_cleanup( &actual );
+  }
+  imgproc_pool_destroy( pool );
+}
+
+void test_batch( TestObjs *objs ) {
+  char in_dir[] = "/tmp/imgproc_tests_XXXXXX";
+  char out_dir[] = "/tmp/imgproc_tests_XXXXXX";
+  ASSERT( mkdtemp( in_dir ) != NULL );
+  ASSERT( mkdtemp( out_dir ) != NULL );
+
+  // square images in both pixel formats and every file format, an image
+  // which isn't square (so transposing it fails), a file which isn't an
+  // image although it is named like one, and one which is skipped
+  struct Image *rgb = to_rgb24( objs->sq_test );
+  struct Image *inputs[] = { objs->sq_test, rgb, objs->smiley, objs->sq_test, rgb };
+  const char *names[] = { "a.png", "b.png", "c.png", "d.pam", "e.ff", "f.png", "notes.txt" };
+  char path[256];
+  for ( int i = 0; i < 7; i++ ) {
+    snprintf( path, sizeof( path ), "%s/%s", in_dir, names[i] );
+    if ( i < 5 ) {
+      ASSERT( img_write( path, inputs[i] ) == IMG_SUCCESS );
+    } else {
+      FILE *fp = fopen( path, "w" );
+      ASSERT( fp != NULL );
+      fputs( "not an image\n", fp );
+      fclose( fp );
+    }
+  }
+
+  struct ImgprocBatchList list;
+  imgproc_batch_list_init( &list );
+  ASSERT( imgproc_batch_list_read_dir( &list, in_dir, out_dir ) );
+  ASSERT( list.num_images == 6 );
+  for ( int i = 0; i < 6; i++ ) {
+    snprintf( path, sizeof( path ), "%s/%s", in_dir, names[i] );
+    ASSERT( strcmp( list.inputs[i], path ) == 0 );
+    snprintf( path, sizeof( path ), "%s/%s", out_dir, names[i] );
+    ASSERT( strcmp( list.outputs[i], path ) == 0 );
+  }
+
+  // run on a pool with queues of one image, so that the stages keep
+  // waiting for each other, and on the calling thread only
+  const enum ImgprocOp ops[] = { IMGPROC_OP_COMPLEMENT, IMGPROC_OP_TRANSPOSE, IMGPROC_OP_EMBOSS };
+  struct ImgprocPool *pool = imgproc_pool_create( 3 );
+  ASSERT( pool != NULL );
+  for ( int run = 0; run < 2; run++ ) {
+    ASSERT( imgproc_batch_run( run == 0 ? pool : NULL, &list, ops, 3, NULL, run == 0 ? 1 : 0 ) == 2 );
+    for ( int i = 0; i < 6; i++ ) {
+      if ( i == 2 || i == 5 ) {
+        ASSERT( access( list.outputs[i], F_OK ) != 0 );
+        continue;
+      }
+      struct Image expected, actual;
+      ASSERT( img_read_native( list.inputs[i], &expected ) == IMG_SUCCESS );
+      ASSERT( imgproc_chain( NULL, ops, 3, &expected ) );
+      ASSERT( img_read_native( list.outputs[i], &actual ) == IMG_SUCCESS );
+      ASSERT( images_equal( &expected, &actual ) );
+      img_cleanup( &expected );
+      img_cleanup( &actual );
+      unlink( list.outputs[i] );
+    }
+  }
+  imgproc_pool_destroy( pool );
+
+  // a manifest names the output files, with comments and blank lines
+  char manifest[256];
+  snprintf( manifest, sizeof( manifest ), "%s/manifest", in_dir );
+  FILE *fp = fopen( manifest, "w" );
+  ASSERT( fp != NULL );
+  fprintf( fp, "# input output\n\n%s %s/x.png\n  %s\t%s/y.pam  \n", list.inputs[0], out_dir, list.inputs[4], out_dir );
+  fclose( fp );
+  struct ImgprocBatchList from_manifest;
+  imgproc_batch_list_init( &from_manifest );
+  ASSERT( imgproc_batch_list_read_manifest( &from_manifest, manifest ) );
+  ASSERT( from_manifest.num_images == 2 );
+  ASSERT( strcmp( from_manifest.inputs[1], list.inputs[4] ) == 0 );
+  snprintf( path, sizeof( path ), "%s/y.pam", out_dir );
+  ASSERT( strcmp( from_manifest.outputs[1], path ) == 0 );
+  ASSERT( imgproc_batch_run( NULL, &from_manifest, ops, 1, NULL, 0 ) == 0 );
+  for ( int i = 0; i < 2; i++ ) {
+    struct Image expected, actual;
+    ASSERT( img_read_native( from_manifest.inputs[i], &expected ) == IMG_SUCCESS );
+    imgproc_complement_mt( NULL, &expected, &expected );
+    ASSERT( img_read_native( from_manifest.outputs[i], &actual ) == IMG_SUCCESS );
+    ASSERT( images_equal( &expected, &actual ) );
+    img_cleanup( &expected );
+    img_cleanup( &actual );
+    unlink( from_manifest.outputs[i] );
+  }
+  imgproc_batch_list_cleanup( &from_manifest );
+  ASSERT( from_manifest.num_images == 0 );
+
+  // a line without an output file name is an error
+  fp = fopen( manifest, "a" );
+  ASSERT( fp != NULL );
+  fputs( "lonely.png\n", fp );
+  fclose( fp );
+  ASSERT( !imgproc_batch_list_read_manifest( &from_manifest, manifest ) );
+  imgproc_batch_list_cleanup( &from_manifest );
+  unlink( manifest );
+
+  for ( int i = 0; i < 7; i++ ) {
+    snprintf( path, sizeof( path ), "%s/%s", in_dir, names[i] );
+    unlink( path );
+  }
+  imgproc_batch_list_cleanup( &list );
+  rmdir( in_dir );
+  rmdir( out_dir );
+  destroy_img( rgb );
+}
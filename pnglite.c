@@ -15,13 +15,46 @@
 #include <string.h>
 #include "pnglite.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define USE_MMAP 1
+#else
+#define USE_MMAP 0
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#define USE_SSE2 1
+#else
+#define USE_SSE2 0
+#endif
+
+/* size of the IDAT chunks written, except for the last one */
+#define PNG_IDAT_SIZE 65536
+
 static png_alloc_t png_alloc;
 static png_free_t png_free;
 
+/* best unfilter kernels the CPU supports (a PNG_SIMD_* value), set by png_init; each png_t chooses its own */
+static int png_simd_supported;
+
 static size_t file_read(png_t* png, void* out, size_t size, size_t numel)
 {
 	size_t result;
-	if(png->read_fun)
+	if(png->map)
+	{
+		size_t avail = (png->map_size - png->map_pos) / size;
+
+		result = numel < avail ? numel : avail;
+		if(out)
+			memcpy(out, png->map + png->map_pos, result * size);
+		png->map_pos += result * size;
+	}
+	else if(png->read_fun)
 	{
 		result = png->read_fun(out, size, numel, png->user_pointer);
 	}
@@ -117,6 +150,21 @@ int png_init(png_alloc_t pngalloc, png_free_t pngfree)
 	else
 		png_free = &free;
 
+#if USE_SSE2 && defined(__GNUC__)
+	png_simd_supported = __builtin_cpu_supports("ssse3") ? PNG_SIMD_SSSE3 : PNG_SIMD_SSE2;
+#elif USE_SSE2
+	png_simd_supported = PNG_SIMD_SSE2;
+#else
+	png_simd_supported = PNG_SIMD_NONE;
+#endif
+
+	return PNG_NO_ERROR;
+}
+
+int png_set_simd(png_t* png, int level)
+{
+	png->simd = (unsigned char)(level < png_simd_supported ? level : png_simd_supported);
+
 	return PNG_NO_ERROR;
 }
 
@@ -251,18 +299,30 @@ void png_print_info(png_t* png)
 	printf("\tinterlace:\t%s\n",	png->interlace_method?"interlace":"no interlace");
 }
 
-int png_open_read(png_t* png, png_read_callback_t read_fun, void* user_pointer)
+static void png_reset_state(png_t* png)
+{
+	png->zs = 0;
+	png->png_data = 0;
+	png->png_datalen = 0;
+	png->readbuf = 0;
+	png->readbuflen = 0;
+	png->prev_row = 0;
+	png->next_row = 0;
+	png->idat_remaining = 0;
+	png->idat_crc = 0;
+	png->in_idat = 0;
+	png->idat_buf = 0;
+	png->filter_buf = 0;
+	png->cur_row = 0;
+	png->writing = 0;
+	png->simd = (unsigned char)png_simd_supported;
+}
+
+static int png_read_header(png_t* png)
 {
 	char header[8];
 	int result;
 
-	png->read_fun = read_fun;
-	png->write_fun = 0;
-	png->user_pointer = user_pointer;
-
-	if(!read_fun && !user_pointer)
-		return PNG_WRONG_ARGUMENTS;
-
 	if(file_read(png, header, 1, 8) != 8)
 		return PNG_EOF_ERROR;
 
@@ -276,11 +336,32 @@ int png_open_read(png_t* png, png_read_callback_t read_fun, void* user_pointer)
 	return result;
 }
 
+int png_open_read(png_t* png, png_read_callback_t read_fun, void* user_pointer)
+{
+	png->read_fun = read_fun;
+	png->write_fun = 0;
+	png->user_pointer = user_pointer;
+	png->map = 0;
+	png_reset_state(png);
+
+	if(!read_fun && !user_pointer)
+		return PNG_WRONG_ARGUMENTS;
+
+	return png_read_header(png);
+}
+
 int png_open_write(png_t* png, png_write_callback_t write_fun, void* user_pointer)
 {
 	png->write_fun = write_fun;
 	png->read_fun = 0;
 	png->user_pointer = user_pointer;
+	png->map = 0;
+	png_reset_state(png);
+	png->filter_mode = PNG_FILTER_MODE_ADAPTIVE;
+	png->level = Z_DEFAULT_COMPRESSION;
+	png->strategy = Z_DEFAULT_STRATEGY;
+	png->mem_level = 8;
+	png->window_bits = 15;
 
 	if(!write_fun && !user_pointer)
 		return PNG_WRONG_ARGUMENTS;
@@ -303,6 +384,53 @@ int png_open_file_read(png_t *png, const char* filename)
 	return png_open_read(png, 0, fp);
 }
 
+int png_open_file_mmap(png_t *png, const char* filename)
+{
+#if USE_MMAP
+	struct stat st;
+	void* map;
+	int result;
+	int fd = open(filename, O_RDONLY);
+
+	if(fd < 0)
+		return PNG_FILE_ERROR;
+
+	/* pipes, empty files and the like are read the usual way */
+	if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+	{
+		close(fd);
+		return png_open_file_read(png, filename);
+	}
+
+	map = mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if(map == MAP_FAILED)
+		return png_open_file_read(png, filename);
+
+	madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+	png->read_fun = 0;
+	png->write_fun = 0;
+	png->user_pointer = 0;
+	png->map = map;
+	png->map_size = (size_t)st.st_size;
+	png->map_pos = 0;
+	png_reset_state(png);
+
+	result = png_read_header(png);
+	if(result != PNG_NO_ERROR)
+	{
+		munmap(map, (size_t)st.st_size);
+		png->map = 0;
+	}
+
+	return result;
+#else
+	return png_open_file_read(png, filename);
+#endif
+}
+
 int png_open_file_write(png_t *png, const char* filename)
 {
 	FILE* fp = fopen(filename, "wb");
@@ -318,14 +446,44 @@ int png_open_file(png_t *png, const char* filename)
 	return png_open_file_read(png, filename);
 }
 
+static void png_write_release(png_t* png);
+
 int png_close_file(png_t* png)
 {
+	if(png->writing)
+		png_write_release(png);
+	else
+		png_read_end(png);
+
+#if USE_MMAP
+	if(png->map)
+	{
+		munmap((void*)png->map, png->map_size);
+		png->map = 0;
+		return PNG_NO_ERROR;
+	}
+#endif
+
 	fclose(png->user_pointer);
 
 	return PNG_NO_ERROR;
 }
 
-static int png_init_deflate(png_t* png, unsigned char* data, int datalen)
+/* zlib allocation callbacks, so that zlib's state and window come from
+   the same allocator as pnglite's buffers */
+static voidpf png_zalloc(voidpf opaque, uInt items, uInt size)
+{
+	(void)opaque;
+	return png_alloc((size_t)items * size);
+}
+
+static void png_zfree(voidpf opaque, voidpf address)
+{
+	(void)opaque;
+	png_free(address);
+}
+
+static int png_init_deflate(png_t* png)
 {
 	z_stream *stream;
 	png->zs = png_alloc(sizeof(z_stream));
@@ -336,12 +494,14 @@ static int png_init_deflate(png_t* png, unsigned char* data, int datalen)
 		return PNG_MEMORY_ERROR;
 
 	memset(stream, 0, sizeof(z_stream));
+	stream->zalloc = png_zalloc;
+	stream->zfree = png_zfree;
 
-	if(deflateInit(stream, Z_DEFAULT_COMPRESSION) != Z_OK)
+	if(deflateInit2(stream, png->level, Z_DEFLATED, png->window_bits, png->mem_level, png->strategy) != Z_OK)
 		return PNG_ZLIB_ERROR;
 
-	stream->next_in = data;
-	stream->avail_in = datalen;
+	stream->next_out = png->idat_buf + 4;
+	stream->avail_out = PNG_IDAT_SIZE;
 
 	return PNG_NO_ERROR;
 }
@@ -363,6 +523,8 @@ static int png_init_inflate(png_t* png)
 
 #if USE_ZLIB
 	memset(stream, 0, sizeof(z_stream));
+	stream->zalloc = png_zalloc;
+	stream->zfree = png_zfree;
 	if(inflateInit(stream) != Z_OK)
 		return PNG_ZLIB_ERROR;
 #else
@@ -387,6 +549,7 @@ static int png_end_deflate(png_t* png)
 	deflateEnd(stream);
 
 	png_free(png->zs);
+	png->zs = 0;
 
 	return PNG_NO_ERROR;
 }
@@ -417,7 +580,10 @@ static int png_end_inflate(png_t* png)
 	return PNG_NO_ERROR;
 }
 
-static int png_inflate(png_t* png, unsigned char* data, int len)
+static int png_read_idat(png_t* png);
+
+/* inflates until the output buffer set in the stream is full, reading IDAT data as it is needed */
+static int png_inflate(png_t* png)
 {
 	int result;
 #if USE_ZLIB
@@ -429,28 +595,54 @@ static int png_inflate(png_t* png, unsigned char* data, int len)
 	if(!stream)
 		return PNG_MEMORY_ERROR;
 
-	stream->next_in = data;
-	stream->avail_in = len;
+	while(stream->avail_out > 0)
+	{
+		if(stream->avail_in == 0)
+		{
+			result = png_read_idat(png);
+			if(result != PNG_NO_ERROR)
+				return result;
+		}
 
 #if USE_ZLIB
-	result = inflate(stream, Z_SYNC_FLUSH);
+		result = inflate(stream, Z_SYNC_FLUSH);
 #else
-	result = z_inflate(stream);
+		result = z_inflate(stream);
 #endif
 
-	if(result != Z_STREAM_END && result != Z_OK)
-	{
-		printf("%s\n", stream->msg);
-		return PNG_ZLIB_ERROR;
+		if(result == Z_STREAM_END && stream->avail_out > 0)
+			return PNG_EOF_ERROR;	/* image data ended early */
+
+		if(result != Z_STREAM_END && result != Z_OK)
+		{
+			if(stream->msg)
+				printf("%s\n", stream->msg);
+			return PNG_ZLIB_ERROR;
+		}
 	}
 
-	if(stream->avail_in != 0)
-		return PNG_ZLIB_ERROR;
+	return PNG_NO_ERROR;
+}
+
+/* writes the first len bytes of image data in idat_buf as an IDAT chunk */
+static int png_write_idat(png_t* png, unsigned len)
+{
+	unsigned long crc;
+
+	crc = crc32(0L, Z_NULL, 0);
+	crc = crc32(crc, png->idat_buf, len+4);
+
+	if(file_write_ul(png, len) != PNG_NO_ERROR ||
+	   file_write(png, png->idat_buf, 1, len+4) != len+4 ||
+	   file_write_ul(png, crc) != PNG_NO_ERROR)
+		return PNG_IO_ERROR;
 
 	return PNG_NO_ERROR;
 }
 
-static int png_deflate(png_t* png, char* outdata, int outlen, int *outwritten)
+/* deflates len bytes of data, writing an IDAT chunk each time idat_buf fills up.
+   With flush set to Z_FINISH, the deflate stream is completed. */
+static int png_deflate(png_t* png, unsigned char* data, unsigned len, int flush)
 {
 	int result;
 
@@ -459,141 +651,178 @@ static int png_deflate(png_t* png, char* outdata, int outlen, int *outwritten)
 	if(!stream)
 		return PNG_MEMORY_ERROR;
 
-	stream->next_out = (unsigned char*)outdata;
-	stream->avail_out = outlen;
-
-	result = deflate(stream, Z_SYNC_FLUSH);
-
-	*outwritten = outlen - stream->avail_out;
+	stream->next_in = data;
+	stream->avail_in = len;
 
-	if(result != Z_STREAM_END && result != Z_OK)
+	do
 	{
-		printf("%s\n", stream->msg);
-		return PNG_ZLIB_ERROR;
-	}
+		result = deflate(stream, flush);
 
-	return result;
-}
+		if(result != Z_STREAM_END && result != Z_OK && result != Z_BUF_ERROR)
+		{
+			if(stream->msg)
+				printf("%s\n", stream->msg);
+			return PNG_ZLIB_ERROR;
+		}
 
-static int png_write_idats(png_t* png, unsigned char* data)
-{
-	unsigned char *chunk;
-	unsigned long written;
-	unsigned long crc;
-	unsigned size = png->width * png->height * png->bpp + png->height;
-	unsigned chunk_size = compressBound(size);
+		if(stream->avail_out == 0)
+		{
+			if(png_write_idat(png, PNG_IDAT_SIZE) != PNG_NO_ERROR)
+				return PNG_IO_ERROR;
 
-	(void)png_init_deflate;
-	(void)png_end_deflate;
-	(void)png_deflate;
+			stream->next_out = png->idat_buf + 4;
+			stream->avail_out = PNG_IDAT_SIZE;
+		}
+	} while(stream->avail_in > 0 || (flush == Z_FINISH && result != Z_STREAM_END));
 
-	chunk = png_alloc(chunk_size + 4);
-	memcpy(chunk, "IDAT", 4);
+	return PNG_NO_ERROR;
+}
 
-	written = chunk_size;
-	compress(chunk+4, &written, data, size);
+static int png_write_iend(png_t* png)
+{
+	unsigned long crc = crc32(0L, (const unsigned char *)"IEND", 4);
 
-	crc = crc32(0L, Z_NULL, 0);
-	crc = crc32(crc, chunk, written+4);
-	set_ul(chunk+written+4, crc);
-	file_write_ul(png, written);
-	file_write(png, chunk, 1, written+8);
-	png_free(chunk);
-
-	file_write_ul(png, 0);
-	file_write(png, "IEND", 1, 4);
-	crc = crc32(0L, (const unsigned char *)"IEND", 4);
-	file_write_ul(png, crc);
+	if(file_write_ul(png, 0) != PNG_NO_ERROR ||
+	   file_write(png, "IEND", 1, 4) != 4 ||
+	   file_write_ul(png, crc) != PNG_NO_ERROR)
+		return PNG_IO_ERROR;
 
 	return PNG_NO_ERROR;
 }
 
-static int png_read_idat(png_t* png, unsigned length)
+static int png_end_idat(png_t* png)
 {
-#if DO_CRC_CHECKS
 	unsigned orig_crc;
-	unsigned calc_crc;
+
+	if(file_read_ul(png, &orig_crc) != PNG_NO_ERROR)
+		return PNG_FILE_ERROR;
+
+#if DO_CRC_CHECKS
+	if(orig_crc != png->idat_crc)
+		return PNG_CRC_ERROR;
 #endif
 
-	if(!png->readbuf || png->readbuflen < length)
-	{
-		if (png->readbuf)
-		{
-			png_free(png->readbuf);
-		}
-		png->readbuf = png_alloc(length);
-		png->readbuflen = length;
-	}
+	png->in_idat = 0;
 
-	if(!png->readbuf)
-	{
-		return PNG_MEMORY_ERROR;
-	}
+	return PNG_NO_ERROR;
+}
 
-	if(file_read(png, png->readbuf, 1, length) != length)
+/* reads the next piece of the current IDAT's data, at most readbuflen bytes of it into readbuf, or all of it in place
+   when the file is mapped */
+static int png_read_idat_data(png_t* png, unsigned char** data, unsigned* length)
+{
+	if(png->map)
 	{
-		return PNG_FILE_ERROR;
-	}
-
-#if DO_CRC_CHECKS
-	calc_crc = crc32(0L, Z_NULL, 0);
-	calc_crc = crc32(calc_crc, (unsigned char*)"IDAT", 4);
-	calc_crc = crc32(calc_crc, (unsigned char*)png->readbuf, length);
+		*length = png->idat_remaining;
 
-	file_read_ul(png, &orig_crc);
+		if(png->map_size - png->map_pos < *length)
+			return PNG_FILE_ERROR;
 
-	if(orig_crc != calc_crc)
+		*data = (unsigned char*)png->map + png->map_pos;
+		png->map_pos += *length;
+	}
+	else
 	{
-		return PNG_CRC_ERROR;
+		*length = png->idat_remaining < png->readbuflen ? png->idat_remaining : png->readbuflen;
+
+		if(file_read(png, png->readbuf, 1, *length) != *length)
+			return PNG_FILE_ERROR;
+
+		*data = png->readbuf;
 	}
-#else
-	file_read_ul(png);
+
+#if DO_CRC_CHECKS
+	png->idat_crc = crc32(png->idat_crc, *data, *length);
 #endif
+	png->idat_remaining -= *length;
 
-	return png_inflate(png, png->readbuf, length);
+	return PNG_NO_ERROR;
 }
 
-static int png_process_chunk(png_t* png)
+/* reads the next piece of IDAT data as input for the inflate stream */
+static int png_read_idat(png_t* png)
 {
-	int result = PNG_NO_ERROR;
+	int result;
 	unsigned type;
 	unsigned length;
+	unsigned char* data;
+#if USE_ZLIB
+	z_stream *stream = png->zs;
+#else
+	zl_stream *stream = png->zs;
+#endif
 
-	file_read_ul(png, &length);
-
-	if(file_read(png, &type, 1, 4) != 4)
-		return PNG_FILE_ERROR;
-
-	if(type == *(unsigned int*)"IDAT")	/* if we found an idat, all other idats should be followed with no other chunks in between */
+	while(png->idat_remaining == 0)
 	{
-		if(!png->png_data) /* first IDAT */
+		if(png->in_idat)
 		{
-			png->png_datalen = png->width * png->height * png->bpp + png->height;
-			png->png_data = png_alloc(png->png_datalen);
+			result = png_end_idat(png);
+			if(result != PNG_NO_ERROR)
+				return result;
 		}
 
-		if(!png->png_data)
-			return PNG_MEMORY_ERROR;
+		if(file_read_ul(png, &length) != PNG_NO_ERROR || file_read(png, &type, 1, 4) != 4)
+			return PNG_FILE_ERROR;
 
-		if(!png->zs)
+		if(type == *(unsigned int*)"IDAT")
 		{
-			result = png_init_inflate(png);
-			if(result != PNG_NO_ERROR)
-				return result;
+			png->in_idat = 1;
+			png->idat_remaining = length;
+			png->idat_crc = crc32(0L, Z_NULL, 0);
+			png->idat_crc = crc32(png->idat_crc, (unsigned char*)"IDAT", 4);
+		}
+		else if(type == *(unsigned int*)"IEND")
+		{
+			return PNG_EOF_ERROR;	/* not enough image data */
+		}
+		else
+		{
+			file_read(png, 0, 1, length + 4); /* unknown chunk */
 		}
-
-		return png_read_idat(png, length);
 	}
-	else if(type == *(unsigned int*)"IEND")
+
+	result = png_read_idat_data(png, &data, &length);
+	if(result != PNG_NO_ERROR)
+		return result;
+
+	stream->next_in = data;
+	stream->avail_in = length;
+
+	return PNG_NO_ERROR;
+}
+
+/* skips whatever follows the last scanline, up to and including the IEND chunk type */
+static int png_read_to_end(png_t* png)
+{
+	int result;
+	unsigned type;
+	unsigned length;
+	unsigned char* data;
+
+	while(png->idat_remaining > 0)
 	{
-		return PNG_DONE;
+		result = png_read_idat_data(png, &data, &length);
+		if(result != PNG_NO_ERROR)
+			return result;
 	}
-	else
+
+	if(png->in_idat)
 	{
-		file_read(png, 0, 1, length + 4); /* unknown chunk */
+		result = png_end_idat(png);
+		if(result != PNG_NO_ERROR)
+			return result;
 	}
 
-	return result;
+	for(;;)
+	{
+		if(file_read_ul(png, &length) != PNG_NO_ERROR || file_read(png, &type, 1, 4) != 4)
+			return PNG_FILE_ERROR;
+
+		if(type == *(unsigned int*)"IEND")
+			return PNG_NO_ERROR;
+
+		file_read(png, 0, 1, length + 4);
+	}
 }
 
 static void png_filter_sub(int stride, unsigned char* in, unsigned char* out, int len)
@@ -700,137 +929,1044 @@ static void png_filter_paeth(int stride, unsigned char* in, unsigned char* out,
 	}
 }
 
-static int png_filter(png_t* png, unsigned char* data)
+/* the value filter type predicts for a byte from its left (a), upper (b) and upper left (c) neighbours */
+static unsigned char png_predict(int type, unsigned char a, unsigned char b, unsigned char c)
 {
-	(void) png;
-	(void) data;
-	return PNG_NO_ERROR;
+	switch(type)
+	{
+	case 1: /* sub */
+		return a;
+	case 2: /* up */
+		return b;
+	case 3: /* average */
+		return (unsigned char)(((unsigned)a + b) / 2);
+	case 4: /* paeth */
+		return png_paeth(a, b, c);
+	default: /* none */
+		return 0;
+	}
 }
 
-static int png_unfilter(png_t* png, unsigned char* data)
+#if USE_SSE2
+/* paeth predictor for eight 16-bit lanes */
+static __m128i png_paeth_epi16(__m128i a, __m128i b, __m128i c)
 {
-	unsigned i;
-	unsigned pos = 0;
-	unsigned outpos = 0;
-	unsigned char *filtered = png->png_data;
+	__m128i zero = _mm_setzero_si128();
+	__m128i pa = _mm_sub_epi16(b, c);	/* p - a */
+	__m128i pb = _mm_sub_epi16(a, c);	/* p - b */
+	__m128i pc = _mm_add_epi16(pa, pb);	/* p - c */
+	__m128i use_c, use_bc, bc;
 
-	int stride = png->bpp;
+	pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+	pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+	pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
 
-	while(pos < png->png_datalen)
-	{
-		unsigned char filter = filtered[pos];
+	use_c = _mm_cmpgt_epi16(pb, pc);
+	bc = _mm_or_si128(_mm_and_si128(use_c, c), _mm_andnot_si128(use_c, b));
+	use_bc = _mm_cmpgt_epi16(pa, _mm_min_epi16(pb, pc));
 
-		pos++;
+	return _mm_or_si128(_mm_and_si128(use_bc, bc), _mm_andnot_si128(use_bc, a));
+}
 
-		if(png->depth == 16)
-		{
-			for(i = 0; i < png->width * stride; i+=2)
-			{
-				*(short*)(filtered+pos+i) = (filtered[pos+i] << 8) | filtered[pos+i+1];
-			}
-		}
+static __m128i png_paeth_sse2(__m128i a, __m128i b, __m128i c)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i lo = png_paeth_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+	__m128i hi = png_paeth_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero));
 
-		switch(filter)
+	return _mm_packus_epi16(lo, hi);
+}
+
+/* filters 16 bytes at a time from position i on, returning where the scalar code has to continue */
+static unsigned png_filter_scanline_sse2(int type, int stride, const unsigned char* row, const unsigned char* prev,
+	unsigned char* out, unsigned i, unsigned len)
+{
+	for(; i + 16 <= len; i += 16)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i*)(row + i));
+		__m128i a = _mm_loadu_si128((const __m128i*)(row + i - stride));
+		__m128i b = _mm_loadu_si128((const __m128i*)(prev + i));
+		__m128i c = _mm_loadu_si128((const __m128i*)(prev + i - stride));
+		__m128i pred;
+
+		switch(type)
 		{
-		case 0: /* none */
-			memcpy(data+outpos, filtered+pos, png->width * stride);
+		case 1:
+			pred = a;
 			break;
-		case 1: /* sub */
-			png_filter_sub(stride, filtered+pos, data+outpos, png->width * stride);
-			break;
-		case 2: /* up */
-			if(outpos)
-				png_filter_up(stride, filtered+pos, data+outpos, data + outpos - (png->width*stride), png->width*stride);
-			else
-				png_filter_up(stride, filtered+pos, data+outpos, 0, png->width*stride);
-			break;
-		case 3: /* average */
-			if(outpos)
-				png_filter_average(stride, filtered+pos, data+outpos, data + outpos - (png->width*stride), png->width*stride);
-			else
-				png_filter_average(stride, filtered+pos, data+outpos, 0, png->width*stride);
+		case 2:
+			pred = b;
 			break;
-		case 4: /* paeth */
-			if(outpos)
-				png_filter_paeth(stride, filtered+pos, data+outpos, data + outpos - (png->width*stride), png->width*stride);
-			else
-				png_filter_paeth(stride, filtered+pos, data+outpos, 0, png->width*stride);
+		case 3: /* _mm_avg_epu8 rounds up, the average filter rounds down */
+			pred = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
 			break;
 		default:
-			return PNG_UNKNOWN_FILTER;
+			pred = png_paeth_sse2(a, b, c);
+			break;
 		}
 
-		outpos += png->width * stride;
-		pos += png->width * stride;
+		_mm_storeu_si128((__m128i*)(out + i), _mm_sub_epi8(x, pred));
 	}
 
-	return PNG_NO_ERROR;
+	return i;
 }
+#endif
 
-int png_get_data(png_t* png, unsigned char* data)
+/* applies filter type 1-4 to row, storing the filtered bytes in out. prev is the previous scanline (all zero for the first). */
+static void png_filter_scanline(int type, int stride, const unsigned char* row, const unsigned char* prev,
+	unsigned char* out, unsigned len)
 {
-	int result = PNG_NO_ERROR;
+	unsigned i;
 
-	png->zs = NULL;
-	png->png_datalen = 0;
-	png->png_data = NULL;
-	png->readbuf = NULL;
-	png->readbuflen = 0;
+	/* the first pixel has no left neighbour */
+	for(i = 0; i < (unsigned)stride && i < len; i++)
+		out[i] = row[i] - png_predict(type, 0, prev[i], 0);
 
-	while(result == PNG_NO_ERROR)
-	{
-		result = png_process_chunk(png);
-	}
+#if USE_SSE2
+	i = png_filter_scanline_sse2(type, stride, row, prev, out, i, len);
+#endif
 
-	if (png->readbuf)
-	{
-		png_free(png->readbuf);
-		png->readbuflen = 0;
-	}
-	if (png->zs)
-	{
-		png_end_inflate(png);
-	}
+	for(; i < len; i++)
+		out[i] = row[i] - png_predict(type, row[i - stride], prev[i], prev[i - stride]);
+}
+
+/* sum of the filtered bytes taken as signed magnitudes, the usual estimate of how well a filtered scanline compresses */
+static unsigned long png_filter_cost(const unsigned char* data, unsigned len)
+{
+	unsigned long cost = 0;
+	unsigned i = 0;
+
+#if USE_SSE2
+	__m128i zero = _mm_setzero_si128();
+	__m128i sum = zero;
 
-	if(result != PNG_DONE)
+	for(; i + 16 <= len; i += 16)
 	{
-		png_free(png->png_data);
-		return result;
+		__m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+		v = _mm_min_epu8(v, _mm_sub_epi8(zero, v));
+		sum = _mm_add_epi64(sum, _mm_sad_epu8(v, zero));
 	}
 
-	result = png_unfilter(png, data);
+	cost = (unsigned long)_mm_cvtsi128_si32(sum) + (unsigned long)_mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+#endif
 
-	png_free(png->png_data);
+	for(; i < len; i++)
+		cost += data[i] < 128 ? data[i] : 256 - data[i];
 
-	return result;
+	return cost;
 }
 
-int png_set_data(png_t* png, unsigned width, unsigned height, char depth, int color, unsigned char* data)
+/* filters the scanline in cur_row (after its filter type byte), choosing the filter type by png->filter_mode.
+   Returns the scanline to deflate, filter type byte first: cur_row itself if it is best left unfiltered, otherwise png_data. */
+static unsigned char* png_filter_row(png_t* png)
 {
-	//int i;
-	unsigned i;
-	unsigned char *filtered;
-	png->width = width;
-	png->height = height;
-	png->depth = depth;
-	png->color_type = color;
-	png->bpp = png_get_bpp(png);
+	unsigned len = png->png_datalen - 1;
+	unsigned char *row = png->cur_row + 1;
+	int last_type, type, best_type = 0;
+	unsigned long cost, best_cost;
+
+	png->cur_row[0] = 0;
 
-	filtered = png_alloc(width * height * png->bpp + height);
+	if(png->filter_mode == PNG_FILTER_MODE_NONE)
+		return png->cur_row;
 
-	for(i = 0; i < png->height; i++)
+	last_type = png->filter_mode == PNG_FILTER_MODE_FAST ? 2 : 4;
+	best_cost = png_filter_cost(row, len);
+
+	for(type = 1; type <= last_type; type++)
 	{
-		filtered[i*png->width*png->bpp+i] = 0;
-		memcpy(&filtered[i*png->width*png->bpp+i+1], data + i * png->width*png->bpp, png->width*png->bpp);
+		png_filter_scanline(type, png->bpp, row, png->prev_row + 1, png->filter_buf + 1, len);
+		cost = png_filter_cost(png->filter_buf + 1, len);
+
+		if(cost < best_cost)
+		{
+			/* keep the best scanline so far in png_data */
+			unsigned char *tmp = png->png_data;
+			png->png_data = png->filter_buf;
+			png->filter_buf = tmp;
+			best_cost = cost;
+			best_type = type;
+		}
 	}
 
-	png_filter(png, filtered);
-	png_write_ihdr(png);
-	png_write_idats(png, filtered);
+	if(best_type == 0)
+		return png->cur_row;
 
-	png_free(filtered);
+	png->png_data[0] = (unsigned char)best_type;
 
-	return PNG_NO_ERROR;
+	return png->png_data;
+}
+
+#if USE_SSE2
+/*
+	Vectorized unfiltering. Up is done 16 bytes at a time. Sub, average and paeth depend on the pixel to the left,
+	so they work one pixel at a time, with each pixel's bytes in parallel; they are specialized for the 3 and 4 byte
+	pixels of 8 bit truecolor images. prev_line must not be 0 (the first scanline is unfiltered against zeros).
+*/
+
+static void png_unfilter_up_sse2(unsigned char* in, unsigned char* out, unsigned char* prev_line, int len)
+{
+	int i;
+
+	for(i = 0; i + 16 <= len; i += 16)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i*)(in + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(prev_line + i));
+		_mm_storeu_si128((__m128i*)(out + i), _mm_add_epi8(x, b));
+	}
+
+	for(; i < len; i++)
+		out[i] = in[i] + prev_line[i];
+}
+
+static inline __m128i png_load_pixel(const unsigned char* p, int bpp)
+{
+	int v = 0;
+	memcpy(&v, p, bpp);
+	return _mm_cvtsi32_si128(v);
+}
+
+static inline void png_store_pixel(unsigned char* p, __m128i v, int bpp)
+{
+	int x = _mm_cvtsi128_si32(v);
+	memcpy(p, &x, bpp);
+}
+
+static inline __m128i png_abs_epi16_sse2(__m128i x)
+{
+	return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+#define PNG_DEFINE_UNFILTER_SUB_AVG(BPP) \
+static void png_unfilter_sub##BPP##_sse2(unsigned char* in, unsigned char* out, int len) \
+{ \
+	__m128i a = _mm_setzero_si128(); \
+	int i; \
+	for(i = 0; i < len; i += BPP) \
+	{ \
+		a = _mm_add_epi8(a, png_load_pixel(in + i, BPP)); \
+		png_store_pixel(out + i, a, BPP); \
+	} \
+} \
+\
+static void png_unfilter_average##BPP##_sse2(unsigned char* in, unsigned char* out, unsigned char* prev_line, int len) \
+{ \
+	__m128i a = _mm_setzero_si128(); \
+	__m128i one = _mm_set1_epi8(1); \
+	int i; \
+	for(i = 0; i < len; i += BPP) \
+	{ \
+		__m128i b = png_load_pixel(prev_line + i, BPP); \
+		/* _mm_avg_epu8 rounds up, the average filter rounds down */ \
+		__m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one)); \
+		a = _mm_add_epi8(avg, png_load_pixel(in + i, BPP)); \
+		png_store_pixel(out + i, a, BPP); \
+	} \
+}
+
+/* paeth with the pixel's bytes widened to 16 bits; pa, pb and pc as in png_paeth */
+#define PNG_DEFINE_UNFILTER_PAETH(ISA, BPP, ABS16, ATTR) \
+ATTR static void png_unfilter_paeth##BPP##_##ISA(unsigned char* in, unsigned char* out, unsigned char* prev_line, int len) \
+{ \
+	__m128i zero = _mm_setzero_si128(); \
+	__m128i a = zero, c = zero; \
+	int i; \
+	for(i = 0; i < len; i += BPP) \
+	{ \
+		__m128i b = _mm_unpacklo_epi8(png_load_pixel(prev_line + i, BPP), zero); \
+		__m128i pa = _mm_sub_epi16(b, c); \
+		__m128i pb = _mm_sub_epi16(a, c); \
+		__m128i pc = _mm_add_epi16(pa, pb); \
+		__m128i smallest, use_a, use_b, nearest; \
+		pa = ABS16(pa); \
+		pb = ABS16(pb); \
+		pc = ABS16(pc); \
+		smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb)); \
+		use_a = _mm_cmpeq_epi16(smallest, pa); \
+		use_b = _mm_andnot_si128(use_a, _mm_cmpeq_epi16(smallest, pb)); \
+		nearest = _mm_or_si128(_mm_and_si128(use_b, b), _mm_andnot_si128(use_b, c)); \
+		nearest = _mm_or_si128(_mm_and_si128(use_a, a), _mm_andnot_si128(use_a, nearest)); \
+		nearest = _mm_add_epi8(_mm_packus_epi16(nearest, nearest), png_load_pixel(in + i, BPP)); \
+		png_store_pixel(out + i, nearest, BPP); \
+		a = _mm_unpacklo_epi8(nearest, zero); \
+		c = b; \
+	} \
+}
+
+PNG_DEFINE_UNFILTER_SUB_AVG(3)
+PNG_DEFINE_UNFILTER_SUB_AVG(4)
+PNG_DEFINE_UNFILTER_PAETH(sse2, 3, png_abs_epi16_sse2, )
+PNG_DEFINE_UNFILTER_PAETH(sse2, 4, png_abs_epi16_sse2, )
+PNG_DEFINE_UNFILTER_PAETH(ssse3, 3, _mm_abs_epi16, __attribute__((target("ssse3"))))
+PNG_DEFINE_UNFILTER_PAETH(ssse3, 4, _mm_abs_epi16, __attribute__((target("ssse3"))))
+
+/* unfilters with the vector kernels if there are some for this filter and pixel size, returning 0 if not */
+static int png_unfilter_simd(int simd, int filter, int stride, unsigned char* in, unsigned char* out, unsigned char* prev_line, int len)
+{
+	if(simd == PNG_SIMD_NONE || !prev_line)
+		return 0;
+
+	if(filter == 2)
+	{
+		png_unfilter_up_sse2(in, out, prev_line, len);
+		return 1;
+	}
+
+	if(stride == 3)
+	{
+		switch(filter)
+		{
+		case 1: png_unfilter_sub3_sse2(in, out, len); return 1;
+		case 3: png_unfilter_average3_sse2(in, out, prev_line, len); return 1;
+		case 4:
+			if(simd == PNG_SIMD_SSSE3)
+				png_unfilter_paeth3_ssse3(in, out, prev_line, len);
+			else
+				png_unfilter_paeth3_sse2(in, out, prev_line, len);
+			return 1;
+		}
+	}
+	else if(stride == 4)
+	{
+		switch(filter)
+		{
+		case 1: png_unfilter_sub4_sse2(in, out, len); return 1;
+		case 3: png_unfilter_average4_sse2(in, out, prev_line, len); return 1;
+		case 4:
+			if(simd == PNG_SIMD_SSSE3)
+				png_unfilter_paeth4_ssse3(in, out, prev_line, len);
+			else
+				png_unfilter_paeth4_sse2(in, out, prev_line, len);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+#endif
+
+/* unfilters the scanline in png_data (filter type byte first) into out; prev_line is 0 for the first scanline */
+static int png_unfilter_row(png_t* png, unsigned char* out, unsigned char* prev_line)
+{
+	unsigned i;
+	unsigned char *filtered = png->png_data + 1;
+	int stride = png->bpp;
+	int len = png->width * stride;
+
+	if(png->depth == 16)
+	{
+		for(i = 0; i < png->width * stride; i+=2)
+		{
+			*(short*)(filtered+i) = (filtered[i] << 8) | filtered[i+1];
+		}
+	}
+
+#if USE_SSE2
+	if(png->png_data[0] != 0 && png_unfilter_simd(png->simd, png->png_data[0], stride, filtered, out, prev_line, len))
+		return PNG_NO_ERROR;
+#endif
+
+	/* the scalar code handles every case, and is the reference for the vector kernels */
+	switch(png->png_data[0])
+	{
+	case 0: /* none */
+		memcpy(out, filtered, len);
+		break;
+	case 1: /* sub */
+		png_filter_sub(stride, filtered, out, len);
+		break;
+	case 2: /* up */
+		png_filter_up(stride, filtered, out, prev_line, len);
+		break;
+	case 3: /* average */
+		png_filter_average(stride, filtered, out, prev_line, len);
+		break;
+	case 4: /* paeth */
+		png_filter_paeth(stride, filtered, out, prev_line, len);
+		break;
+	default:
+		return PNG_UNKNOWN_FILTER;
+	}
+
+	return PNG_NO_ERROR;
+}
+
+#define PNG_READBUF_SIZE 65536
+
+static int png_read_start(png_t* png)
+{
+	unsigned rowlen = png->width * png->bpp;
+
+	png->png_datalen = rowlen + 1;
+	png->png_data = png_alloc(png->png_datalen);
+	png->prev_row = png_alloc(rowlen ? rowlen : 1);
+	png->cur_row = png_alloc(rowlen ? rowlen : 1);
+	/* a mapped file is inflated in place */
+	if(!png->map)
+	{
+		png->readbuflen = PNG_READBUF_SIZE;
+		png->readbuf = png_alloc(png->readbuflen);
+	}
+
+	if(!png->png_data || !png->prev_row || !png->cur_row || (!png->map && !png->readbuf))
+		return PNG_MEMORY_ERROR;
+
+	/* the first scanline is unfiltered against a scanline of zeros */
+	memset(png->prev_row, 0, rowlen ? rowlen : 1);
+
+	return png_init_inflate(png);
+}
+
+int png_read_end(png_t* png)
+{
+	if(png->zs)
+		png_end_inflate(png);
+
+	if(png->png_data)
+		png_free(png->png_data);
+	if(png->prev_row)
+		png_free(png->prev_row);
+	if(png->cur_row)
+		png_free(png->cur_row);
+	if(png->readbuf)
+		png_free(png->readbuf);
+
+	png->zs = 0;
+	png->png_data = 0;
+	png->png_datalen = 0;
+	png->prev_row = 0;
+	png->cur_row = 0;
+	png->readbuf = 0;
+	png->readbuflen = 0;
+
+	return PNG_NO_ERROR;
+}
+
+int png_read_rows(png_t* png, unsigned char* data, unsigned max_rows, unsigned* rows_read)
+{
+	return png_read_rows_convert(png, data, max_rows, (size_t)png->width * png->bpp, 0, rows_read);
+}
+
+int png_read_rows_convert(png_t* png, unsigned char* data, unsigned max_rows, size_t stride, png_convert_row_t convert,
+	unsigned* rows_read)
+{
+	int result = PNG_NO_ERROR;
+	size_t rowlen = (size_t)png->width * png->bpp;
+	unsigned char *prev_line;
+	unsigned n;
+#if USE_ZLIB
+	z_stream *stream;
+#else
+	zl_stream *stream;
+#endif
+
+	*rows_read = 0;
+
+	if(png->next_row >= png->height)
+		return PNG_DONE;
+
+	if(!png->zs)
+	{
+		result = png_read_start(png);
+		if(result != PNG_NO_ERROR)
+		{
+			png_read_end(png);
+			return result;
+		}
+	}
+
+	stream = png->zs;
+	prev_line = png->prev_row;
+
+	for(n = 0; n < max_rows && png->next_row < png->height; n++)
+	{
+		unsigned char *out = data + n * stride;
+
+		stream->next_out = png->png_data;
+		stream->avail_out = png->png_datalen;
+
+		result = png_inflate(png);
+		if(result == PNG_NO_ERROR)
+			result = png_unfilter_row(png, convert ? png->cur_row : out, prev_line);
+
+		if(result != PNG_NO_ERROR)
+		{
+			png_read_end(png);
+			return result;
+		}
+
+		if(convert)
+		{
+			/* the unfiltered scanline is kept for unfiltering the next one */
+			convert(png->cur_row, out, png->width);
+			prev_line = png->cur_row;
+			png->cur_row = png->prev_row;
+			png->prev_row = prev_line;
+		}
+		else
+			prev_line = out;
+
+		png->next_row++;
+	}
+
+	*rows_read = n;
+
+	if(png->next_row < png->height)
+	{
+		/* keep the last scanline for unfiltering the next call's first one */
+		if(n > 0 && prev_line != png->prev_row)
+			memcpy(png->prev_row, prev_line, rowlen);
+		return PNG_NO_ERROR;
+	}
+
+	result = png_read_to_end(png);
+	png_read_end(png);
+
+	return result == PNG_NO_ERROR ? PNG_DONE : result;
+}
+
+int png_get_data(png_t* png, unsigned char* data)
+{
+	int result;
+	unsigned rows;
+
+	do
+	{
+		result = png_read_rows(png, data, png->height, &rows);
+		data += (size_t)rows * png->width * png->bpp;
+	} while(result == PNG_NO_ERROR);
+
+	return result == PNG_DONE ? PNG_NO_ERROR : result;
+}
+
+static void png_write_release(png_t* png)
+{
+	if(png->zs)
+		png_end_deflate(png);
+
+	if(png->png_data)
+		png_free(png->png_data);
+	if(png->filter_buf)
+		png_free(png->filter_buf);
+	if(png->prev_row)
+		png_free(png->prev_row);
+	if(png->cur_row)
+		png_free(png->cur_row);
+	if(png->idat_buf)
+		png_free(png->idat_buf);
+
+	png->png_data = 0;
+	png->png_datalen = 0;
+	png->filter_buf = 0;
+	png->prev_row = 0;
+	png->cur_row = 0;
+	png->idat_buf = 0;
+	png->writing = 0;
+}
+
+int png_check_filter_mode(int mode)
+{
+	if(mode != PNG_FILTER_MODE_NONE && mode != PNG_FILTER_MODE_FAST && mode != PNG_FILTER_MODE_ADAPTIVE)
+		return PNG_WRONG_ARGUMENTS;
+
+	return PNG_NO_ERROR;
+}
+
+int png_set_filter_mode(png_t* png, int mode)
+{
+	int result = png_check_filter_mode(mode);
+
+	if(result != PNG_NO_ERROR)
+		return result;
+
+	png->filter_mode = (unsigned char)mode;
+
+	return PNG_NO_ERROR;
+}
+
+int png_check_compression(int level, int strategy, int mem_level, int window_bits)
+{
+	if(level < -1 || level > 9 || mem_level < 1 || mem_level > 9 || window_bits < 9 || window_bits > 15)
+		return PNG_WRONG_ARGUMENTS;
+
+	if(strategy != PNG_STRATEGY_DEFAULT && strategy != PNG_STRATEGY_FILTERED &&
+	   strategy != PNG_STRATEGY_HUFFMAN_ONLY && strategy != PNG_STRATEGY_RLE)
+		return PNG_WRONG_ARGUMENTS;
+
+	return PNG_NO_ERROR;
+}
+
+int png_set_compression(png_t* png, int level, int strategy, int mem_level, int window_bits)
+{
+	int result = png_check_compression(level, strategy, mem_level, window_bits);
+
+	if(result != PNG_NO_ERROR)
+		return result;
+
+	switch(strategy)
+	{
+	case PNG_STRATEGY_DEFAULT:
+		png->strategy = Z_DEFAULT_STRATEGY; break;
+	case PNG_STRATEGY_FILTERED:
+		png->strategy = Z_FILTERED; break;
+	case PNG_STRATEGY_HUFFMAN_ONLY:
+		png->strategy = Z_HUFFMAN_ONLY; break;
+	case PNG_STRATEGY_RLE:
+		png->strategy = Z_RLE; break;
+	}
+
+	png->level = (signed char)level;
+	png->mem_level = (unsigned char)mem_level;
+	png->window_bits = (unsigned char)window_bits;
+
+	return PNG_NO_ERROR;
+}
+
+int png_write_begin(png_t* png, unsigned width, unsigned height, char depth, int color)
+{
+	int result;
+
+	png->width = width;
+	png->height = height;
+	png->depth = depth;
+	png->color_type = color;
+	png->bpp = png_get_bpp(png);
+	png->next_row = 0;
+
+	png->writing = 1;
+	png->png_datalen = width * png->bpp + 1;
+	png->png_data = png_alloc(png->png_datalen);
+	png->filter_buf = png_alloc(png->png_datalen);
+	png->prev_row = png_alloc(png->png_datalen);
+	png->cur_row = png_alloc(png->png_datalen);
+	png->idat_buf = png_alloc(PNG_IDAT_SIZE + 4);
+
+	if(!png->png_data || !png->filter_buf || !png->prev_row || !png->cur_row || !png->idat_buf)
+	{
+		png_write_release(png);
+		return PNG_MEMORY_ERROR;
+	}
+
+	/* the scanline before the first one is taken to be all zero */
+	memset(png->prev_row, 0, png->png_datalen);
+
+	memcpy(png->idat_buf, "IDAT", 4);
+
+	result = png_init_deflate(png);
+	if(result == PNG_NO_ERROR)
+		result = png_write_ihdr(png);
+
+	if(result != PNG_NO_ERROR)
+		png_write_release(png);
+
+	return result;
+}
+
+int png_write_rows(png_t* png, unsigned char* data, unsigned num_rows)
+{
+	return png_write_rows_convert(png, data, num_rows, (size_t)png->width * png->bpp, 0);
+}
+
+int png_write_rows_convert(png_t* png, const unsigned char* data, unsigned num_rows, size_t stride, png_convert_row_t convert)
+{
+	int result = PNG_NO_ERROR;
+	size_t rowlen = png->png_datalen - 1;
+	unsigned i;
+
+	if(!png->writing || num_rows > png->height - png->next_row)
+		return PNG_WRONG_ARGUMENTS;
+
+	for(i = 0; i < num_rows && result == PNG_NO_ERROR; i++)
+	{
+		const unsigned char *row = data + i * stride;
+		unsigned char *tmp;
+
+		/* the scanline is converted straight into the buffer it is filtered (or deflated) from */
+		if(convert)
+			convert(row, png->cur_row + 1, png->width);
+		else
+			memcpy(png->cur_row + 1, row, rowlen);
+
+		result = png_deflate(png, png_filter_row(png), png->png_datalen, Z_NO_FLUSH);
+
+		/* deflate has consumed the scanline, so its buffer can hold the next one */
+		tmp = png->prev_row;
+		png->prev_row = png->cur_row;
+		png->cur_row = tmp;
+	}
+
+	png->next_row += i;
+
+	if(result != PNG_NO_ERROR)
+		png_write_release(png);
+
+	return result;
+}
+
+int png_write_end(png_t* png)
+{
+	int result;
+
+	if(!png->writing)
+		return PNG_WRONG_ARGUMENTS;
+
+	if(png->next_row != png->height)
+	{
+		png_write_release(png);
+		return PNG_WRONG_ARGUMENTS;
+	}
+
+	result = png_deflate(png, 0, 0, Z_FINISH);
+
+	if(result == PNG_NO_ERROR)
+	{
+		z_stream *stream = png->zs;
+		unsigned len = PNG_IDAT_SIZE - stream->avail_out;
+
+		if(len > 0)
+			result = png_write_idat(png, len);
+	}
+
+	if(result == PNG_NO_ERROR)
+		result = png_write_iend(png);
+
+	png_write_release(png);
+
+	return result;
+}
+
+/*
+	Parallel encoding. The scanlines are split into bands which are filtered and deflated independently, each into a
+	raw deflate stream of its own, pigz style. Every band but the last ends with a sync flush, so the streams end on a
+	byte boundary and can simply be concatenated, and each band's compressor is primed with the last window of
+	filtered data before it (recomputed by the band itself, since filtering is deterministic), so compression
+	barely suffers at the boundaries. Each band becomes one IDAT chunk, its CRC computed by the band; the zlib header
+	goes in front of the first and the combined adler32 after the last.
+*/
+
+/* bands are kept small enough for their IDAT chunks to stay far below the 2^31 byte chunk size limit */
+#define PNG_MAX_BAND_BYTES (1u << 30)
+
+/* initial size of a band's output buffer, which grows as needed (and starts at an eighth of the band's raw
+   data if that is more) */
+#define PNG_BAND_MIN_CAP 65536
+
+typedef struct
+{
+	unsigned char*			out;			/* "IDAT", then the band's deflate data */
+	size_t				len;
+	size_t				cap;
+	unsigned long			adler;			/* adler32 of the band's filtered scanlines */
+	size_t				raw_len;		/* length of the band's filtered scanlines */
+	unsigned long			crc;			/* crc of out[0..len) */
+	int				result;
+} png_band_t;
+
+typedef struct
+{
+	const png_t*			png;
+	const unsigned char*		data;
+	size_t				stride;
+	png_convert_row_t		convert;
+	unsigned			num_bands;
+	png_band_t*			bands;
+} png_band_job_t;
+
+/* the two byte zlib header matching the deflate settings */
+static void png_zlib_header(const png_t* png, unsigned char* out)
+{
+	unsigned cmf = 0x08 | ((png->window_bits - 8) << 4);
+	unsigned flevel;
+
+	if(png->level == 0 || png->level == 1)
+		flevel = 0;
+	else if(png->level >= 2 && png->level <= 5)
+		flevel = 1;
+	else if(png->level == 6 || png->level == Z_DEFAULT_COMPRESSION)
+		flevel = 2;
+	else
+		flevel = 3;
+
+	out[0] = (unsigned char)cmf;
+	out[1] = (unsigned char)(flevel << 6);
+	out[1] += (31 - (cmf * 256 + out[1]) % 31) % 31;
+}
+
+/* converts row y of the image into the scanline buffer cur_row */
+static void png_band_load_row(png_t* png, const png_band_job_t* job, unsigned y)
+{
+	const unsigned char* row = job->data + y * job->stride;
+
+	if(job->convert)
+		job->convert(row, png->cur_row + 1, png->width);
+	else
+		memcpy(png->cur_row + 1, row, png->png_datalen - 1);
+}
+
+static void png_band_swap_rows(png_t* png)
+{
+	unsigned char *tmp = png->prev_row;
+	png->prev_row = png->cur_row;
+	png->cur_row = tmp;
+}
+
+/* makes room for at least n more bytes in band->out */
+static int png_band_reserve(png_band_t* band, size_t n)
+{
+	unsigned char* bigger;
+
+	if(band->cap - band->len >= n)
+		return PNG_NO_ERROR;
+
+	bigger = png_alloc(band->cap * 2 + n);
+	if(!bigger)
+		return PNG_MEMORY_ERROR;
+
+	memcpy(bigger, band->out, band->len);
+	png_free(band->out);
+	band->out = bigger;
+	band->cap = band->cap * 2 + n;
+
+	return PNG_NO_ERROR;
+}
+
+/* deflates with the given flush mode into band->out, growing it whenever it fills up */
+static int png_band_deflate(z_stream* stream, png_band_t* band, unsigned char* data, unsigned len, int flush)
+{
+	int result;
+
+	stream->next_in = data;
+	stream->avail_in = len;
+
+	for(;;)
+	{
+		stream->next_out = band->out + band->len;
+		stream->avail_out = (uInt)(band->cap - band->len);
+		result = deflate(stream, flush);
+		band->len = band->cap - stream->avail_out;
+
+		if(result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR)
+			return PNG_ZLIB_ERROR;
+
+		if(stream->avail_out > 0 && stream->avail_in == 0 && (flush != Z_FINISH || result == Z_STREAM_END))
+			return PNG_NO_ERROR;
+
+		if(stream->avail_out == 0 && png_band_reserve(band, 1) != PNG_NO_ERROR)
+			return PNG_MEMORY_ERROR;
+	}
+}
+
+static int png_deflate_band(const png_band_job_t* job, unsigned b)
+{
+	png_band_t* band = &job->bands[b];
+	png_t png = *job->png;
+	unsigned first = (unsigned)((unsigned long long)png.height * b / job->num_bands);
+	unsigned last = (unsigned)((unsigned long long)png.height * (b + 1) / job->num_bands);
+	unsigned window = 1u << png.window_bits;
+	unsigned dict_rows = (window + png.png_datalen - 1) / png.png_datalen;
+	unsigned char* dict = 0;
+	z_stream stream;
+	int result = PNG_NO_ERROR;
+	unsigned y;
+
+	if(dict_rows > first)
+		dict_rows = first;
+
+	/* the scanline buffers are the band's own, the settings are png's */
+	png.png_data = png_alloc(png.png_datalen);
+	png.filter_buf = png_alloc(png.png_datalen);
+	png.prev_row = png_alloc(png.png_datalen);
+	png.cur_row = png_alloc(png.png_datalen);
+	band->raw_len = (size_t)(last - first) * png.png_datalen;
+	/* start small and let png_band_deflate grow the buffer: reserving deflateBound for every band would hold
+	   about as much memory as the raw image */
+	band->cap = band->raw_len / 8;
+	if(band->cap < PNG_BAND_MIN_CAP)
+		band->cap = PNG_BAND_MIN_CAP;
+	if(band->cap > 4 + 2 + 4 + deflateBound(0, (uLong)band->raw_len))
+		band->cap = 4 + 2 + 4 + deflateBound(0, (uLong)band->raw_len);
+	band->out = png_alloc(band->cap);
+	if(dict_rows > 0)
+		dict = png_alloc((size_t)dict_rows * png.png_datalen);
+
+	memset(&stream, 0, sizeof(stream));
+	stream.zalloc = png_zalloc;
+	stream.zfree = png_zfree;
+
+	if(!png.png_data || !png.filter_buf || !png.prev_row || !png.cur_row || !band->out || (dict_rows > 0 && !dict))
+		result = PNG_MEMORY_ERROR;
+	else if(deflateInit2(&stream, png.level, Z_DEFLATED, -(int)png.window_bits, png.mem_level, png.strategy) != Z_OK)
+		result = PNG_ZLIB_ERROR;
+
+	if(result == PNG_NO_ERROR)
+	{
+		memcpy(band->out, "IDAT", 4);
+		band->len = 4;
+		if(b == 0)
+		{
+			png_zlib_header(&png, band->out + 4);
+			band->len += 2;
+		}
+
+		/* filter the scanlines just before the band again, giving the row before the band and the dictionary */
+		if(first - dict_rows > 0)
+			png_band_load_row(&png, job, first - dict_rows - 1);
+		else
+			memset(png.cur_row, 0, png.png_datalen);
+		png_band_swap_rows(&png);
+
+		for(y = first - dict_rows; y < first; y++)
+		{
+			png_band_load_row(&png, job, y);
+			memcpy(dict + (size_t)(y - (first - dict_rows)) * png.png_datalen, png_filter_row(&png), png.png_datalen);
+			png_band_swap_rows(&png);
+		}
+
+		if(dict_rows > 0)
+		{
+			size_t dict_len = (size_t)dict_rows * png.png_datalen;
+			size_t used = dict_len < window ? dict_len : window;
+			if(deflateSetDictionary(&stream, dict + dict_len - used, (uInt)used) != Z_OK)
+				result = PNG_ZLIB_ERROR;
+		}
+	}
+
+	band->adler = adler32(0L, Z_NULL, 0);
+
+	for(y = first; y < last && result == PNG_NO_ERROR; y++)
+	{
+		unsigned char* filtered;
+
+		png_band_load_row(&png, job, y);
+		filtered = png_filter_row(&png);
+		band->adler = adler32(band->adler, filtered, png.png_datalen);
+		result = png_band_deflate(&stream, band, filtered, png.png_datalen, Z_NO_FLUSH);
+		png_band_swap_rows(&png);
+	}
+
+	if(result == PNG_NO_ERROR)
+		result = png_band_deflate(&stream, band, 0, 0, b + 1 == job->num_bands ? Z_FINISH : Z_SYNC_FLUSH);
+
+	if(result == PNG_NO_ERROR)
+		band->crc = crc32(crc32(0L, Z_NULL, 0), band->out, (uInt)band->len);
+
+	deflateEnd(&stream);
+	png_free(png.png_data);
+	png_free(png.filter_buf);
+	png_free(png.prev_row);
+	png_free(png.cur_row);
+	if(dict)
+		png_free(dict);
+
+	return result;
+}
+
+static void png_deflate_band_task(void* arg, int task)
+{
+	png_band_job_t* job = arg;
+
+	job->bands[task].result = png_deflate_band(job, (unsigned)task);
+}
+
+int png_write_rows_parallel(png_t* png, const unsigned char* data, size_t stride, png_convert_row_t convert,
+	unsigned num_bands, png_run_tasks_t run, void* runner)
+{
+	png_band_job_t job;
+	png_band_t* bands;
+	unsigned long adler;
+	unsigned char trailer[4];
+	size_t raw_len = (size_t)png->height * png->png_datalen;
+	int result = PNG_NO_ERROR;
+	unsigned b;
+
+	if(!png->writing || png->next_row != 0)
+		return PNG_WRONG_ARGUMENTS;
+
+	if(num_bands < raw_len / PNG_MAX_BAND_BYTES + 1)
+		num_bands = (unsigned)(raw_len / PNG_MAX_BAND_BYTES + 1);
+	if(num_bands > png->height)
+		num_bands = png->height;
+	if(num_bands < 1)
+		num_bands = 1;
+
+	bands = png_alloc(num_bands * sizeof(png_band_t));
+	if(!bands)
+	{
+		png_write_release(png);
+		return PNG_MEMORY_ERROR;
+	}
+	memset(bands, 0, num_bands * sizeof(png_band_t));
+
+	job.png = png;
+	job.data = data;
+	job.stride = stride;
+	job.convert = convert;
+	job.num_bands = num_bands;
+	job.bands = bands;
+
+	run(runner, (int)num_bands, png_deflate_band_task, &job);
+
+	adler = bands[0].adler;
+	for(b = 0; b < num_bands; b++)
+	{
+		if(bands[b].result != PNG_NO_ERROR)
+			result = bands[b].result;
+		else if(b > 0)
+			adler = adler32_combine(adler, bands[b].adler, (z_off_t)bands[b].raw_len);
+	}
+
+	if(result == PNG_NO_ERROR)
+	{
+		png_band_t* lastband = &bands[num_bands - 1];
+
+		/* the adler32 trailer ends the zlib stream in the last IDAT */
+		set_ul(trailer, (unsigned)adler);
+		result = png_band_reserve(lastband, 4);
+		if(result == PNG_NO_ERROR)
+		{
+			memcpy(lastband->out + lastband->len, trailer, 4);
+			lastband->len += 4;
+			lastband->crc = crc32(lastband->crc, trailer, 4);
+		}
+
+		for(b = 0; b < num_bands && result == PNG_NO_ERROR; b++)
+		{
+			unsigned len = (unsigned)bands[b].len;
+
+			if(file_write_ul(png, len - 4) != PNG_NO_ERROR ||
+			   file_write(png, bands[b].out, 1, len) != len ||
+			   file_write_ul(png, (unsigned)bands[b].crc) != PNG_NO_ERROR)
+				result = PNG_IO_ERROR;
+		}
+	}
+
+	if(result == PNG_NO_ERROR)
+		result = png_write_iend(png);
+
+	for(b = 0; b < num_bands; b++)
+		if(bands[b].out)
+			png_free(bands[b].out);
+	png_free(bands);
+
+	png->next_row = png->height;
+	png_write_release(png);
+
+	return result;
+}
+
+int png_set_data(png_t* png, unsigned width, unsigned height, char depth, int color, unsigned char* data)
+{
+	int result;
+
+	result = png_write_begin(png, width, height, depth, color);
+
+	if(result == PNG_NO_ERROR)
+		result = png_write_rows(png, data, height);
+
+	if(result == PNG_NO_ERROR)
+		result = png_write_end(png);
+
+	return result;
 }
 
 char* png_error_string(int error)
@@ -27,6 +27,10 @@
 /*
  * This file was modified 22-Mar-2020 by David Hovemeyer
  * to eliminate compiler warnings.
+ *
+ * Modified to decode and encode scanlines incrementally (png_read_rows,
+ * png_write_rows), so that decoding and encoding need memory
+ * proportional to the image width only.
  */
 
 
@@ -73,6 +77,29 @@ enum
 	PNG_TRUECOLOR_ALPHA		= 6
 };
 
+/*
+	How the filter type of each scanline is chosen when writing.
+*/
+
+enum
+{
+	PNG_FILTER_MODE_NONE		= 0,	/* no filtering (filter type 0) */
+	PNG_FILTER_MODE_FAST		= 1,	/* best of none, sub and up */
+	PNG_FILTER_MODE_ADAPTIVE	= 2	/* best of all five filter types */
+};
+
+/*
+	Deflate strategies for writing (the same values as zlib's).
+*/
+
+enum
+{
+	PNG_STRATEGY_DEFAULT		= 0,
+	PNG_STRATEGY_FILTERED		= 1,
+	PNG_STRATEGY_HUFFMAN_ONLY	= 2,
+	PNG_STRATEGY_RLE		= 3
+};
+
 /*
 	Typedefs for callbacks.
 */
@@ -81,6 +108,9 @@ typedef unsigned (*png_write_callback_t)(void* input, size_t size, size_t numel,
 typedef unsigned (*png_read_callback_t)(void* output, size_t size, size_t numel, void* user_pointer);
 typedef void (*png_free_t)(void* p);
 typedef void * (*png_alloc_t)(size_t s);
+typedef void (*png_convert_row_t)(const unsigned char* in, unsigned char* out, unsigned width);
+typedef void (*png_task_t)(void* arg, int task);
+typedef void (*png_run_tasks_t)(void* runner, int num_tasks, png_task_t task, void* arg);
 
 typedef struct
 {
@@ -103,6 +133,27 @@ typedef struct
 
 	unsigned char*			readbuf;
 	unsigned			readbuflen;
+
+	const unsigned char*		map;			/* file mapped by png_open_file_mmap, or 0 */
+	size_t				map_size;
+	size_t				map_pos;		/* offset of the next byte to read from map */
+
+	unsigned char*			prev_row;		/* last unfiltered scanline (after a filter type byte when writing) */
+	unsigned			next_row;		/* index of the next scanline to decode */
+	unsigned			idat_remaining;		/* bytes of the current IDAT not read yet */
+	unsigned			idat_crc;		/* crc of the current IDAT so far */
+	unsigned char			in_idat;
+
+	unsigned char*			idat_buf;		/* IDAT chunk being written */
+	unsigned char*			filter_buf;		/* candidate filtered scanline */
+	unsigned char*			cur_row;		/* scanline being converted (after a filter type byte when writing) */
+	unsigned char			filter_mode;		/* one of the PNG_FILTER_MODE_* values */
+	signed char			level;			/* deflate settings, see png_set_compression */
+	unsigned char			strategy;
+	unsigned char			mem_level;
+	unsigned char			window_bits;
+	unsigned char			writing;		/* png_write_begin was called */
+	unsigned char			simd;			/* PNG_SIMD_* value used for unfiltering, see png_set_simd */
 } png_t;
 
 /*
@@ -116,12 +167,47 @@ typedef struct
 		pngalloc - Pointer to custom allocation routine. If 0 is passed, malloc from libc will be used.
 		pngfree - Pointer to custom free routine. If 0 is passed, free from libc will be used.
 
+	The routines are also used for zlib's compression and decompression state.
+
+	png_init also detects the instruction sets the CPU supports (see png_set_simd). It must be called before png
+	structures are used on several threads, and not again while they are.
+
 	Returns:
 		Always returns PNG_NO_ERROR.
 */
 
 int png_init(png_alloc_t pngalloc, png_free_t pngfree);
 
+/*
+	Instruction sets for unfiltering scanlines, see png_set_simd.
+*/
+
+enum
+{
+	PNG_SIMD_NONE			= 0,	/* portable scalar code */
+	PNG_SIMD_SSE2			= 1,
+	PNG_SIMD_SSSE3			= 2
+};
+
+/*
+	Function: png_set_simd
+
+	This function selects the instruction set png uses for unfiltering scanlines; the best one the CPU supports up to
+	level is used. Opening a file for reading selects the best one the CPU supports (as found by png_init), so this
+	only needs to be called between opening and decoding to choose a lesser one. The setting belongs to png alone, so
+	images can be decoded on several threads at once. All of them give the same results, and the scalar code is kept
+	as the reference.
+
+	Parameters:
+		png - Pointer to a png structure opened for reading.
+		level - One of the PNG_SIMD_* values.
+
+	Returns:
+		Always returns PNG_NO_ERROR.
+*/
+
+int png_set_simd(png_t* png, int level);
+
 /*
 	Function: png_open_file
 
@@ -141,6 +227,24 @@ int png_open_file(png_t *png, const char* filename);
 int png_open_file_read(png_t *png, const char* filename);
 int png_open_file_write(png_t *png, const char* filename);
 
+/*
+	Function: png_open_file_mmap
+
+	This function opens a png file for reading like png_open_file_read, but maps the whole file into memory. Chunks are
+	parsed in place and IDAT data is inflated straight from the mapping, without read calls or a copy into a read
+	buffer. Falls back to png_open_file_read where the file can't be mapped (or mmap isn't available). Close with
+	png_close_file.
+
+	Parameters:
+		png - Empty png_t struct.
+		filename - Filename of the file to be opened.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_open_file_mmap(png_t *png, const char* filename);
+
 /*
 	Function: png_open
 
@@ -215,8 +319,256 @@ char* png_error_string(int error);
 
 int png_get_data(png_t* png, unsigned char* data);
 
+/*
+	Function: png_read_rows
+
+	This function decodes the next scanlines of the opened png file. Image data is inflated incrementally and every
+	scanline is handed out as soon as it is complete, so only the previous scanline is kept for unfiltering and the
+	memory used does not depend on the image height. Each decoded scanline takes
+
+	> width*(bytes per pixel)
+
+	bytes, and consecutive scanlines are stored one after the other in data. Call repeatedly until PNG_DONE is returned.
+	No further scanlines can be read after an error.
+
+	Parameters:
+		png - png struct opened for reading.
+		data - Where to store the scanlines, room for at least max_rows of them.
+		max_rows - Maximum number of scanlines to decode.
+		rows_read - Set to the number of scanlines stored in data.
+
+	Returns:
+		PNG_NO_ERROR if there are more scanlines to decode, PNG_DONE once the last scanline has been decoded (this
+		call may still have stored scanlines), otherwise an error code.
+*/
+
+int png_read_rows(png_t* png, unsigned char* data, unsigned max_rows, unsigned* rows_read);
+
+/*
+	Function: png_read_rows_convert
+
+	This function is like png_read_rows, but stores the scanlines in the caller's own layout. Each scanline is
+	unfiltered into pnglite's scanline buffer (allocated with the png_alloc routine, so suitably aligned for any type)
+	and passed through convert, which writes it to its place in data. The unfiltered scanline stays in cache, so the
+	conversion costs no extra pass over the image.
+
+	Parameters:
+		png - png struct opened for reading.
+		data - Where to store the converted scanlines, room for at least max_rows of them.
+		max_rows - Maximum number of scanlines to decode.
+		stride - Distance in bytes between the starts of consecutive scanlines in data.
+		convert - Called with each unfiltered scanline, where to store it in data, and the width in pixels. If 0,
+		          scanlines are stored unchanged.
+		rows_read - Set to the number of scanlines stored in data.
+
+	Returns:
+		As for png_read_rows.
+*/
+
+int png_read_rows_convert(png_t* png, unsigned char* data, unsigned max_rows, size_t stride, png_convert_row_t convert,
+	unsigned* rows_read);
+
+/*
+	Function: png_read_end
+
+	This function releases the decoding state of png_read_rows. It is only needed if decoding is stopped before
+	png_read_rows has returned PNG_DONE or an error, and is also done by png_close_file.
+
+	Parameters:
+		png - png struct opened for reading.
+
+	Returns:
+		PNG_NO_ERROR
+*/
+
+int png_read_end(png_t* png);
+
+/*
+	Function: png_set_data
+
+	This function encodes a whole image and writes it to the png opened for writing. It is the same as calling
+	png_write_begin, png_write_rows with all scanlines, and png_write_end.
+
+	Parameters:
+		png - png struct opened for writing.
+		width - Image width in pixels.
+		height - Image height in pixels.
+		depth - Bits per channel.
+		color - Color type, one of the PNG_* color storage values.
+		data - Scanlines of the image, each width*(bytes per pixel) bytes.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
 int png_set_data(png_t* png, unsigned width, unsigned height, char depth, int color, unsigned char* data);
 
+/*
+	Function: png_set_filter_mode
+
+	This function sets how the scanlines of the images written to png are filtered. For each scanline, the filter type
+	giving the smallest sum of absolute (signed) filtered byte values is used. PNG_FILTER_MODE_FAST only tries the
+	none, sub and up filters, PNG_FILTER_MODE_ADAPTIVE also tries average and paeth, and PNG_FILTER_MODE_NONE does
+	not filter at all. png_open_write selects PNG_FILTER_MODE_ADAPTIVE.
+
+	Parameters:
+		png - png struct opened for writing.
+		mode - One of the PNG_FILTER_MODE_* values.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_set_filter_mode(png_t* png, int mode);
+
+/*
+	Function: png_check_filter_mode
+
+	This function checks a filter mode the way png_set_filter_mode does, without changing any png struct, so that
+	settings can be validated before a file is opened for writing.
+
+	Parameters:
+		mode - One of the PNG_FILTER_MODE_* values.
+
+	Returns:
+		PNG_NO_ERROR if png_set_filter_mode would accept the mode, otherwise PNG_WRONG_ARGUMENTS.
+*/
+
+int png_check_filter_mode(int mode);
+
+/*
+	Function: png_set_compression
+
+	This function sets how the image data written to png is deflated. png_open_write selects the zlib defaults
+	(level -1, PNG_STRATEGY_DEFAULT, mem_level 8, window_bits 15.)
+
+	Parameters:
+		png - png struct opened for writing.
+		level - Compression level from 0 (none) to 9 (best), or -1 for the zlib default (6).
+		strategy - One of the PNG_STRATEGY_* values.
+		mem_level - Memory used for the compression state, from 1 to 9.
+		window_bits - Base two logarithm of the window size, from 9 to 15.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_set_compression(png_t* png, int level, int strategy, int mem_level, int window_bits);
+
+/*
+	Function: png_check_compression
+
+	This function checks deflate settings the way png_set_compression does, without changing any png struct.
+
+	Parameters:
+		level, strategy, mem_level, window_bits - As for png_set_compression.
+
+	Returns:
+		PNG_NO_ERROR if png_set_compression would accept the settings, otherwise PNG_WRONG_ARGUMENTS.
+*/
+
+int png_check_compression(int level, int strategy, int mem_level, int window_bits);
+
+/*
+	Function: png_write_begin
+
+	This function starts writing an image to the png opened for writing, scanline by scanline. The header is written
+	immediately. Scanlines passed to png_write_rows are deflated incrementally and written as IDAT chunks of a fixed
+	size as the compressed data becomes available, so the memory used does not depend on the image height.
+
+	Parameters:
+		png - png struct opened for writing.
+		width - Image width in pixels.
+		height - Image height in pixels.
+		depth - Bits per channel.
+		color - Color type, one of the PNG_* color storage values.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_write_begin(png_t* png, unsigned width, unsigned height, char depth, int color);
+
+/*
+	Function: png_write_rows
+
+	This function encodes the next scanlines of the image started with png_write_begin.
+
+	Parameters:
+		png - png struct being written.
+		data - Scanlines to write, each width*(bytes per pixel) bytes, one after the other.
+		num_rows - Number of scanlines in data.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code. Writing can't continue after an error.
+*/
+
+int png_write_rows(png_t* png, unsigned char* data, unsigned num_rows);
+
+/*
+	Function: png_write_rows_convert
+
+	This function is like png_write_rows, but reads the scanlines in the caller's own layout. Each one is passed through
+	convert, which writes it as PNG scanline bytes into pnglite's scanline buffer, so that no converted copy of the image
+	is needed.
+
+	Parameters:
+		png - png struct being written.
+		data - Scanlines to write, in the caller's layout.
+		num_rows - Number of scanlines in data.
+		stride - Distance in bytes between the starts of consecutive scanlines in data.
+		convert - Called with each scanline, the buffer to write its width*(bytes per pixel) PNG bytes to, and the
+		          width in pixels. If 0, scanlines are copied unchanged.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code. Writing can't continue after an error.
+*/
+
+int png_write_rows_convert(png_t* png, const unsigned char* data, unsigned num_rows, size_t stride, png_convert_row_t convert);
+
+/*
+	Function: png_write_end
+
+	This function finishes the image started with png_write_begin, writing the last IDAT chunk and the IEND chunk, and
+	releases the encoding state. All scanlines must have been written.
+
+	Parameters:
+		png - png struct being written.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_write_end(png_t* png);
+
+/*
+	Function: png_write_rows_parallel
+
+	This function encodes all scanlines of the image started with png_write_begin and finishes it, like
+	png_write_rows_convert for every scanline followed by png_write_end, but splits the scanlines into bands which are
+	filtered and deflated concurrently. The bands are joined into a single zlib stream (with sync flushes between
+	them), one IDAT chunk per band, so the result is a standard PNG. The output is a little larger than a serial
+	encode's, by a few bytes per band.
+
+	The bands are handed out as tasks through run, which must call task(arg, i) once for every i in [0, num_tasks),
+	on any threads, and return when all calls have finished. The tasks only share read access to png and data.
+
+	Parameters:
+		png - png struct being written, with no scanlines written yet.
+		data - Scanlines to write, in the caller's layout.
+		stride - Distance in bytes between the starts of consecutive scanlines in data.
+		convert - As for png_write_rows_convert, may be 0. Called from the tasks, so it must be thread safe.
+		num_bands - Number of bands to split the image into (more are used for huge images).
+		run - Function running the tasks.
+		runner - First argument passed to run.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_write_rows_parallel(png_t* png, const unsigned char* data, size_t stride, png_convert_row_t convert,
+	unsigned num_bands, png_run_tasks_t run, void* runner);
+
 /*
 	Function: png_close_file
 